@@ -26,6 +26,7 @@
 #include <vector>
 
 #include "audioreader.h"
+#include "audiokern.h"
 #include "wavreader.h"
 #include "fiforeader.h"
 #include "log.h"
@@ -113,25 +114,5 @@ AudioReader *openAudio(const string& fn, const string& audioparams,
 void swapSamples(unsigned char *data, int bytesPerSamp, int scount)
 {
     //LOGDEB("swapSamples: bps " << bytesPerSamp << " count " << scount << endl);
-    if (bytesPerSamp == 2) {
-        swab(data, data, scount * 2);
-    } else {
-        unsigned char sample[4];
-        // Byte index in data buffer
-        unsigned int pindex = 0;
-    
-        while (scount-- > 0) {
-            int sindex = 0;
-            while (sindex < bytesPerSamp) {
-                sample[sindex++] = data[pindex++];
-            }
-            
-            sindex = 0;
-            while (sindex < bytesPerSamp) {
-                data[--pindex] = sample[sindex++];
-            }
-            
-            pindex += bytesPerSamp;
-        }
-    }
+    bswapSamplesInPlace(data, size_t(scount) * bytesPerSamp, 8 * bytesPerSamp);
 }
@@ -31,8 +31,13 @@
 #define BSWAP16(X) (X)
 #endif
 
+#include <unistd.h>
+
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <vector>
 #include <alsa/asoundlib.h>
 
 #include <samplerate.h>
@@ -40,29 +45,111 @@
 #include "log.h"
 #include "rcvqueue.h"
 #include "conftree.h"
+#include "chrono.h"
+#include "coalesce.h"
+#include "msgpool.h"
+#include "histo.h"
+#include "driftcache.h"
 
 using namespace std;
 
 #ifndef MIN
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #endif
+#ifndef MAX
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+#endif
 
 // The queue for audio blocks ready for alsa. This is the maximum size
 // before enqueuing blocks
 static const unsigned int qs_hi = 100;
+// The queue is also bounded by the duration of the queued audio
+// (scalsaqueuems). The messages are coalesced (see coalesce.h) and
+// their size depends on the stream, so the count is only a safety
+// limit.
+static const unsigned int alsaqueuems = 1000;
 
 // Queue size target including alsa buffers. There is no particular
 // reason for the qs_hi/2 value. We could try something lower to
 // minimize latency
 static const unsigned int qstarg = qs_hi/2;
 
+// Fast start (scstartms): we start playing with a smaller queue, and
+// the rate control then grows its target to the normal size by
+// running at most this much faster than nominal. 0.2% is about 3.5
+// cents, which should not be noticeable.
+static const double startramp = 0.002;
+
 static WorkQueue<AudioMessage*> alsaqueue("alsaqueue", qs_hi);
+// Max messages the writer takes from alsaqueue at once. When it runs
+// behind, it catches up without going through the lock for each.
+static const unsigned int writerbatch = 8;
+// Incremented by the eater before it discards the alsaqueue
+// contents. The writer then also drops the audio it already took,
+// up to the flush message.
+static std::atomic<unsigned int> alsaflushgen(0);
+// Audio duration (uS) the writer waits for before starting: the
+// current queue target.
+static std::atomic<unsigned int> alsastartus(0);
+// Frames currently in alsaqueue. With the alsa delay, this tells when
+// a new buffer will be played.
+static std::atomic<long> alsaqframes(0);
 
 /* This is used to disable sample rate conversion until playing is actually 
    started */
 static bool qinit = false;
 
+// Synchronized playout: the messages have a scheduled play time
+// (m_playat), which we use instead of the queue depth for starting
+// and for the rate control.
+static std::atomic<bool> syncplay(false);
+// Max lateness before we drop data instead of adjusting the rate
+static const long long maxlateus = 100000;
+// Time constant for the timestamp error correction: an error of
+// this value yields a rate adjustment of 100%. The adjustment is
+// clamped to +-10%.
+static const double synctcus = 2000000.0;
+// Synchronized start: max play time beyond the sender latency (for
+// the transit estimate errors), and sleep slice.
+static const long long startmarginus = 200000;
+static const long long startsliceus = 10000;
+
+// Idle mode: the input has been silent for a while. The eater
+// bypasses the resampler and the rate control, and, if idlestop is
+// set, the writer stops the alsa stream when the queue is empty.
+static std::atomic<bool> alsaidle(false);
+static bool idlestop = false;
+
+// Copy of the last frames written to alsa, for the fade-out when
+// flushing. Indexed by frame count modulo the size.
+static std::vector<short> alsahist;
+static unsigned long long alsahisttotal;
+static unsigned int alsachans;
+// Flush: fade-out duration, and margin kept ahead of the hardware
+// position when rewinding
+static const unsigned int flushfadems = 5;
+static const unsigned int flushguardms = 2;
+
 static snd_pcm_t *pcm;
+static string alsadevice("default");
+// Format changes: the writer reconfigures the device when it gets
+// the reconfig message. Set until this is done: the eater must not
+// access the device meanwhile.
+static std::atomic<bool> alsareconf(false);
+// Set by alsadispose() when a flush discards an in-band reconfig
+// message, which the eater must then queue again. Eater thread only.
+static bool alsareconfdropped = false;
+// Drop the old format data instead of playing it out
+static bool reconfdrop = false;
+// Actual rate, buffer and period sizes
+static unsigned int alsarate = 44100;
+static snd_pcm_uframes_t alsabufferframes;
+static std::atomic<unsigned int> alsaperiodframes(0);
+// Status timestamps are from the monotonic clock
+static bool alsatsmono = false;
+// Format the device is open for (0 if not open). It is possibly
+// opened before we get any data (scpreopenfreq).
+static unsigned int alsaopenfreq, alsaopenchans;
 
 // A period is data processed between interrupts. When playing,
 // there is one period belonging to the hardware and normally
@@ -77,29 +164,377 @@ static snd_pcm_t *pcm;
 // 200mS at 44.1 Khz
 //
 // These may be changed depending on local alsa caps:
-static snd_pcm_uframes_t periodsize = 16384; /* Periodsize (bytes) */
+static const snd_pcm_uframes_t dflperiodsize = 16384;
+static snd_pcm_uframes_t periodsize = dflperiodsize; /* Periodsize (bytes) */
 static unsigned int periods = 2;       /* Number of periods */
 
+// Current in-driver delay in samples
+static int alsadelay()
+{
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(pcm, &delay) >= 0) {
+        return delay;
+    } else {
+        return 0;
+    }
+}
+
+// Local monotonic time (uS) at which a frame written now would be
+// played.
+static long long alsaplaytime()
+{
+    if (alsatsmono) {
+        snd_pcm_status_t *status;
+        snd_pcm_status_alloca(&status);
+        if (snd_pcm_status(pcm, status) == 0 &&
+            snd_pcm_status_get_state(status) == SND_PCM_STATE_RUNNING) {
+            snd_htimestamp_t ts;
+            snd_pcm_status_get_htstamp(status, &ts);
+            if (ts.tv_sec || ts.tv_nsec) {
+                return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 +
+                    snd_pcm_status_get_delay(status) * 1000000LL / alsarate;
+            }
+        }
+    }
+    return Chrono::monomicros() + alsadelay() * 1000000LL / alsarate;
+}
+
+// Write to alsa, and keep a copy of the data
+static snd_pcm_sframes_t alsawritei(const char *buf, snd_pcm_uframes_t frames,
+                                    unsigned int chans)
+{
+    snd_pcm_sframes_t ret = snd_pcm_writei(pcm, buf, frames);
+    if (ret <= 0) {
+        return ret;
+    }
+    size_t histframes = MAX(alsabufferframes, 1);
+    if (chans != alsachans || alsahist.size() != histframes * chans) {
+        alsachans = chans;
+        alsahist.assign(histframes * chans, 0);
+    }
+    const short *sp = (const short *)buf;
+    for (snd_pcm_sframes_t f = 0; f < ret; f++) {
+        size_t idx = size_t((alsahisttotal + f) % histframes) * chans;
+        memcpy(&alsahist[idx], sp + f * chans, chans * sizeof(short));
+    }
+    alsahisttotal += ret;
+    return ret;
+}
+
+// Write frames of silence
+static bool alsasilence(unsigned int chans, snd_pcm_uframes_t frames)
+{
+    static short zeros[1024];
+    snd_pcm_uframes_t chunk = (sizeof(zeros) / sizeof(short)) / chans;
+    while (frames > 0) {
+        snd_pcm_uframes_t cnt = MIN(chunk, frames);
+        if (alsawritei((const char *)zeros, cnt, chans) !=
+            snd_pcm_sframes_t(cnt)) {
+            return false;
+        }
+        frames -= cnt;
+    }
+    return true;
+}
+
+// Stop playing what's in the alsa buffer, as fast as possible
+// without a click: rewind to just ahead of the hardware position,
+// rewrite a short fade-out from our copy of the data, and let it
+// drain. If we can't rewind, just drop the data.
+static void alsaflush()
+{
+    snd_pcm_sframes_t delay = 0;
+    snd_pcm_sframes_t guard = flushguardms * alsarate / 1000;
+    snd_pcm_sframes_t fade = flushfadems * alsarate / 1000;
+    bool drain = false;
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING && alsachans &&
+        snd_pcm_delay(pcm, &delay) == 0) {
+        if (delay <= guard + fade) {
+            drain = true;
+        } else {
+            snd_pcm_sframes_t n = snd_pcm_rewindable(pcm);
+            if (n > delay - guard)
+                n = delay - guard;
+            if (n > 0)
+                n = snd_pcm_rewind(pcm, n);
+            if (n > 0) {
+                alsahisttotal -= n;
+                size_t histframes = alsahist.size() / alsachans;
+                fade = MIN(fade, n);
+                vector<short> buf(fade * alsachans);
+                for (snd_pcm_sframes_t f = 0; f < fade; f++) {
+                    float g = 1.0f - float(f + 1) / (fade + 1);
+                    size_t idx = size_t((alsahisttotal + f) % histframes) *
+                        alsachans;
+                    for (unsigned int c = 0; c < alsachans; c++) {
+                        short v = BSWAP16(alsahist[idx + c]);
+                        buf[f * alsachans + c] = BSWAP16(short(v * g));
+                    }
+                }
+                drain = alsawritei((const char *)&buf[0], fade, alsachans) ==
+                    fade;
+            }
+        }
+    }
+    LOGDEB("alsawriter: flush, delay " << delay << (drain ? " fade" : " drop")
+           << endl);
+    if (drain) {
+        snd_pcm_drain(pcm);
+    } else {
+        snd_pcm_drop(pcm);
+    }
+    snd_pcm_prepare(pcm);
+    qinit = false;
+}
+
+// Ask the writer to reconfigure the device. If the queued data is
+// discarded anyway, the message goes on the control lane, else it
+// follows the data in the old format.
+static bool queuereconfig(unsigned int freq, unsigned int chans, bool ctl)
+{
+    AudioMessage *rm = new AudioMessage(16, chans, 0, freq, 0, 0);
+    rm->m_reconfig = true;
+    alsareconf = true;
+    return ctl ? alsaqueue.putControl(rm) : alsaqueue.put(rm);
+}
+
+// alsaqueue weight: message duration in uS. The control messages
+// weigh nothing.
+static size_t alsaweight(AudioMessage *m)
+{
+    if (m->m_flush || m->m_reconfig || m->m_freq == 0)
+        return 0;
+    return size_t(m->frames()) * 1000000 / m->m_freq;
+}
+
+// Disposer for the messages discarded from alsaqueue
+static void alsadispose(AudioMessage *m)
+{
+    if (m->m_reconfig)
+        alsareconfdropped = true;
+    else if (!m->m_flush)
+        alsaqframes -= m->frames();
+    AudioMessage::release(m);
+}
+
+// Discard the messages not yet played, including those already
+// taken by the writer. If fm is set, it is queued on the control
+// lane, so that the writer gets it at once.
+static bool alsaqflush(AudioMessage *fm = 0)
+{
+    alsaflushgen++;
+    if (fm)
+        return alsaqueue.putControl(fm, true);
+    alsaqueue.flush();
+    return true;
+}
+
+// Normal target queue size in frames: targetms, or qstarg input
+// packets. The default is limited to half the alsaqueue capacity
+// (queuems), else the writer would wait forever for the start level
+// while the eater blocks on the full queue. An explicit targetms
+// already raised the capacity.
+static double targetframes(int targetms, unsigned int queuems,
+                           int bufframes, unsigned int freq)
+{
+    if (targetms > 0)
+        return targetms * freq / 1000.0;
+    return MIN(double(qstarg * bufframes), queuems * freq / 2000.0);
+}
+
+// Synchronized start: wait, then write silence so that the first
+// frame of tsk plays at tsk->m_playat. Returns the count of frames
+// to skip at the start of tsk if we are a bit late, or -1 if the
+// message is too late and should be dropped, or if a flush came
+// while we were waiting (flushgen changed).
+//
+// The play time is normally at most the sender latency after the
+// arrival: anything further comes from bad timestamps, and we start
+// unsynchronized instead of sleeping on.
+static long alsastartat(AudioMessage *tsk, unsigned int flushgen)
+{
+    long long msgus = tsk->frames() * 1000000LL / alsarate;
+    long long bufferus = alsabufferframes * 1000000LL / alsarate;
+    long long now = Chrono::monomicros();
+    long long lead = tsk->m_playat - alsaplaytime();
+    if (lead < -msgus) {
+        return -1;
+    }
+    if (tsk->m_playat - now > tsk->m_latencyus + startmarginus) {
+        LOGINF("alsawriter: play time " << (tsk->m_playat - now) / 1000 <<
+               " mS ahead with latency " << tsk->m_latencyus / 1000 <<
+               " mS: not synchronizing the start\n");
+        return 0;
+    }
+    // Don't fill the alsa buffer with silence: sleep first, in slices
+    // so that a flush is not kept waiting.
+    while (lead > bufferus / 2) {
+        if (flushgen != alsaflushgen) {
+            return -1;
+        }
+        usleep(MIN(lead - bufferus / 2, startsliceus));
+        lead = tsk->m_playat - alsaplaytime();
+    }
+    LOGDEB("alsawriter: synchronized start, lead " << lead << " uS\n");
+    if (lead > 0) {
+        if (!alsasilence(tsk->m_chans, lead * alsarate / 1000000)) {
+            return -1;
+        }
+        return 0;
+    }
+    return long(-lead * alsarate / 1000000);
+}
+
+static bool alsa_init(const string& dev, AudioMessage *tsk);
+
+// Format change: play or drop what's in the device, and reopen it
+// with the new parameters.
+static bool alsareconfig(AudioMessage *tsk)
+{
+    Chrono chron;
+    if (reconfdrop) {
+        snd_pcm_drop(pcm);
+    } else {
+        snd_pcm_drain(pcm);
+    }
+    int drainms = chron.millis();
+    snd_pcm_close(pcm);
+    pcm = 0;
+    alsaopenfreq = alsaopenchans = 0;
+    qinit = false;
+    bool ok = alsa_init(alsadevice, tsk);
+    LOGINF("alsawriter: reconfigured for " << tsk->m_freq << " Hz " <<
+           tsk->m_chans << " channels in " << chron.millis() << " mS (" <<
+           (reconfdrop ? "drop " : "drain ") << drainms << " mS)\n");
+    alsareconf = false;
+    return ok;
+}
+
+// Underrun prevention: while playing, the writer waits for data at
+// most until the alsa buffer is down to underrunguardms, and then
+// writes underrunfillms of silence. The rate control sees the extra
+// delay and slows down. After maxfillms of consecutive silence, the
+// sender is probably gone: we stop filling and let the stream
+// underrun as it used to.
+static const unsigned int underrunguardms = 5;
+static const unsigned int underrunfillms = 10;
+static const unsigned int maxfillms = 500;
+// Consecutive silence frames written by alsawaitdata()
+static unsigned long fillframes;
+static unsigned long fillevents;
+
+// Wait for the queue to be non-empty. Returns false if it is gone.
+static bool alsawaitdata()
+{
+    for (;;) {
+        long long delayus = alsadelay() * 1000000LL / alsarate;
+        long long deadline = Chrono::monomicros() + delayus -
+            underrunguardms * 1000;
+        switch (alsaqueue.waitminsz(1, wqDeadline(deadline))) {
+        case WorkQueue<AudioMessage*>::WQ_OK:
+            return true;
+        case WorkQueue<AudioMessage*>::WQ_FAILED:
+            return false;
+        case WorkQueue<AudioMessage*>::WQ_TIMEOUT:
+            break;
+        }
+        if (alsachans == 0 || fillframes >= maxfillms * alsarate / 1000) {
+            return alsaqueue.waitminsz(1);
+        }
+        unsigned int frames = underrunfillms * alsarate / 1000;
+        if (!alsasilence(alsachans, frames)) {
+            return alsaqueue.waitminsz(1);
+        }
+        if (fillframes == 0) {
+            fillevents++;
+            LOGDEB("alsawriter: input late, inserting silence (" <<
+                   fillevents << " times)\n");
+        }
+        fillframes += frames;
+    }
+}
+
 static void *alsawriter(void *p)
 {
+    AudioMessage *batch[writerbatch];
+    size_t nbatch = 0, ibatch = 0;
+    unsigned int flushgen = 0;
     while (true) {
-        if (!qinit) {
-            if (!alsaqueue.waitminsz(qstarg)) {
-                LOGERR("alsawriter: waitminsz failed\n");
+        if (ibatch == nbatch) {
+            if (!qinit && !syncplay) {
+                if (!alsaqueue.waitminweight(alsastartus)) {
+                    LOGERR("alsawriter: waitminweight failed\n");
+                    alsaqueue.workerExit();
+                    return (void *)1;
+                }
+            } else if (qinit && !alsaidle && !alsareconf) {
+                if (!alsawaitdata()) {
+                    LOGERR("alsawriter: waitminsz failed\n");
+                    alsaqueue.workerExit();
+                    return (void *)1;
+                }
+            }
+            flushgen = alsaflushgen;
+            size_t qsz;
+            // Only take one message while starting: the start
+            // depends on the queue size.
+            nbatch = alsaqueue.takeUpTo(batch, qinit ? writerbatch : 1, &qsz);
+            if (nbatch == 0) {
+                // TBD: reset alsa?
+                alsaqueue.workerExit();
+                return (void*)1;
+            }
+            ibatch = 0;
+            long long now = Chrono::monomicros();
+            for (size_t i = 0; i < nbatch; i++) {
+                batch[i]->m_stamps[AudioMessage::STG_ALSADEQUEUE] = now;
+            }
+        }
+        // The control messages have no format: test them before
+        // looking at the frames.
+        AudioMessage *tsk = batch[ibatch++];
+        if (tsk->m_flush) {
+            // What follows was queued after the flush (the eater
+            // puts a reconfig message after its flush too). The
+            // control lane brought us the message ahead of the
+            // discarded data.
+            flushgen = alsaflushgen;
+            alsaflush();
+            AudioMessage::release(tsk);
+            continue;
+        }
+        if (tsk->m_reconfig) {
+            flushgen = alsaflushgen;
+            bool ok = alsareconfig(tsk);
+            AudioMessage::release(tsk);
+            if (!ok) {
                 alsaqueue.workerExit();
                 return (void *)1;
             }
+            continue;
         }
-        AudioMessage *tsk = 0;
-        size_t qsz;
-        if (!alsaqueue.take(&tsk, &qsz)) {
-            // TBD: reset alsa?
-            alsaqueue.workerExit();
-            return (void*)1;
+        // The frames count as queued until they are written: the
+        // rate control looks at alsaqframes plus the alsa delay.
+        alsaqframes -= tsk->frames();
+        if (flushgen != alsaflushgen) {
+            // Taken before a flush
+            AudioMessage::release(tsk);
+            continue;
         }
         // Bufs 
         snd_pcm_uframes_t frames = tsk->frames();
-        snd_pcm_sframes_t ret =  snd_pcm_writei(pcm, tsk->m_buf, frames);
+        const char *buf = tsk->m_buf;
+        if (!qinit && tsk->m_playat) {
+            long skip = alsastartat(tsk, flushgen);
+            if (skip < 0 || skip >= long(frames)) {
+                LOGDEB("alsawriter: late message dropped\n");
+                AudioMessage::release(tsk);
+                continue;
+            }
+            frames -= skip;
+            buf += skip * tsk->m_chans * (tsk->m_bits / 8);
+        }
+        snd_pcm_sframes_t ret =  alsawritei(buf, frames, tsk->m_chans);
         if (ret != int(frames)) {
             LOGERR("snd-cm_writei(" << frames <<" frames) failed: ret: " <<
                    ret << endl);
@@ -109,8 +544,21 @@ static void *alsawriter(void *p)
             }
         } else {
             qinit = true;
+            fillframes = 0;
+            tsk->m_stamps[AudioMessage::STG_WRITTEN] = Chrono::monomicros();
+            latencyRecord(tsk);
+            latencyFirstSample(tsk);
+        }
+        AudioMessage::release(tsk);
+        if (idlestop && alsaidle && ibatch == nbatch &&
+            alsaqueue.qsize() == 0) {
+            // Only silence remains in the alsa buffer: no need to
+            // play it. We restart as usual when data comes back.
+            LOGDEB("alsawriter: idle, stopping the stream\n");
+            snd_pcm_drop(pcm);
+            snd_pcm_prepare(pcm);
+            qinit = false;
         }
-        delete tsk;
     }
 }
 
@@ -121,17 +569,21 @@ static bool alsa_init(const string& dev, AudioMessage *tsk)
     const char *cmd = "";
     int dir=0;
     unsigned int actual_rate = tsk->m_freq;
+    periodsize = dflperiodsize;
+    alsaopenfreq = alsaopenchans = 0;
 
     if ((err = snd_pcm_open(&pcm, dev.c_str(), 
                             SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
         LOGERR("alsa_init: snd_pcm_open " << dev << " " << 
                snd_strerror(err) << endl);
-        return false;;
+        pcm = 0;
+        return false;
     }
     if ((err = snd_pcm_hw_params_malloc(&hwparams)) < 0) {
         LOGERR("alsa_init: snd_pcm_hw_params_malloc " << 
                snd_strerror(err) << endl);
         snd_pcm_close(pcm);
+        pcm = 0;
         return false;
     }
 
@@ -196,33 +648,56 @@ static bool alsa_init(const string& dev, AudioMessage *tsk)
     if ((err = snd_pcm_hw_params(pcm, hwparams)) < 0) {
         goto error;
     }
+    alsarate = actual_rate;
+    alsabufferframes = bufferframes;
+    {
+        snd_pcm_uframes_t pframes = 0;
+        snd_pcm_hw_params_get_period_size(hwparams, &pframes, &dir);
+        alsaperiodframes = pframes;
+        LOGDEB("Alsa: period size " << pframes << " frames\n");
+    }
+
+    // Ask for monotonic status timestamps, for the synchronized
+    // playout. Not fatal.
+    {
+        snd_pcm_sw_params_t *swparams;
+        snd_pcm_sw_params_alloca(&swparams);
+        alsatsmono = false;
+        if (snd_pcm_sw_params_current(pcm, swparams) == 0 &&
+            snd_pcm_sw_params_set_tstamp_mode(pcm, swparams,
+                                              SND_PCM_TSTAMP_ENABLE) == 0
+#if SND_LIB_VERSION >= 0x01001d
+            && snd_pcm_sw_params_set_tstamp_type(
+                pcm, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0
+#endif
+            && snd_pcm_sw_params(pcm, swparams) == 0) {
+#if SND_LIB_VERSION >= 0x01001d
+            alsatsmono = true;
+#endif
+        }
+        LOGDEB("Alsa: rate " << alsarate << " monotonic timestamps " <<
+               alsatsmono << endl);
+    }
         
     snd_pcm_hw_params_free(hwparams);
+    alsaopenfreq = tsk->m_freq;
+    alsaopenchans = tsk->m_chans;
     return true;
 
 error:
     LOGERR("alsa_init: " << cmd << " error:" << snd_strerror(err) << endl);
     snd_pcm_hw_params_free(hwparams);
+    snd_pcm_close(pcm);
+    pcm = 0;
     return false;
 }
 
-// Current in-driver delay in samples
-static int alsadelay()
-{
-    snd_pcm_sframes_t delay;
-    if (snd_pcm_delay(pcm, &delay) >= 0) {
-        return delay;
-    } else {
-        return 0;
-    }
-}
-
 class Filter {
 public:
 #define FNS 128
-    Filter() : old(0.0), sum(0.0), idx(0) {
+    Filter(double init = 1.0) : old(0.0), sum(0.0), idx(0) {
         for (int i = 0; i < FNS; i++) {
-            buf[i] = 1.0;
+            buf[i] = init;
             sum += buf[i];
         }
     }
@@ -234,6 +709,10 @@ public:
         sum -= buf[idx];
         return sum/FNS;
     }
+    // Current value, without adding a new one
+    double value() {
+        return sum/FNS;
+    }
     double old;
     double buf[FNS];
     double sum;
@@ -285,10 +764,71 @@ static void *audioEater(void *cls)
     LOGDEB("audioEater: alsadirect. Will use converter type " << 
            cvt_type << endl);
 
-    string alsadevice("default");
+    alsadevice = "default";
     ctxt->config->get("scalsadevice", alsadevice);    
 
-    WorkQueue<AudioMessage*> *queue = ctxt->queue;
+    // Seconds of digital silence before we go idle. 0 disables
+    int idlesecs = 5;
+    string value;
+    if (ctxt->config->get("scidlesecs", value)) {
+        idlesecs = atoi(value.c_str());
+    }
+    idlestop = false;
+    if (ctxt->config->get("scidlestop", value)) {
+        idlestop = atoi(value.c_str()) != 0;
+    }
+    reconfdrop = false;
+    if (ctxt->config->get("scformatdrop", value)) {
+        reconfdrop = atoi(value.c_str()) != 0;
+    }
+    // Max duration of the coalesced buffers. 0 disables coalescing
+    int coalescems = 50;
+    if (ctxt->config->get("sccoalescems", value)) {
+        coalescems = atoi(value.c_str());
+    }
+    // Queue size target (alsaqueue and alsa buffer), in mS. 0 means
+    // qstarg input packets.
+    int targetms = 0;
+    if (ctxt->config->get("sctargetms", value)) {
+        targetms = atoi(value.c_str());
+    }
+    unsigned int queuems = alsaqueuems;
+    if (ctxt->config->get("scalsaqueuems", value)) {
+        queuems = atoi(value.c_str());
+    }
+    if (targetms > 0 && queuems < 2 * unsigned(targetms)) {
+        // Leave room above the target for the rate control
+        queuems = 2 * targetms;
+    }
+    alsaqueue.setWeight(alsaweight, queuems * 1000);
+    alsaqueue.setDisposer(alsadispose);
+    // Initial queue size for starting to play, in mS. 0 means the
+    // normal target size.
+    int startms = 0;
+    if (ctxt->config->get("scstartms", value)) {
+        startms = atoi(value.c_str());
+    }
+    // Open the device in advance for this rate (stereo), so that it's
+    // ready when the data comes. 0 disables.
+    unsigned int preopenfreq = 44100;
+    if (ctxt->config->get("scpreopenfreq", value)) {
+        preopenfreq = atoi(value.c_str());
+    }
+    // Stored clock ratios. An empty value disables
+    string driftfn("/var/cache/upmpdcli/scdrift");
+    ctxt->config->get("scdriftcache", driftfn);
+    string drifturi = senderUri();
+    DriftCache drift(driftfn, alsadevice, drifturi);
+    alsaperiodframes = 0;
+    alsastartus = 0;
+    alsareconf = false;
+    alsaidle = false;
+    // Count of consecutive silent frames
+    unsigned long silentframes = 0;
+
+    AudioQueue *queue = ctxt->queue;
+    // The batches should fit in the pool blocks
+    unsigned int poolbytes = ctxt->pool ? ctxt->pool->payloadBytes() : 0;
 
     delete ctxt;
     ctxt = 0;
@@ -296,6 +836,9 @@ static void *audioEater(void *cls)
     qinit = false;
 
     double samplerate_ratio = 1.0;
+    // Nominal sender/DAC clock ratio, from the drift cache. The
+    // controller only corrects around it.
+    double drift_ratio = 1.0;
     Filter filter;
 
     int src_error = 0;
@@ -306,37 +849,153 @@ static void *audioEater(void *cls)
     // twice the size for output (allocated on first use).
     size_t src_input_bytes = 0;
     
+    alsaopenfreq = alsaopenchans = 0;
+    if (preopenfreq) {
+        AudioMessage fmt(16, 2, 0, preopenfreq, 0, 0);
+        Chrono chron;
+        if (alsa_init(alsadevice, &fmt)) {
+            LOGDEB("audioEater:alsa: device opened in " << chron.millis() <<
+                   " mS\n");
+        } else {
+            // We'll try again with the stream format
+            LOGERR("audioEater:alsa: can't pre-open " << alsadevice <<
+                   " at " << preopenfreq << " Hz\n");
+        }
+    }
+
     alsaqueue.start(1, alsawriter, 0);
 
     // Integral term. We do not use it at the moment
     // double it = 0;
 
-    // Number of frames per buffer. This is mostly constant for a
-    // given stream (depends on fe and buffer time, Windows Songcast
+    // Number of frames per input packet. This is mostly constant for
+    // a given stream (depends on fe and buffer time, Windows Songcast
     // buffers are 10mS, so 441 frames at cd q). Recomputed on first
     // buf, the init is to avoid warnings
     int bufframes = 441;
+    // Normal target queue size in frames: targetms, or qstarg input
+    // packets.
+    double normtargframes = qstarg * bufframes;
+    // Current target queue size in frames. Less than normtargframes
+    // after a fast start.
+    double qtargframes = normtargframes;
+
+    // The small network packets are batched into buffers of about
+    // the alsa period size, up to coalescems. We process the ready
+    // buffers from the coalescer before taking more input. A partial
+    // batch is released if no input comes for coalescems (the sender
+    // stalled or paused).
+    Coalescer coalescer;
+    coalescer.setMaxBytes(poolbytes);
+    deque<AudioMessage*> ready;
+    // Input queue closed: process what's ready, then exit
+    bool inputdone = false;
+    // Current input format
+    unsigned int src_freq = 0, src_chans = 0;
 
     while (true) {
         AudioMessage *tsk = 0;
-        size_t qsz;
-        if (!queue->take(&tsk, &qsz)) {
-            LOGDEB("audioEater: alsadirect: queue take failed\n");
-            alsaqueue.setTerminateAndWait();
-            queue->workerExit();
-            return (void*)1;
+        if (ready.empty()) {
+            if (inputdone) {
+                // Play out what is queued if we are playing, then let
+                // the device drain.
+                if (qinit)
+                    alsaqueue.waitIdle();
+                alsaqueue.setTerminateAndWait();
+                if (pcm)
+                    snd_pcm_drain(pcm);
+                queue->workerExit();
+                return (void*)1;
+            }
+            size_t qsz;
+            AudioQueue::WaitStatus st;
+            if (coalescer.holding()) {
+                st = queue->take(&tsk, wqDeadline(Chrono::monomicros() +
+                                                  coalescems * 1000), &qsz);
+            } else {
+                st = queue->take(&tsk, &qsz) ? AudioQueue::WQ_OK :
+                    AudioQueue::WQ_FAILED;
+            }
+            if (st == AudioQueue::WQ_TIMEOUT) {
+                coalescer.drain(ready);
+                continue;
+            }
+            if (st != AudioQueue::WQ_OK) {
+                LOGDEB("audioEater: alsadirect: queue take failed\n");
+                // End of input: the partial batch goes out first
+                inputdone = true;
+                coalescer.drain(ready);
+                continue;
+            }
+            tsk->m_stamps[AudioMessage::STG_DEQUEUE] = Chrono::monomicros();
+            unsigned int target = coalescems * tsk->m_freq / 1000;
+            if (alsaperiodframes && alsaperiodframes < target)
+                target = alsaperiodframes;
+            coalescer.setTarget(target);
+            coalescer.add(tsk, ready);
+            continue;
+        }
+        tsk = ready.front();
+        ready.pop_front();
+
+        if (tsk->m_flush) {
+            // Discard all that's not played yet: the writer handles
+            // the alsa buffer when it gets the flush message.
+            LOGDEB("audioEater:alsa: flush\n");
+            if (src_state == 0) {
+                // Not started
+                AudioMessage::release(tsk);
+                tsk = 0;
+            } else {
+                src_reset(src_state);
+            }
+            // A reconfig message on the control lane survives the
+            // flush, an in-band one is discarded and must be resent.
+            alsareconfdropped = false;
+            if (!alsaqflush(tsk) ||
+                (alsareconfdropped &&
+                 !queuereconfig(src_freq, src_chans, true))) {
+                LOGERR("alsaEater: queue put failed\n");
+                queue->workerExit();
+                return (void *)1;
+            }
+            silentframes = 0;
+            alsaidle = false;
+            if (startms > 0 && src_freq) {
+                qtargframes = MIN(startms * src_freq / 1000.0,
+                                  normtargframes);
+            }
+            if (senderUri() != drifturi) {
+                // Switching senders (daemon mode): restart the rate
+                // control from the new sender's ratio.
+                drifturi = senderUri();
+                drift.setUri(drifturi);
+                if (src_freq) {
+                    drift_ratio = drift.start(src_freq);
+                    filter = Filter(drift_ratio);
+                }
+            }
+            continue;
         }
 
         if (tsk->m_bytes == 0 || tsk->m_chans == 0 || tsk->m_bits == 0) {
             LOGDEB("Zero buf\n");
+            AudioMessage::release(tsk);
             continue;
         }
-
         if (src_state == 0) {
-            if (!alsa_init(alsadevice, tsk)) {
-                alsaqueue.setTerminateAndWait();
-                queue->workerExit();
-                return (void *)1;
+            if (alsaopenfreq != tsk->m_freq || alsaopenchans != tsk->m_chans) {
+                if (alsaopenfreq) {
+                    // Opened in advance for another format
+                    snd_pcm_close(pcm);
+                    pcm = 0;
+                    alsaopenfreq = alsaopenchans = 0;
+                }
+                if (!alsa_init(alsadevice, tsk)) {
+                    alsaqueue.setTerminateAndWait();
+                    queue->workerExit();
+                    return (void *)1;
+                }
             }
             // BEST_QUALITY yields approx 25% cpu on a core i7
             // 4770T. Obviously too much, actually might not be
@@ -347,8 +1006,92 @@ static void *audioEater(void *cls)
             // Rpi: FASTEST is 30% CPU on a Pi2 with USB
             // audio. Curiously it's 25-30% on a Pi1 with i2s audio.
             src_state = src_new(cvt_type, tsk->m_chans, &src_error);
+            drift_ratio = drift.start(tsk->m_freq);
+            filter = Filter(drift_ratio);
 
-            bufframes = tsk->frames();
+            bufframes = coalescer.packetFrames();
+            normtargframes = targetframes(targetms, queuems, bufframes,
+                                          tsk->m_freq);
+            qtargframes = normtargframes;
+            if (startms > 0) {
+                qtargframes = MIN(startms * tsk->m_freq / 1000.0, qtargframes);
+            }
+        } else if (tsk->m_freq != src_freq || tsk->m_chans != src_chans) {
+            // Format change. The writer reconfigures the device after
+            // the old data, we start the new resampler and rate
+            // control from scratch. The sample size does not matter
+            // here: we always output 16 bits.
+            LOGINF("audioEater:alsa: format change from " << src_freq <<
+                   "/" << src_chans << " to " << tsk->m_freq << "/" <<
+                   tsk->m_chans << endl);
+            if (reconfdrop) {
+                alsaqflush();
+            }
+            if (!queuereconfig(tsk->m_freq, tsk->m_chans, reconfdrop)) {
+                LOGERR("alsaEater: queue put failed\n");
+                queue->workerExit();
+                return (void *)1;
+            }
+            src_delete(src_state);
+            src_state = src_new(cvt_type, tsk->m_chans, &src_error);
+            drift_ratio = drift.start(tsk->m_freq);
+            filter = Filter(drift_ratio);
+            silentframes = 0;
+            bufframes = coalescer.packetFrames();
+            normtargframes = targetframes(targetms, queuems, bufframes,
+                                          tsk->m_freq);
+            qtargframes = normtargframes;
+            if (startms > 0) {
+                qtargframes = MIN(startms * tsk->m_freq / 1000.0, qtargframes);
+            }
+        }
+        src_freq = tsk->m_freq;
+        src_chans = tsk->m_chans;
+        alsastartus = (unsigned int)(qtargframes * 1000000 / tsk->m_freq);
+
+        if (idlesecs > 0) {
+            if (tsk->m_silent) {
+                silentframes += tsk->frames();
+            } else {
+                silentframes = 0;
+            }
+            bool idle = silentframes >= (unsigned long)idlesecs * tsk->m_freq;
+            if (idle != alsaidle) {
+                LOGDEB("audioEater:alsa: " << (idle ? "entering" : "leaving")
+                       << " idle mode\n");
+                alsaidle = idle;
+            } else if (idle && idlestop) {
+                // The writer stops after the queue is drained (we
+                // still sent the first idle buffer, so that it wakes
+                // up if it was waiting).
+                AudioMessage::release(tsk);
+                continue;
+            }
+            if (idle) {
+                // No resampling: just send zeros at the nominal
+                // rate. The resampler and the rate filter are not
+                // touched, they resume where they were.
+                unsigned int frames = tsk->frames();
+                if (!tsk->reserve(frames * tsk->m_chans * 2, false)) {
+                    LOGERR("audioEater:alsa: out of memory\n");
+                    alsaqueue.setTerminateAndWait();
+                    queue->workerExit();
+                    return (void *)1;
+                }
+                tsk->m_bytes = frames * tsk->m_chans * 2;
+                memset(tsk->m_buf, 0, tsk->m_bytes);
+                tsk->m_bits = 16;
+                tsk->m_needswap = false;
+                alsaqframes += frames;
+                tsk->m_stamps[AudioMessage::STG_CONVERTED] =
+                    Chrono::monomicros();
+                if (!alsaqueue.put(tsk)) {
+                    LOGERR("alsaEater: queue put failed\n");
+                    queue->workerExit();
+                    return (void *)1;
+                }
+                continue;
+            }
         }
         
         // Computing the samplerate conversion factor. We want to keep
@@ -359,11 +1102,46 @@ static void *audioEater(void *cls)
         // Qsize in frames. This is the variable to control
         double qs;
 
-        if (qinit) {
-            qs = alsaqueue.qsize() * bufframes + alsadelay();
+        // We can't look at the device while it is being reconfigured
+        bool running = qinit && !alsareconf;
+        syncplay = tsk->m_playat != 0;
+        if (running && tsk->m_playat) {
+            // Synchronized playout: the variable is the difference
+            // between the scheduled and the estimated play times for
+            // the first frame of this buffer.
+            qs = alsaqframes + alsadelay();
+            long long playus = alsaplaytime() +
+                alsaqframes * 1000000LL / alsarate;
+            long long errus = tsk->m_playat - playus;
+            if (errus < -maxlateus) {
+                LOGDEB("audioEater:alsa: late by " << -errus << 
+                       " uS, dropping buffer\n");
+                AudioMessage::release(tsk);
+                continue;
+            }
+            samplerate_ratio = drift_ratio + errus / synctcus;
+            if (samplerate_ratio < 0.9) 
+                samplerate_ratio = 0.9;
+            if (samplerate_ratio > 1.1)
+                samplerate_ratio = 1.1;
+            {
+                static int cnt;
+                if (cnt++ == 101) {
+                    LOGDEB("audioEater:alsa: sync error " << errus <<
+                           " uS\n");
+                    cnt = 0;
+                }
+            }
+        } else if (running) {
+            qs = alsaqframes + alsadelay();
             // Error term
-            double qstargframes = qstarg * bufframes;
+            double qstargframes = qtargframes;
             double et =  ((qstargframes - qs) / qstargframes);
+            // Fast start: grow the target towards the normal size.
+            if (qtargframes < normtargframes) {
+                qtargframes = MIN(qtargframes + startramp * tsk->frames(),
+                                  normtargframes);
+            }
 
             // Integral. Not used, made it worse each time I tried.
             // This is probably because our command is actually the
@@ -384,7 +1162,7 @@ static void *audioEater(void *cls)
             // double adj = et * ((et < 0) ? -et : et);
 
             // Computed ratio
-            samplerate_ratio =  1.0 + adj;
+            samplerate_ratio =  drift_ratio + adj;
 
             // Limit extension
             if (samplerate_ratio < 0.9) 
@@ -393,14 +1171,20 @@ static void *audioEater(void *cls)
                 samplerate_ratio = 1.1;
 
         } else {
-            // Starting up, wait for more info
-            qs = alsaqueue.qsize();
-            samplerate_ratio = 1.0;
+            // Starting up, or restarting after an idle period or an
+            // xrun: wait for more info, and keep the previous ratio.
+            qs = alsaqueue.qweight() * tsk->m_freq / 1000000.0;
+            samplerate_ratio = 0;
             // it = 0;
         }
 
         // Average the rate value to eliminate fast oscillations
-        samplerate_ratio = filter(samplerate_ratio);
+        if (samplerate_ratio == 0) {
+            samplerate_ratio = filter.value();
+        } else {
+            samplerate_ratio = filter(samplerate_ratio);
+            drift.sample(samplerate_ratio, tsk->frames());
+        }
 
         unsigned int tot_samples = tsk->samples();
         src_data.input_frames = tsk->frames();
@@ -416,36 +1200,64 @@ static void *audioEater(void *cls)
         src_data.src_ratio = samplerate_ratio;
         src_data.end_of_input = 0;
         
-        // Data always comes in host order, because this is what we
-        // request from upstream. 24 and 32 bits are untested.
+        // Data comes in host order, because this is what we request
+        // from upstream, except in zero-copy mode where we get the
+        // raw msb-first Songcast data, and swap it while converting
+        // (m_needswap). 24 and 32 bits are untested.
         switch (tsk->m_bits) {
         case 16: 
         {
-            const short *sp = (const short *)tsk->m_buf;
-            for (unsigned int i = 0; i < tot_samples; i++) {
-                src_data.data_in[i] = *sp++;
+            if (tsk->m_needswap) {
+                const unsigned char *icp = (const unsigned char *)tsk->m_buf;
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    src_data.data_in[i] = short((icp[0] << 8) | icp[1]);
+                    icp += 2;
+                }
+            } else {
+                const short *sp = (const short *)tsk->m_buf;
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    src_data.data_in[i] = *sp++;
+                }
             }
         }
         break;
         case 24: 
         {
             const unsigned char *icp = (const unsigned char *)tsk->m_buf;
-            int o;
-            unsigned char *ocp = (unsigned char *)&o;
-            for (unsigned int i = 0; i < tot_samples; i++) {
-                ocp[0] = *icp++;
-                ocp[1] = *icp++;
-                ocp[2] = *icp++;
-                ocp[3] = (ocp[2] & 0x80) ? 0xff : 0;
-                src_data.data_in[i] = o;
+            if (tsk->m_needswap) {
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    src_data.data_in[i] = (int((signed char)icp[0]) << 16) |
+                        (icp[1] << 8) | icp[2];
+                    icp += 3;
+                }
+            } else {
+                int o;
+                unsigned char *ocp = (unsigned char *)&o;
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    ocp[0] = *icp++;
+                    ocp[1] = *icp++;
+                    ocp[2] = *icp++;
+                    ocp[3] = (ocp[2] & 0x80) ? 0xff : 0;
+                    src_data.data_in[i] = o;
+                }
             }
         }
         break;
         case 32: 
         {
-            const int *ip = (const int *)tsk->m_buf;
-            for (unsigned int i = 0; i < tot_samples; i++) {
-                src_data.data_in[i] = *ip++;
+            if (tsk->m_needswap) {
+                const unsigned char *icp = (const unsigned char *)tsk->m_buf;
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    src_data.data_in[i] = int((unsigned(icp[0]) << 24) |
+                                              (icp[1] << 16) |
+                                              (icp[2] << 8) | icp[3]);
+                    icp += 4;
+                }
+            } else {
+                const int *ip = (const int *)tsk->m_buf;
+                for (unsigned int i = 0; i < tot_samples; i++) {
+                    src_data.data_in[i] = *ip++;
+                }
             }
         }
         break;
@@ -459,6 +1271,7 @@ static void *audioEater(void *cls)
         int ret = src_process(src_state, &src_data);
         if (ret) {
             LOGERR("src_process: " << src_strerror(ret) << endl);
+            AudioMessage::release(tsk);
             continue;
         }
 
@@ -468,6 +1281,7 @@ static void *audioEater(void *cls)
                 LOGDEB("audioEater:alsa: " 
                        " qstarg " << qstarg <<
                        " iqsz " << alsaqueue.qsize() <<
+                       " iqms " << alsaqueue.qweight() / 1000 <<
                        " qsize " << int(qs/bufframes) << 
                        " ratio " << samplerate_ratio <<
                        " in " << src_data.input_frames << 
@@ -479,18 +1293,15 @@ static void *audioEater(void *cls)
 
         // New number of samples after conversion. We are going to
         // copy them back to the audio buffer, and may need to
-        // reallocate it.
+        // reallocate it. This also gets us a buffer of our own if
+        // the message was pointing to the network data (zero-copy).
         tot_samples =  src_data.output_frames_gen * tsk->m_chans;
         needed_bytes = tot_samples * (tsk->m_bits / 8);
-        if (tsk->m_allocbytes < needed_bytes) {
-            tsk->m_allocbytes = needed_bytes;
-            tsk->m_buf = (char *)realloc(tsk->m_buf, tsk->m_allocbytes);
-            if (!tsk->m_buf) {
-                LOGERR("audioEater:alsa: out of memory\n");
-                alsaqueue.setTerminateAndWait();
-                queue->workerExit();
-                return (void *)1;
-            }
+        if (!tsk->reserve(needed_bytes, false)) {
+            LOGERR("audioEater:alsa: out of memory\n");
+            alsaqueue.setTerminateAndWait();
+            queue->workerExit();
+            return (void *)1;
         }
 
         // Convert floats buffer into output which is always 16LE for
@@ -550,7 +1361,10 @@ static void *audioEater(void *cls)
             tsk->m_bytes = (char *)sp - tsk->m_buf;
         }
         tsk->m_bits = 16;
+        tsk->m_needswap = false;
 
+        alsaqframes += tsk->frames();
+        tsk->m_stamps[AudioMessage::STG_CONVERTED] = Chrono::monomicros();
         if (!alsaqueue.put(tsk)) {
             LOGERR("alsaEater: queue put failed\n");
             queue->workerExit();
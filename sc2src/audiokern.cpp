@@ -0,0 +1,916 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AK_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AK_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "audiokern.h"
+
+// The different implementations. Each kernel set is a table of
+// function pointers, the active one is selected by the static
+// initializer at the end of the file.
+typedef void (*SwapFunc)(unsigned char *, const unsigned char *, size_t);
+typedef float (*DotFunc)(const float *, const float *, size_t);
+typedef bool (*ZeroFunc)(const unsigned char *, size_t);
+typedef void (*MixFunc)(float *, const float *, size_t, float, float);
+typedef void (*CvtFunc)(short *, const float *, size_t);
+
+struct KernelSet {
+    const char *name;
+    bool (*supported)();
+    SwapFunc swap16;
+    SwapFunc swap24;
+    SwapFunc swap32;
+    DotFunc dot;
+    ZeroFunc zero;
+    MixFunc mix;
+    CvtFunc f2s16;
+};
+
+////////// Scalar versions. These also process the tails for the SIMD ones.
+
+static bool scalar_supported()
+{
+    return true;
+}
+
+static void scalar_swap16(unsigned char *dest, const unsigned char *src,
+                          size_t bytes)
+{
+    for (size_t i = 0; i + 2 <= bytes; i += 2) {
+        unsigned char c = src[i];
+        dest[i] = src[i+1];
+        dest[i+1] = c;
+    }
+}
+
+static void scalar_swap24(unsigned char *dest, const unsigned char *src,
+                          size_t bytes)
+{
+    for (size_t i = 0; i + 3 <= bytes; i += 3) {
+        unsigned char c = src[i];
+        dest[i+1] = src[i+1];
+        dest[i] = src[i+2];
+        dest[i+2] = c;
+    }
+}
+
+static void scalar_swap32(unsigned char *dest, const unsigned char *src,
+                          size_t bytes)
+{
+    for (size_t i = 0; i + 4 <= bytes; i += 4) {
+        unsigned char c0 = src[i], c1 = src[i+1];
+        dest[i] = src[i+3];
+        dest[i+1] = src[i+2];
+        dest[i+2] = c1;
+        dest[i+3] = c0;
+    }
+}
+
+// Several accumulators let the compiler pipeline the additions
+static float scalar_dot(const float *a, const float *b, size_t n)
+{
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i+1] * b[i+1];
+        s2 += a[i+2] * b[i+2];
+        s3 += a[i+3] * b[i+3];
+    }
+    for (; i < n; i++) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+// 8 bytes at a time, with an early exit every 64 bytes
+static bool scalar_zero(const unsigned char *buf, size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        uint64_t w[8];
+        memcpy(w, buf + i, 64);
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+            return false;
+    }
+    for (; i < bytes; i++) {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+
+// The tail functions take the gain at the start and its increment.
+static void scalar_mixtail(float *out, const float *in, size_t n,
+                           float g, float dg)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] += in[i] * g;
+        g += dg;
+    }
+}
+
+static void scalar_mix(float *out, const float *in, size_t n,
+                       float g0, float g1)
+{
+    if (n == 0)
+        return;
+    scalar_mixtail(out, in, n, g0, (g1 - g0) / n);
+}
+
+static void scalar_f2s16(short *out, const float *in, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        float v = in[i];
+        if (v >= 32767.0f) {
+            out[i] = 32767;
+        } else if (v <= -32768.0f) {
+            out[i] = -32768;
+        } else {
+            out[i] = short(lrintf(v));
+        }
+    }
+}
+
+static const KernelSet scalar_kernels = {
+    "scalar", scalar_supported, scalar_swap16, scalar_swap24, scalar_swap32,
+    scalar_dot, scalar_zero, scalar_mix, scalar_f2s16
+};
+
+#ifdef AK_X86
+////////// SSSE3: pshufb
+//
+// The 24 bits case works on 48 bytes (16 samples) per step: each
+// output vector is built from the 2 or 3 input vectors it needs bytes
+// from. All loads are done before the stores, so that the in-place
+// operation works (without store forwarding stalls).
+
+static bool ssse3_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+// Returns the count of bytes processed
+__attribute__((target("ssse3")))
+static size_t ssse3_shuffle(unsigned char *dest, const unsigned char *src,
+                            size_t bytes, __m128i mask)
+{
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_swap16(unsigned char *dest, const unsigned char *src,
+                         size_t bytes)
+{
+    const __m128i mask = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t i = ssse3_shuffle(dest, src, bytes, mask);
+    scalar_swap16(dest + i, src + i, bytes - i);
+}
+
+// Shuffle masks for the 24 bits case: m24[k][v] extracts the bytes
+// of output vector k which come from input vector v (-1 yields 0).
+static const char m24[3][3][16] = {
+    {{2,1,0,5,4,3,8,7,6,11,10,9,14,13,12,-1},
+     {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1},
+     {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}},
+    {{-1,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
+     {0,-1,4,3,2,7,6,5,10,9,8,13,12,11,-1,15},
+     {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,0,-1}},
+    {{-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
+     {14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
+     {-1,3,2,1,6,5,4,9,8,7,12,11,10,15,14,13}},
+};
+
+__attribute__((target("ssse3")))
+static void ssse3_swap24(unsigned char *dest, const unsigned char *src,
+                         size_t bytes)
+{
+    const __m128i m00 = _mm_loadu_si128((const __m128i *)m24[0][0]);
+    const __m128i m01 = _mm_loadu_si128((const __m128i *)m24[0][1]);
+    const __m128i m10 = _mm_loadu_si128((const __m128i *)m24[1][0]);
+    const __m128i m11 = _mm_loadu_si128((const __m128i *)m24[1][1]);
+    const __m128i m12 = _mm_loadu_si128((const __m128i *)m24[1][2]);
+    const __m128i m21 = _mm_loadu_si128((const __m128i *)m24[2][1]);
+    const __m128i m22 = _mm_loadu_si128((const __m128i *)m24[2][2]);
+    size_t i = 0;
+    for (; i + 48 <= bytes; i += 48) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i o0 = _mm_or_si128(_mm_shuffle_epi8(a, m00),
+                                  _mm_shuffle_epi8(b, m01));
+        __m128i o1 = _mm_or_si128(_mm_shuffle_epi8(a, m10),
+                                  _mm_or_si128(_mm_shuffle_epi8(b, m11),
+                                               _mm_shuffle_epi8(c, m12)));
+        __m128i o2 = _mm_or_si128(_mm_shuffle_epi8(b, m21),
+                                  _mm_shuffle_epi8(c, m22));
+        _mm_storeu_si128((__m128i *)(dest + i), o0);
+        _mm_storeu_si128((__m128i *)(dest + i + 16), o1);
+        _mm_storeu_si128((__m128i *)(dest + i + 32), o2);
+    }
+    scalar_swap24(dest + i, src + i, bytes - i);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_swap32(unsigned char *dest, const unsigned char *src,
+                         size_t bytes)
+{
+    const __m128i mask = _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+    size_t i = ssse3_shuffle(dest, src, bytes, mask);
+    scalar_swap32(dest + i, src + i, bytes - i);
+}
+
+__attribute__((target("ssse3")))
+static float sse_dot(const float *a, const float *b, size_t n)
+{
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i),
+                                       _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+                                       _mm_loadu_ps(b + i + 4)));
+    }
+    float t[4];
+    _mm_storeu_ps(t, _mm_add_ps(s0, s1));
+    return (t[0] + t[1]) + (t[2] + t[3]) + scalar_dot(a + i, b + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static bool sse_zero(const unsigned char *buf, size_t bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        const __m128i *p = (const __m128i *)(buf + i);
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+            _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            return false;
+    }
+    return scalar_zero(buf + i, bytes - i);
+}
+
+__attribute__((target("ssse3")))
+static void sse_mix(float *out, const float *in, size_t n, float g0, float g1)
+{
+    if (n == 0)
+        return;
+    float dg = (g1 - g0) / n;
+    __m128 g = _mm_setr_ps(g0, g0 + dg, g0 + 2 * dg, g0 + 3 * dg);
+    const __m128 step = _mm_set1_ps(4 * dg);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 o = _mm_loadu_ps(out + i);
+        o = _mm_add_ps(o, _mm_mul_ps(_mm_loadu_ps(in + i), g));
+        _mm_storeu_ps(out + i, o);
+        g = _mm_add_ps(g, step);
+    }
+    scalar_mixtail(out + i, in + i, n - i, g0 + i * dg, dg);
+}
+
+// cvtps2dq rounds to nearest, packssdw saturates.
+__attribute__((target("ssse3")))
+static void sse_f2s16(short *out, const float *in, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_cvtps_epi32(_mm_loadu_ps(in + i));
+        __m128i b = _mm_cvtps_epi32(_mm_loadu_ps(in + i + 4));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+    }
+    scalar_f2s16(out + i, in + i, n - i);
+}
+
+static const KernelSet ssse3_kernels = {
+    "ssse3", ssse3_supported, ssse3_swap16, ssse3_swap24, ssse3_swap32,
+    sse_dot, sse_zero, sse_mix, sse_f2s16
+};
+
+////////// AVX2. vpshufb works inside 128 bits lanes, so the 24 bits
+// case processes two 48 bytes blocks in parallel, one per lane.
+
+static bool avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_swap1632(unsigned char *dest, const unsigned char *src,
+                          size_t bytes, __m256i mask)
+{
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_swap16(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    const __m256i mask =
+        _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                         1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t whole = bytes & ~size_t(31);
+    avx2_swap1632(dest, src, whole, mask);
+    scalar_swap16(dest + whole, src + whole, bytes - whole);
+}
+
+__attribute__((target("avx2")))
+static void avx2_swap32(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    const __m256i mask =
+        _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+                         3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+    size_t whole = bytes & ~size_t(31);
+    avx2_swap1632(dest, src, whole, mask);
+    scalar_swap32(dest + whole, src + whole, bytes - whole);
+}
+
+// Broadcast a 16 bytes mask to both lanes
+__attribute__((target("avx2")))
+static inline __m256i avx2_mask(const char *m)
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m));
+}
+
+__attribute__((target("avx2")))
+static void avx2_swap24(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    const __m256i m00 = avx2_mask(m24[0][0]);
+    const __m256i m01 = avx2_mask(m24[0][1]);
+    const __m256i m10 = avx2_mask(m24[1][0]);
+    const __m256i m11 = avx2_mask(m24[1][1]);
+    const __m256i m12 = avx2_mask(m24[1][2]);
+    const __m256i m21 = avx2_mask(m24[2][1]);
+    const __m256i m22 = avx2_mask(m24[2][2]);
+    size_t i = 0;
+    for (; i + 96 <= bytes; i += 96) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i x2 = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        // Rearrange so that the low lanes hold the first 48 bytes
+        // block and the high lanes the second one.
+        __m256i a = _mm256_permute2x128_si256(x0, x1, 0x30);
+        __m256i b = _mm256_permute2x128_si256(x0, x2, 0x21);
+        __m256i c = _mm256_permute2x128_si256(x1, x2, 0x30);
+        __m256i o0 = _mm256_or_si256(_mm256_shuffle_epi8(a, m00),
+                                     _mm256_shuffle_epi8(b, m01));
+        __m256i o1 = _mm256_or_si256(
+            _mm256_shuffle_epi8(a, m10),
+            _mm256_or_si256(_mm256_shuffle_epi8(b, m11),
+                            _mm256_shuffle_epi8(c, m12)));
+        __m256i o2 = _mm256_or_si256(_mm256_shuffle_epi8(b, m21),
+                                     _mm256_shuffle_epi8(c, m22));
+        _mm256_storeu_si256((__m256i *)(dest + i),
+                            _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + i + 32),
+                            _mm256_permute2x128_si256(o2, o0, 0x30));
+        _mm256_storeu_si256((__m256i *)(dest + i + 64),
+                            _mm256_permute2x128_si256(o1, o2, 0x31));
+    }
+    _mm256_zeroupper();
+    ssse3_swap24(dest + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static float avx2_dot(const float *a, const float *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                             _mm256_loadu_ps(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8),
+                                             _mm256_loadu_ps(b + i + 8)));
+    }
+    s0 = _mm256_add_ps(s0, s1);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s0),
+                          _mm256_extractf128_ps(s0, 1));
+    float t[4];
+    _mm_storeu_ps(t, h);
+    // Tail inline: calling non-VEX code with dirty upper registers
+    // would incur transition penalties.
+    float sum = (t[0] + t[1]) + (t[2] + t[3]);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static bool avx2_zero(const unsigned char *buf, size_t bytes)
+{
+    size_t i = 0;
+    bool zero = true;
+    for (; i + 128 <= bytes; i += 128) {
+        const __m256i *p = (const __m256i *)(buf + i);
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                            _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(v, v)) {
+            zero = false;
+            break;
+        }
+    }
+    _mm256_zeroupper();
+    return zero && sse_zero(buf + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_mix(float *out, const float *in, size_t n, float g0, float g1)
+{
+    if (n == 0)
+        return;
+    float dg = (g1 - g0) / n;
+    __m256 g = _mm256_setr_ps(g0, g0 + dg, g0 + 2 * dg, g0 + 3 * dg,
+                              g0 + 4 * dg, g0 + 5 * dg, g0 + 6 * dg,
+                              g0 + 7 * dg);
+    const __m256 step = _mm256_set1_ps(8 * dg);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 o = _mm256_loadu_ps(out + i);
+        o = _mm256_add_ps(o, _mm256_mul_ps(_mm256_loadu_ps(in + i), g));
+        _mm256_storeu_ps(out + i, o);
+        g = _mm256_add_ps(g, step);
+    }
+    _mm256_zeroupper();
+    scalar_mixtail(out + i, in + i, n - i, g0 + i * dg, dg);
+}
+
+// vpackssdw works per 128 bits lane: fix the order with a permute.
+__attribute__((target("avx2")))
+static void avx2_f2s16(short *out, const float *in, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_loadu_ps(in + i));
+        __m256i b = _mm256_cvtps_epi32(_mm256_loadu_ps(in + i + 8));
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), p);
+    }
+    _mm256_zeroupper();
+    sse_f2s16(out + i, in + i, n - i);
+}
+
+static const KernelSet avx2_kernels = {
+    "avx2", avx2_supported, avx2_swap16, avx2_swap24, avx2_swap32,
+    avx2_dot, avx2_zero, avx2_mix, avx2_f2s16
+};
+#endif /* AK_X86 */
+
+#ifdef AK_NEON
+////////// NEON. The 24 bits case uses the de-interleaving loads.
+
+static bool neon_supported()
+{
+#if defined(__aarch64__)
+    return true;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+static void neon_swap16(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        vst1q_u8(dest + i, vrev16q_u8(vld1q_u8(src + i)));
+    }
+    scalar_swap16(dest + i, src + i, bytes - i);
+}
+
+static void neon_swap24(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 48 <= bytes; i += 48) {
+        uint8x16x3_t v = vld3q_u8(src + i);
+        uint8x16_t t = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = t;
+        vst3q_u8(dest + i, v);
+    }
+    scalar_swap24(dest + i, src + i, bytes - i);
+}
+
+static void neon_swap32(unsigned char *dest, const unsigned char *src,
+                        size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        vst1q_u8(dest + i, vrev32q_u8(vld1q_u8(src + i)));
+    }
+    scalar_swap32(dest + i, src + i, bytes - i);
+}
+
+static float neon_dot(const float *a, const float *b, size_t n)
+{
+    float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = vmlaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+        s1 = vmlaq_f32(s1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float t[4];
+    vst1q_f32(t, vaddq_f32(s0, s1));
+    return (t[0] + t[1]) + (t[2] + t[3]) + scalar_dot(a + i, b + i, n - i);
+}
+
+static bool neon_zero(const unsigned char *buf, size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        uint8x16_t v = vorrq_u8(
+            vorrq_u8(vld1q_u8(buf + i), vld1q_u8(buf + i + 16)),
+            vorrq_u8(vld1q_u8(buf + i + 32), vld1q_u8(buf + i + 48)));
+        uint64x2_t w = vreinterpretq_u64_u8(v);
+        if ((vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) != 0)
+            return false;
+    }
+    return scalar_zero(buf + i, bytes - i);
+}
+
+static void neon_mix(float *out, const float *in, size_t n, float g0, float g1)
+{
+    if (n == 0)
+        return;
+    float dg = (g1 - g0) / n;
+    float ginit[4] = {g0, g0 + dg, g0 + 2 * dg, g0 + 3 * dg};
+    float32x4_t g = vld1q_f32(ginit);
+    const float32x4_t step = vdupq_n_f32(4 * dg);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(out + i, vmlaq_f32(vld1q_f32(out + i), vld1q_f32(in + i), g));
+        g = vaddq_f32(g, step);
+    }
+    scalar_mixtail(out + i, in + i, n - i, g0 + i * dg, dg);
+}
+
+// The conversion truncates: add +-0.5 first for rounding to nearest,
+// then saturate while narrowing.
+static void neon_f2s16(short *out, const float *in, size_t n)
+{
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vld1q_f32(in + i);
+        float32x4_t b = vld1q_f32(in + i + 4);
+        float32x4_t ha = vreinterpretq_f32_u32(
+            vorrq_u32(vreinterpretq_u32_f32(half),
+                      vandq_u32(vreinterpretq_u32_f32(a), sign)));
+        float32x4_t hb = vreinterpretq_f32_u32(
+            vorrq_u32(vreinterpretq_u32_f32(half),
+                      vandq_u32(vreinterpretq_u32_f32(b), sign)));
+        int32x4_t ia = vcvtq_s32_f32(vaddq_f32(a, ha));
+        int32x4_t ib = vcvtq_s32_f32(vaddq_f32(b, hb));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+    }
+    scalar_f2s16(out + i, in + i, n - i);
+}
+
+static const KernelSet neon_kernels = {
+    "neon", neon_supported, neon_swap16, neon_swap24, neon_swap32,
+    neon_dot, neon_zero, neon_mix, neon_f2s16
+};
+#endif /* AK_NEON */
+
+// All implementations, best first.
+static const KernelSet *allkernels[] = {
+#ifdef AK_X86
+    &avx2_kernels,
+    &ssse3_kernels,
+#endif
+#ifdef AK_NEON
+    &neon_kernels,
+#endif
+    &scalar_kernels,
+    0
+};
+
+static const KernelSet *kernels = &scalar_kernels;
+
+// Select the implementation at program startup.
+class KernelSelector {
+public:
+    KernelSelector() {
+        for (int i = 0; allkernels[i]; i++) {
+            if (allkernels[i]->supported()) {
+                kernels = allkernels[i];
+                break;
+            }
+        }
+    }
+};
+static KernelSelector kernelselector;
+
+void bswapSamples(unsigned char *dest, const unsigned char *src,
+                  size_t bytes, unsigned int bits)
+{
+    switch (bits) {
+    case 16: kernels->swap16(dest, src, bytes); break;
+    case 24: kernels->swap24(dest, src, bytes); break;
+    case 32: kernels->swap32(dest, src, bytes); break;
+    default: break;
+    }
+}
+
+float audioDotProduct(const float *a, const float *b, size_t n)
+{
+    return kernels->dot(a, b, n);
+}
+
+bool audioIsZero(const void *buf, size_t bytes)
+{
+    return kernels->zero((const unsigned char *)buf, bytes);
+}
+
+void audioMixAdd(float *out, const float *in, size_t n, float g0, float g1)
+{
+    kernels->mix(out, in, n, g0, g1);
+}
+
+void audioFloatToS16(short *out, const float *in, size_t n)
+{
+    kernels->f2s16(out, in, n);
+}
+
+const char *audioKernelsImpl()
+{
+    return kernels->name;
+}
+
+#ifdef TEST_AUDIOKERN
+///////////////////// test driver and benchmark
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "chrono.h"
+
+static char *thisprog;
+static void
+Usage(void)
+{
+    fprintf(stderr, "Usage : %s [mbytes]\n", thisprog);
+    exit(1);
+}
+
+// Check a kernel set against the scalar one, with sizes which are
+// not multiples of the SIMD steps, in place and out of place.
+static bool check(const KernelSet *ks)
+{
+    const SwapFunc scal[] = {scalar_swap16, scalar_swap24, scalar_swap32};
+    const SwapFunc test[] = {ks->swap16, ks->swap24, ks->swap32};
+    unsigned char src[1000], ref[1000], out[1000];
+    for (int b = 0; b < 3; b++) {
+        for (size_t sz = 0; sz < 1000; sz += 1 + sz / 8) {
+            for (size_t i = 0; i < sizeof(src); i++)
+                src[i] = random();
+            memcpy(ref, src, sizeof(src));
+            memcpy(out, src, sizeof(src));
+            scal[b](ref, src, sz);
+            test[b](out, src, sz);
+            if (memcmp(ref, out, sizeof(out))) {
+                fprintf(stderr, "%s: %d bits size %d: out of place FAILED\n",
+                        ks->name, 16 + 8*b, int(sz));
+                return false;
+            }
+            memcpy(out, src, sizeof(src));
+            test[b](out, out, sz);
+            if (memcmp(ref, out, sizeof(out))) {
+                fprintf(stderr, "%s: %d bits size %d: in place FAILED\n",
+                        ks->name, 16 + 8*b, int(sz));
+                return false;
+            }
+        }
+    }
+    float fa[1000], fb[1000];
+    for (size_t i = 0; i < 1000; i++) {
+        fa[i] = float(random()) / RAND_MAX - 0.5;
+        fb[i] = float(random()) / RAND_MAX - 0.5;
+    }
+    for (size_t sz = 0; sz < 1000; sz += 1 + sz / 8) {
+        float ref = scalar_dot(fa, fb, sz);
+        float val = ks->dot(fa, fb, sz);
+        if (fabsf(ref - val) > 1e-4 * (1 + fabsf(ref))) {
+            fprintf(stderr, "%s: dot size %d: FAILED %g %g\n", ks->name,
+                    int(sz), ref, val);
+            return false;
+        }
+    }
+    float mref[1000], mout[1000];
+    for (size_t sz = 0; sz < 1000; sz += 1 + sz / 8) {
+        for (size_t i = 0; i < 1000; i++)
+            mref[i] = mout[i] = fb[i];
+        scalar_mix(mref, fa, sz, 0.25, 1.5);
+        ks->mix(mout, fa, sz, 0.25, 1.5);
+        for (size_t i = 0; i < 1000; i++) {
+            if (fabsf(mref[i] - mout[i]) > 1e-4 * (1 + fabsf(mref[i]))) {
+                fprintf(stderr, "%s: mix size %d pos %d: FAILED %g %g\n",
+                        ks->name, int(sz), int(i), mref[i], mout[i]);
+                return false;
+            }
+        }
+    }
+    float cvin[1000];
+    short sref[1000], sout[1000];
+    for (size_t i = 0; i < 1000; i++)
+        cvin[i] = (float(random()) / RAND_MAX - 0.5) * 80000;
+    for (size_t sz = 0; sz < 1000; sz += 1 + sz / 8) {
+        memset(sref, 0, sizeof(sref));
+        memset(sout, 0, sizeof(sout));
+        scalar_f2s16(sref, cvin, sz);
+        ks->f2s16(sout, cvin, sz);
+        for (size_t i = 0; i < 1000; i++) {
+            if (abs(sref[i] - sout[i]) > 1) {
+                fprintf(stderr, "%s: f2s16 size %d pos %d: FAILED %d %d\n",
+                        ks->name, int(sz), int(i), sref[i], sout[i]);
+                return false;
+            }
+        }
+    }
+    unsigned char zb[1000];
+    memset(zb, 0, sizeof(zb));
+    for (size_t sz = 0; sz < 1000; sz += 1 + sz / 8) {
+        if (!ks->zero(zb, sz)) {
+            fprintf(stderr, "%s: zero size %d: FAILED\n", ks->name, int(sz));
+            return false;
+        }
+        for (size_t pos = 0; pos < sz; pos++) {
+            zb[pos] = 1 << (pos & 7);
+            bool ok = !ks->zero(zb, sz) && ks->zero(zb, pos);
+            zb[pos] = 0;
+            if (!ok) {
+                fprintf(stderr, "%s: zero size %d pos %d: FAILED\n",
+                        ks->name, int(sz), int(pos));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    thisprog = argv[0];
+    argc--;
+    argv++;
+
+    size_t mbytes = 8;
+    if (argc == 1) {
+        mbytes = atoi(argv[0]);
+        if (mbytes == 0)
+            Usage();
+    } else if (argc != 0) {
+        Usage();
+    }
+
+    // Size is a multiple of all sample sizes
+    size_t bytes = mbytes * 1024 * 1024 / 48 * 48;
+    unsigned char *src = (unsigned char *)malloc(bytes);
+    unsigned char *dest = (unsigned char *)malloc(bytes);
+    for (size_t i = 0; i < bytes; i++)
+        src[i] = random();
+
+    printf("Selected implementation: %s\n", audioKernelsImpl());
+    for (int i = 0; allkernels[i]; i++) {
+        const KernelSet *ks = allkernels[i];
+        if (!ks->supported()) {
+            printf("%-8s not supported\n", ks->name);
+            continue;
+        }
+        if (!check(ks)) {
+            return 1;
+        }
+        const SwapFunc fns[] = {ks->swap16, ks->swap24, ks->swap32};
+        for (int b = 0; b < 3; b++) {
+            for (int inplace = 0; inplace < 2; inplace++) {
+                unsigned char *out = inplace ? src : dest;
+                // Warm up, then measure
+                fns[b](out, src, bytes);
+                int loops = 0;
+                Chrono chron;
+                do {
+                    fns[b](out, src, bytes);
+                    loops++;
+                } while (chron.millis() < 300);
+                double secs = chron.micros() / 1e6;
+                printf("%-8s %d bits %-12s %7.2f GB/s\n", ks->name, 16 + 8*b,
+                       inplace ? "in place" : "out of place",
+                       double(bytes) * loops / secs / 1e9);
+            }
+        }
+        // Dot product on cache-resident data, as used by the
+        // concealment pitch search
+        const size_t nf = 1024;
+        float fa[nf], fb[nf + 8];
+        for (size_t j = 0; j < nf + 8; j++) {
+            fb[j] = float(random()) / RAND_MAX - 0.5;
+            if (j < nf)
+                fa[j] = float(random()) / RAND_MAX - 0.5;
+        }
+        volatile float sink = 0;
+        int loops = 0;
+        Chrono chron;
+        do {
+            for (int j = 0; j < 1000; j++)
+                sink = sink + ks->dot(fa, fb + (j & 7), nf);
+            loops += 1000;
+        } while (chron.millis() < 300);
+        double secs = chron.micros() / 1e6;
+        printf("%-8s dot product             %7.2f GFlop/s\n", ks->name,
+               2.0 * nf * loops / secs / 1e9);
+
+        // Silence detection: worst case, scanning a whole zero buffer
+        memset(dest, 0, bytes);
+        loops = 0;
+        chron.restart();
+        do {
+            sink = sink + ks->zero(dest, bytes);
+            loops++;
+        } while (chron.millis() < 300);
+        secs = chron.micros() / 1e6;
+        printf("%-8s silence detection       %7.2f GB/s\n", ks->name,
+               double(bytes) * loops / secs / 1e9);
+
+        // Mixing and conversion, on a cache-resident period
+        float mo[nf];
+        short so[nf];
+        memset(mo, 0, sizeof(mo));
+        loops = 0;
+        chron.restart();
+        do {
+            for (int j = 0; j < 1000; j++)
+                ks->mix(mo, fa, nf, 0.5, 0.25);
+            loops += 1000;
+        } while (chron.millis() < 300);
+        secs = chron.micros() / 1e6;
+        printf("%-8s mix                     %7.2f Gsample/s\n", ks->name,
+               double(nf) * loops / secs / 1e9);
+        for (size_t j = 0; j < nf; j++)
+            mo[j] = fa[j] * 70000;
+        loops = 0;
+        chron.restart();
+        do {
+            for (int j = 0; j < 1000; j++)
+                ks->f2s16(so, mo, nf);
+            loops += 1000;
+        } while (chron.millis() < 300);
+        secs = chron.micros() / 1e6;
+        sink = sink + so[0];
+        printf("%-8s float to 16 bits        %7.2f Gsample/s\n", ks->name,
+               double(nf) * loops / secs / 1e9);
+    }
+    return 0;
+}
+
+#endif /* TEST_AUDIOKERN */
@@ -0,0 +1,69 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _AUDIOKERN_H_INCLUDED_
+#define _AUDIOKERN_H_INCLUDED_
+
+#include <stddef.h>
+
+/**
+ * Low level audio data processing routines, shared by sc2mpd and
+ * mpd2sc.
+ *
+ * Each routine has a plain C++ version and SIMD versions (SSSE3, AVX2
+ * on x86, NEON on ARM). The best version supported by the CPU is
+ * selected once, at program startup.
+ */
+
+/** Swap the bytes inside each sample (16, 24 or 32 bits) while
+ * copying from src to dest. dest and src may be identical, but must
+ * not otherwise overlap. Only whole samples are processed: trailing
+ * bytes beyond the last complete sample are not touched. */
+extern void bswapSamples(unsigned char *dest, const unsigned char *src,
+                         size_t bytes, unsigned int bits);
+
+/** In-place version of bswapSamples() */
+inline void bswapSamplesInPlace(unsigned char *data, size_t bytes,
+                                unsigned int bits)
+{
+    bswapSamples(data, data, bytes, bits);
+}
+
+/** Return the sum of a[i] * b[i] for i in [0, n). The summation order
+ *  depends on the implementation, so the results may differ in the
+ *  last bits. */
+extern float audioDotProduct(const float *a, const float *b, size_t n);
+
+/** Return true if all bytes in the buffer are zero (digital
+ *  silence). */
+extern bool audioIsZero(const void *buf, size_t bytes);
+
+/** Mixing: out[i] += in[i] * g for i in [0, n), with the gain g
+ *  going linearly from g0 (at 0) to g1 (at n), for click-free gain
+ *  changes. Use g0 == g1 for a constant gain. */
+extern void audioMixAdd(float *out, const float *in, size_t n,
+                        float g0, float g1);
+
+/** Convert floats in the 16 bits range to 16 bits samples, rounding
+ *  to nearest and clipping. The rounding of exact halves may differ
+ *  between implementations. */
+extern void audioFloatToS16(short *out, const float *in, size_t n);
+
+/** Name of the selected implementation ("scalar", "ssse3", "avx2",
+ *  "neon"), for logging */
+extern const char *audioKernelsImpl();
+
+#endif /* _AUDIOKERN_H_INCLUDED_ */
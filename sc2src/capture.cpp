@@ -0,0 +1,296 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <queue>
+
+#include "capture.h"
+#include "chrono.h"
+#include "log.h"
+
+using namespace std;
+
+static const char capmagic[4] = {'S', 'C', '2', 'C'};
+static const unsigned int capversion = 1;
+static const unsigned int recheaderbytes = 36;
+static const unsigned char recflaghalt = 1;
+// Flush the writer every so many records (about 1 S of audio)
+static const unsigned int flushcount = 100;
+// Records queued for the writer thread (about 5 S of audio)
+static const unsigned int queuerecords = 512;
+
+static inline void put32(unsigned char *cp, unsigned int v)
+{
+    cp[0] = v >> 24;
+    cp[1] = (v >> 16) & 0xff;
+    cp[2] = (v >> 8) & 0xff;
+    cp[3] = v & 0xff;
+}
+static inline unsigned int get32(const unsigned char *cp)
+{
+    return (unsigned(cp[0]) << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+CaptureWriter::CaptureWriter(const string& path)
+    : m_count(0), m_failed(false),
+      m_queue("capture", queuerecords,
+              SPSCQueue<vector<unsigned char>*>::OVF_DROPNEWEST, dispose)
+{
+    if ((m_fp = fopen(path.c_str(), "wb")) == 0) {
+        LOGERR("CaptureWriter: can't create " << path << ": errno " <<
+               errno << endl);
+        return;
+    }
+    unsigned char hdr[8];
+    memcpy(hdr, capmagic, 4);
+    put32(hdr + 4, capversion);
+    if (fwrite(hdr, sizeof(hdr), 1, m_fp) != 1) {
+        LOGERR("CaptureWriter: write error on " << path << endl);
+        fclose(m_fp);
+        m_fp = 0;
+        return;
+    }
+    if (!m_queue.start(1, writerproc, this)) {
+        LOGERR("CaptureWriter: can't start writer thread\n");
+        fclose(m_fp);
+        m_fp = 0;
+        return;
+    }
+    LOGINF("CaptureWriter: capturing to " << path << endl);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    if (m_fp) {
+        m_queue.waitIdle();
+        m_queue.setTerminateAndWait();
+        if (m_queue.overruns()) {
+            LOGERR("CaptureWriter: " << m_queue.overruns() <<
+                   " records dropped (writer too slow)\n");
+        }
+        fclose(m_fp);
+    }
+}
+
+void CaptureWriter::dispose(vector<unsigned char> *rec)
+{
+    delete rec;
+}
+
+void *CaptureWriter::writerproc(void *arg)
+{
+    CaptureWriter *cw = (CaptureWriter *)arg;
+    vector<unsigned char> *rec;
+    while (cw->m_queue.take(&rec)) {
+        cw->writeRecord(*rec);
+        delete rec;
+    }
+    cw->m_queue.workerExit();
+    return (void *)1;
+}
+
+// Writer thread
+void CaptureWriter::writeRecord(const vector<unsigned char>& rec)
+{
+    if (m_failed)
+        return;
+    if (fwrite(&rec[0], rec.size(), 1, m_fp) != 1) {
+        LOGERR("CaptureWriter: write error: capture stopped\n");
+        m_failed = true;
+        return;
+    }
+    if (++m_count % flushcount == 0 || (rec[30] & recflaghalt))
+        fflush(m_fp);
+}
+
+void CaptureWriter::write(const OhmAudio& msg)
+{
+    if (m_fp == 0 || m_failed)
+        return;
+    vector<unsigned char> *rec =
+        new vector<unsigned char>(recheaderbytes + msg.bytes);
+    unsigned char *hdr = &(*rec)[0];
+    unsigned long long us = msg.recvus;
+    put32(hdr, us >> 32);
+    put32(hdr + 4, us & 0xffffffff);
+    put32(hdr + 8, msg.frame);
+    put32(hdr + 12, msg.mediatimestamp);
+    put32(hdr + 16, msg.medialatency);
+    put32(hdr + 20, msg.freq);
+    put32(hdr + 24, msg.samples);
+    hdr[28] = msg.bits;
+    hdr[29] = msg.chans;
+    hdr[30] = msg.halt ? recflaghalt : 0;
+    hdr[31] = 0;
+    put32(hdr + 32, msg.bytes);
+    if (msg.bytes)
+        memcpy(hdr + recheaderbytes, msg.data, msg.bytes);
+    if (!m_queue.put(rec))
+        delete rec;
+}
+
+CaptureReader::CaptureReader(const string& path)
+{
+    if ((m_fp = fopen(path.c_str(), "rb")) == 0) {
+        LOGERR("CaptureReader: can't open " << path << ": errno " <<
+               errno << endl);
+        return;
+    }
+    unsigned char hdr[8];
+    if (fread(hdr, sizeof(hdr), 1, m_fp) != 1 || memcmp(hdr, capmagic, 4) ||
+        get32(hdr + 4) != capversion) {
+        LOGERR("CaptureReader: " << path << " is not a capture file\n");
+        fclose(m_fp);
+        m_fp = 0;
+    }
+}
+
+CaptureReader::~CaptureReader()
+{
+    if (m_fp)
+        fclose(m_fp);
+}
+
+bool CaptureReader::next(OhmAudio& msg, vector<unsigned char>& buf)
+{
+    if (m_fp == 0)
+        return false;
+    unsigned char hdr[recheaderbytes];
+    if (fread(hdr, sizeof(hdr), 1, m_fp) != 1)
+        return false;
+    msg.recvus = (long long)(((unsigned long long)get32(hdr) << 32) |
+                             get32(hdr + 4));
+    msg.frame = get32(hdr + 8);
+    msg.mediatimestamp = get32(hdr + 12);
+    msg.medialatency = get32(hdr + 16);
+    msg.freq = get32(hdr + 20);
+    msg.samples = get32(hdr + 24);
+    msg.bits = hdr[28];
+    msg.chans = hdr[29];
+    msg.halt = (hdr[30] & recflaghalt) != 0;
+    msg.bytes = get32(hdr + 32);
+    // Songcast messages are limited to 64 KB: anything bigger is garbage
+    if (msg.bytes > 65536) {
+        LOGERR("CaptureReader: bad record\n");
+        return false;
+    }
+    buf.resize(msg.bytes);
+    if (msg.bytes && fread(&buf[0], msg.bytes, 1, m_fp) != 1) {
+        LOGERR("CaptureReader: truncated record\n");
+        return false;
+    }
+    msg.data = msg.bytes ? &buf[0] : 0;
+    return true;
+}
+
+// Deterministic random numbers in [0, 1), same sequence everywhere
+// for a given seed.
+static double urand(unsigned long long& state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// A message waiting for its replay time
+struct Pending {
+    long long deliver;
+    unsigned long seq;
+    OhmAudio msg;
+    vector<unsigned char> buf;
+};
+struct PendingLater {
+    bool operator()(const Pending *a, const Pending *b) const {
+        if (a->deliver != b->deliver)
+            return a->deliver > b->deliver;
+        return a->seq > b->seq;
+    }
+};
+
+bool replayCapture(const string& path, const Impairments& imp,
+                   NativeReceiver::Handler handler, void *arg)
+{
+    CaptureReader reader(path);
+    if (!reader.ok())
+        return false;
+
+    unsigned long long rstate = imp.seed;
+    double scale = (1.0 + imp.skewppm / 1e6) / (imp.speed > 0 ? imp.speed : 1);
+    priority_queue<Pending*, vector<Pending*>, PendingLater> pending;
+    unsigned long seq = 0, dropped = 0, delayed = 0;
+    long long t0 = 0;
+    long long start = Chrono::monomicros();
+
+    // Read ahead: the next message not yet scheduled, and its
+    // nominal replay time.
+    Pending *next = new Pending;
+    long long nominal = 0;
+    bool more = reader.next(next->msg, next->buf);
+    if (more)
+        t0 = next->msg.recvus;
+
+    for (;;) {
+        // Schedule the messages until the next one can't be delivered
+        // before the earliest pending one (delays are never negative).
+        while (more && (pending.empty() || nominal <= pending.top()->deliver)) {
+            Pending *p = next;
+            if (!p->msg.halt && urand(rstate) < imp.loss) {
+                dropped++;
+            } else {
+                p->deliver = nominal;
+                if (imp.jitterms)
+                    p->deliver += (long long)(urand(rstate) * imp.jitterms *
+                                              1000 * scale);
+                if (!p->msg.halt && p->msg.freq &&
+                    urand(rstate) < imp.reorder) {
+                    // Arrive after the next two
+                    p->deliver += (long long)(2.5 * p->msg.samples * 1e6 /
+                                              p->msg.freq * scale);
+                    delayed++;
+                }
+                p->seq = seq++;
+                pending.push(p);
+                p = new Pending;
+            }
+            next = p;
+            if ((more = reader.next(next->msg, next->buf))) {
+                nominal = (long long)((next->msg.recvus - t0) * scale);
+            }
+        }
+        if (pending.empty())
+            break;
+
+        Pending *p = pending.top();
+        pending.pop();
+        if (imp.speed > 0) {
+            long long wait = start + p->deliver - Chrono::monomicros();
+            if (wait > 0)
+                usleep(wait);
+        }
+        p->msg.recvus = Chrono::monomicros();
+        handler(p->msg, arg);
+        delete p;
+    }
+    delete next;
+    LOGINF("replayCapture: " << seq << " messages replayed, " << dropped <<
+           " dropped, " << delayed << " reordered, " <<
+           (Chrono::monomicros() - start) / 1000 << " mS\n");
+    return true;
+}
@@ -0,0 +1,109 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _CAPTURE_H_INCLUDED_
+#define _CAPTURE_H_INCLUDED_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "nativerecv.h"
+#include "spscqueue.h"
+
+/**
+ * Capture and replay of the received Songcast audio messages, to
+ * reproduce field problems and to test the receive pipeline.
+ *
+ * The file has a short header ("SC2C", version), then one record per
+ * message: arrival time, frame number, media timestamp and latency,
+ * format, halt flag, and the raw (msb-first) payload. All the
+ * integers are big-endian.
+ */
+
+/** Write a capture (sccapturefile). Messages are appended in arrival
+ *  order. The file is flushed every few records, so that not much is
+ *  lost when sc2mpd is killed.
+ *
+ *  write() only formats the record and queues it: the file is
+ *  written by a separate thread, so that the receive thread never
+ *  waits for the disk. If the writer falls behind, records are
+ *  dropped (and counted). */
+class CaptureWriter {
+public:
+    CaptureWriter(const std::string& path);
+    ~CaptureWriter();
+    bool ok() {
+        return m_fp != 0;
+    }
+    /** Called from the receive thread (only one) */
+    void write(const OhmAudio& msg);
+private:
+    static void *writerproc(void *arg);
+    static void dispose(std::vector<unsigned char> *rec);
+    void writeRecord(const std::vector<unsigned char>& rec);
+
+    FILE *m_fp;
+    unsigned int m_count;
+    // Set by the writer thread after an error
+    std::atomic<bool> m_failed;
+    SPSCQueue<std::vector<unsigned char>*> m_queue;
+};
+
+/** Read a capture. */
+class CaptureReader {
+public:
+    CaptureReader(const std::string& path);
+    ~CaptureReader();
+    bool ok() {
+        return m_fp != 0;
+    }
+    /** Read the next record. msg.data points into buf. Returns false
+     *  at the end of the file or on error. */
+    bool next(OhmAudio& msg, std::vector<unsigned char>& buf);
+private:
+    FILE *m_fp;
+};
+
+/** Network impairments applied on replay */
+struct Impairments {
+    Impairments()
+        : loss(0), reorder(0), jitterms(0), skewppm(0), speed(1), seed(1) {}
+    // Probability of dropping a message
+    double loss;
+    // Probability of delaying a message after the next two
+    double reorder;
+    // Max random delay added to each message
+    unsigned int jitterms;
+    // The replayed stream runs this much slower than the capture
+    // (arrival times are stretched), as if the sender clock drifted.
+    double skewppm;
+    // Time scale: 2 is twice as fast as the capture, 0 is as fast as
+    // possible.
+    double speed;
+    // For repeatable runs
+    unsigned int seed;
+};
+
+/** Feed a capture to the handler (same interface as the native
+ *  receiver), with the message timing of the capture and the
+ *  impairments. The arrival times passed to the handler are the
+ *  replay ones. Returns when the capture is exhausted. */
+extern bool replayCapture(const std::string& path, const Impairments& imp,
+                          NativeReceiver::Handler handler, void *arg);
+
+#endif /* _CAPTURE_H_INCLUDED_ */
@@ -73,6 +73,19 @@ long long Chrono::amicros() const
     return MICROS(ts, m_orig);
 }
 
+long long Chrono::monomicros()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        // Can't happen on Linux. Fall back to gettimeofday
+        TimeSpec tts;
+        gettime(CLOCK_REALTIME, &tts);
+        ts.tv_sec = tts.tv_sec;
+        ts.tv_nsec = tts.tv_nsec;
+    }
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 Chrono::Chrono()
 {
     restart();
@@ -28,6 +28,10 @@ public:
     /** Return current orig */
     long long amicros() const;
 
+    /** Current monotonic clock value in uS. Not affected by system
+     *  time changes: use this for scheduling. */
+    static long long monomicros();
+
     struct TimeSpec {
         time_t tv_sec; /* Time in seconds */
         long   tv_nsec; /* And nanoseconds (< 10E9) */
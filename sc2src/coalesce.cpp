@@ -0,0 +1,238 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+
+#include "coalesce.h"
+#include "rcvqueue.h"
+#include "log.h"
+
+using namespace std;
+
+Coalescer::Coalescer()
+    : m_target(0), m_maxbytes(0), m_pktframes(0), m_batch(0)
+{
+}
+
+Coalescer::~Coalescer()
+{
+    AudioMessage::release(m_batch);
+}
+
+bool Coalescer::canAppend(AudioMessage *m)
+{
+    return m->m_bits == m_batch->m_bits && m->m_chans == m_batch->m_chans &&
+        m->m_freq == m_batch->m_freq &&
+        m->m_needswap == m_batch->m_needswap &&
+        m->m_silent == m_batch->m_silent;
+}
+
+void Coalescer::drain(deque<AudioMessage*>& out)
+{
+    if (m_batch) {
+        out.push_back(m_batch);
+        m_batch = 0;
+    }
+}
+
+void Coalescer::add(AudioMessage *m, deque<AudioMessage*>& out)
+{
+    if (m->m_flush) {
+        // Everything before is going to be discarded anyway
+        AudioMessage::release(m_batch);
+        m_batch = 0;
+        out.push_back(m);
+        return;
+    }
+    if (m->m_reconfig || m->m_bytes == 0 || m->m_chans == 0 ||
+        m->m_bits == 0) {
+        drain(out);
+        out.push_back(m);
+        return;
+    }
+
+    unsigned int frames = m->frames();
+    m_pktframes = frames;
+    if (m_batch && !canAppend(m)) {
+        drain(out);
+    }
+    // The buffer holds the target plus one packet (which leaves some
+    // room for the resampler output).
+    unsigned int fbytes = m->m_chans * (m->m_bits / 8);
+    unsigned int target = m_target;
+    if (m_maxbytes && target + frames > m_maxbytes / fbytes) {
+        target = m_maxbytes / fbytes > frames ?
+            m_maxbytes / fbytes - frames : 0;
+    }
+    if (target <= frames) {
+        drain(out);
+        out.push_back(m);
+        return;
+    }
+
+    if (m_batch == 0) {
+        // Make room for the whole batch. This also copies the data
+        // if it was external.
+        if (!m->reserve((target + frames) * fbytes)) {
+            LOGERR("Coalescer: out of memory\n");
+            out.push_back(m);
+            return;
+        }
+        m_batch = m;
+    } else {
+        if (!m_batch->reserve(m_batch->m_bytes + m->m_bytes)) {
+            LOGERR("Coalescer: out of memory\n");
+            drain(out);
+            out.push_back(m);
+            return;
+        }
+        memcpy(m_batch->m_buf + m_batch->m_bytes, m->m_buf, m->m_bytes);
+        m_batch->m_bytes += m->m_bytes;
+        AudioMessage::release(m);
+    }
+
+    // Output now if the next packet would not fit: no use waiting
+    // for it.
+    if (m_batch->frames() + frames > target) {
+        drain(out);
+    }
+}
+
+#ifdef TEST_COALESCE
+///////////////////// Benchmark: resampling CPU time, batched or not
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include <vector>
+
+#include <samplerate.h>
+
+static char *thisprog;
+static void
+Usage(void)
+{
+    fprintf(stderr, "Usage : %s [seconds]\n", thisprog);
+    exit(1);
+}
+
+static double cpusecs()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// The per-message work of the alsa eater and writer: conversion to
+// float, resampling, conversion back to 16 bits, and a write system
+// call (to /dev/null instead of the device).
+static void eat(SRC_STATE *src, AudioMessage *m, vector<float>& in,
+                vector<float>& out, int fd)
+{
+    unsigned int samples = m->samples();
+    in.resize(samples);
+    out.resize(2 * samples);
+    const short *sp = (const short *)m->m_buf;
+    for (unsigned int i = 0; i < samples; i++) {
+        in[i] = sp[i];
+    }
+    SRC_DATA data;
+    memset(&data, 0, sizeof(data));
+    data.data_in = &in[0];
+    data.data_out = &out[0];
+    data.input_frames = m->frames();
+    data.output_frames = 2 * m->frames();
+    data.src_ratio = 1.001;
+    src_process(src, &data);
+    m->reserve(data.output_frames_gen * m->m_chans * 2, false);
+    short *op = (short *)m->m_buf;
+    for (long i = 0; i < data.output_frames_gen * m->m_chans; i++) {
+        float v = out[i];
+        op[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : short(v);
+    }
+    if (write(fd, m->m_buf, data.output_frames_gen * m->m_chans * 2) < 0) {
+        perror("write");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    thisprog = argv[0];
+    argc--;
+    argv++;
+
+    int seconds = 60;
+    if (argc == 1) {
+        seconds = atoi(argv[0]);
+        if (seconds <= 0)
+            Usage();
+    } else if (argc != 0) {
+        Usage();
+    }
+
+    // Windows Songcast: 10 mS packets, 16 bits stereo
+    const unsigned int freq = 44100, chans = 2, pktframes = 441;
+    const unsigned int npkts = seconds * freq / pktframes;
+    const unsigned int targets[] = {0, 1024, 2048, 4096, 8192};
+    // Packet data: one period of a 100 Hz tone
+    vector<short> pkt(pktframes * chans);
+    for (unsigned int i = 0; i < pktframes; i++) {
+        for (unsigned int c = 0; c < chans; c++)
+            pkt[i * chans + c] = short(10000 * sin(2 * M_PI * i / pktframes));
+    }
+    int fd = open("/dev/null", O_WRONLY);
+    double base = 0;
+    for (unsigned int t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+        Coalescer co;
+        co.setTarget(targets[t]);
+        int err;
+        SRC_STATE *src = src_new(SRC_SINC_FASTEST, chans, &err);
+        vector<float> in, out;
+        deque<AudioMessage*> ready;
+        unsigned long calls = 0;
+        double start = cpusecs();
+        for (unsigned int p = 0; p < npkts; p++) {
+            unsigned int bytes = pktframes * chans * 2;
+            AudioMessage *m = new AudioMessage(16, chans, pktframes, freq,
+                                               (char *)malloc(bytes), bytes);
+            memcpy(m->m_buf, &pkt[0], bytes);
+            co.add(m, ready);
+            while (!ready.empty()) {
+                eat(src, ready.front(), in, out, fd);
+                AudioMessage::release(ready.front());
+                ready.pop_front();
+                calls++;
+            }
+        }
+        double secs = cpusecs() - start;
+        src_delete(src);
+        if (t == 0)
+            base = secs;
+        printf("batch %5u frames: %6lu calls, %7.3f mS CPU per second of "
+               "audio (%.2f)\n", targets[t], calls, 1000 * secs / seconds,
+               base > 0 ? secs / base : 1.0);
+    }
+    return 0;
+}
+
+#endif /* TEST_COALESCE */
@@ -0,0 +1,87 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _COALESCE_H_INCLUDED_
+#define _COALESCE_H_INCLUDED_
+
+#include <deque>
+
+class AudioMessage;
+
+/**
+ * Batch the small Songcast packets (typically 10 mS) into bigger
+ * buffers, so that the resampler and the alsa writer have fewer,
+ * larger calls to make.
+ *
+ * A batch is output when the next packet would not fit in the target
+ * size. Packets which can't be appended (different format, byte
+ * order or silence state) end the current batch. Control messages
+ * (flush, reconfig, or no data) end it too and are passed through
+ * (a flush message discards the current batch instead).
+ *
+ * The first message of a batch is used as the container, its data is
+ * copied to its own buffer, and the data of the following ones is
+ * appended. The batch keeps the play time of its first message.
+ *
+ * Runs on the audio eater thread, the target size is set from the
+ * alsa period size with a latency ceiling.
+ */
+class Coalescer {
+public:
+    Coalescer();
+    ~Coalescer();
+
+    /** Set the batch size in frames. 0 or a value not bigger than
+     *  the packet size disables batching. */
+    void setTarget(unsigned int frames) {
+        m_target = frames;
+    }
+
+    /** Limit the batch buffer size in bytes, so that the batches fit
+     *  in a message pool block (payloadBytes()) instead of falling
+     *  back to the heap at high sample rates. 0 for no limit. */
+    void setMaxBytes(unsigned int bytes) {
+        m_maxbytes = bytes;
+    }
+
+    /** Add a message. Batches and passed-through messages which are
+     *  ready are appended to out, in order. We take ownership of m. */
+    void add(AudioMessage *m, std::deque<AudioMessage*>& out);
+
+    /** Output the current partial batch, if any. */
+    void drain(std::deque<AudioMessage*>& out);
+
+    /** A partial batch is waiting for more packets */
+    bool holding() {
+        return m_batch != 0;
+    }
+
+    /** Frame count of the last input packet */
+    unsigned int packetFrames() {
+        return m_pktframes;
+    }
+
+private:
+    bool canAppend(AudioMessage *m);
+
+    unsigned int m_target;
+    unsigned int m_maxbytes;
+    unsigned int m_pktframes;
+    // Current batch
+    AudioMessage *m_batch;
+};
+
+#endif /* _COALESCE_H_INCLUDED_ */
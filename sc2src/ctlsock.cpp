@@ -0,0 +1,153 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctlsock.h"
+#include "log.h"
+
+using namespace std;
+
+// Limits: connected clients and command line length
+static const unsigned int maxclients = 8;
+static const size_t maxline = 4096;
+
+ControlServer::ControlServer(const string& path, Handler handler, void *arg)
+    : m_path(path), m_handler(handler), m_arg(arg), m_fd(-1)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOGERR("ControlServer: path too long: " << path << endl);
+        return;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    if ((m_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        LOGERR("ControlServer: socket: errno " << errno << endl);
+        return;
+    }
+    unlink(path.c_str());
+    if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(m_fd, maxclients) < 0) {
+        LOGERR("ControlServer: bind/listen " << path << ": errno " <<
+               errno << endl);
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    LOGDEB("ControlServer: listening on " << path << endl);
+}
+
+ControlServer::~ControlServer()
+{
+    for (unsigned int i = 0; i < m_clients.size(); i++) {
+        close(m_clients[i].fd);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        unlink(m_path.c_str());
+    }
+}
+
+bool ControlServer::processInput(Client& cl, bool& quit)
+{
+    string::size_type pos;
+    while (!quit && (pos = cl.buf.find('\n')) != string::npos) {
+        string cmd = cl.buf.substr(0, pos);
+        cl.buf.erase(0, pos + 1);
+        if (!cmd.empty() && cmd[cmd.size() - 1] == '\r') {
+            cmd.erase(cmd.size() - 1);
+        }
+        LOGDEB1("ControlServer: command [" << cmd << "]\n");
+        string reply = m_handler(cmd, quit, m_arg);
+        reply += "\n";
+        // Replies are short, the socket buffer takes them. No
+        // SIGPIPE if the client is gone.
+        if (send(cl.fd, reply.c_str(), reply.size(), MSG_NOSIGNAL) !=
+            ssize_t(reply.size())) {
+            return false;
+        }
+    }
+    if (cl.buf.size() > maxline) {
+        LOGERR("ControlServer: command line too long\n");
+        return false;
+    }
+    return true;
+}
+
+bool ControlServer::run()
+{
+    if (m_fd < 0) {
+        return false;
+    }
+    vector<struct pollfd> fds;
+    bool quit = false;
+    while (!quit) {
+        fds.resize(m_clients.size() + 1);
+        fds[0].fd = m_fd;
+        fds[0].events = m_clients.size() < maxclients ? POLLIN : 0;
+        for (unsigned int i = 0; i < m_clients.size(); i++) {
+            fds[i + 1].fd = m_clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGERR("ControlServer: poll: errno " << errno << endl);
+            return false;
+        }
+
+        // Clients, from the end so that we can erase
+        for (unsigned int i = m_clients.size(); i > 0; i--) {
+            if (fds[i].revents == 0)
+                continue;
+            Client& cl = m_clients[i - 1];
+            char buf[512];
+            ssize_t n = read(cl.fd, buf, sizeof(buf));
+            bool keep = n > 0;
+            if (keep) {
+                cl.buf.append(buf, n);
+                keep = processInput(cl, quit);
+            }
+            if (!keep) {
+                close(cl.fd);
+                m_clients.erase(m_clients.begin() + (i - 1));
+            }
+            if (quit)
+                break;
+        }
+
+        if (!quit && (fds[0].revents & POLLIN)) {
+            int cfd = accept(m_fd, 0, 0);
+            if (cfd >= 0) {
+                m_clients.push_back(Client(cfd));
+            } else if (errno != EINTR && errno != EAGAIN) {
+                LOGERR("ControlServer: accept: errno " << errno << endl);
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,69 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _CTLSOCK_H_INCLUDED_
+#define _CTLSOCK_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+/**
+ * Local control socket for the daemon mode: a Unix stream socket
+ * accepting one-line text commands, each answered by a one-line
+ * reply. The protocol itself (the commands) is implemented by the
+ * handler function.
+ *
+ * Everything runs on the thread calling run(), the handler does not
+ * need to be reentrant.
+ */
+class ControlServer {
+public:
+    /** Command handler. Gets one command line (without the end of
+     *  line), returns the reply (same). Set quit to make run() return
+     *  after sending the reply. */
+    typedef std::string (*Handler)(const std::string& cmd, bool& quit,
+                                   void *arg);
+
+    /** Create the socket. An existing file at path is removed. */
+    ControlServer(const std::string& path, Handler handler, void *arg);
+    ~ControlServer();
+
+    bool ok() {
+        return m_fd >= 0;
+    }
+
+    /** Serve the clients until the handler asks to quit. Returns
+     *  false for a fatal error. */
+    bool run();
+
+private:
+    struct Client {
+        Client(int f) : fd(f) {}
+        int fd;
+        std::string buf;
+    };
+    // Process the complete lines in the client input buffer. Returns
+    // false if the client is gone.
+    bool processInput(Client& cl, bool& quit);
+
+    std::string m_path;
+    Handler m_handler;
+    void *m_arg;
+    int m_fd;
+    std::vector<Client> m_clients;
+};
+
+#endif /* _CTLSOCK_H_INCLUDED_ */
@@ -0,0 +1,147 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <ctype.h>
+
+#include "driftcache.h"
+#include "conftree.h"
+#include "log.h"
+
+using namespace std;
+
+// Duration of the averaging blocks
+static const unsigned int blocksecs = 30;
+// Two consecutive block means closer than this: converged
+static const double convergedppm = 20;
+// A block mean further than this from the cached value: stale entry
+static const double staleppm = 200;
+// Don't rewrite the file for smaller changes
+static const double saveppm = 2;
+// Sanity limits for the values read from the file
+static const double maxppm = 2000;
+
+DriftCache::DriftCache(const string& fn, const string& dev, const string& uri)
+    : m_conf(0), m_dev(dev), m_freq(0), m_saved(0),
+      m_blocksum(0), m_blockframes(0), m_lastmean(0)
+{
+    setUri(uri);
+    if (fn.empty()) {
+        return;
+    }
+    m_conf = new ConfSimple(fn.c_str());
+    if (m_conf->getStatus() != ConfSimple::STATUS_RW) {
+        LOGINF("DriftCache: can't open " << fn << " for writing, "
+               "clock ratios will not be stored\n");
+        delete m_conf;
+        m_conf = 0;
+    }
+}
+
+DriftCache::~DriftCache()
+{
+    delete m_conf;
+}
+
+void DriftCache::setUri(const string& uri)
+{
+    // The uri is used as a parameter name: no '=' or spaces
+    m_uri = uri;
+    for (unsigned int i = 0; i < m_uri.size(); i++) {
+        if (m_uri[i] == '=' || isspace((unsigned char)m_uri[i]))
+            m_uri[i] = '_';
+    }
+    m_freq = 0;
+}
+
+string DriftCache::key()
+{
+    char buf[30];
+    snprintf(buf, sizeof(buf), "@%u", m_freq);
+    return m_uri + buf;
+}
+
+double DriftCache::start(unsigned int freq)
+{
+    m_freq = freq;
+    m_saved = 0;
+    m_blocksum = 0;
+    m_blockframes = 0;
+    m_lastmean = 0;
+    if (m_conf == 0 || m_uri.empty()) {
+        return 1.0;
+    }
+    string value;
+    if (m_conf->get(key(), value, m_dev)) {
+        double ratio = atof(value.c_str());
+        if (fabs(ratio - 1.0) * 1e6 < maxppm) {
+            m_saved = ratio;
+            LOGDEB("DriftCache: " << key() << " on " << m_dev <<
+                   ": starting with ratio " << value << endl);
+        } else {
+            LOGERR("DriftCache: bad value for " << key() << ": " <<
+                   value << endl);
+            m_conf->erase(key(), m_dev);
+        }
+    }
+    return m_saved != 0 ? m_saved : 1.0;
+}
+
+void DriftCache::sample(double ratio, unsigned int frames)
+{
+    if (m_conf == 0 || m_freq == 0 || m_uri.empty()) {
+        return;
+    }
+    m_blocksum += ratio * frames;
+    m_blockframes += frames;
+    if (m_blockframes >= (unsigned long)blocksecs * m_freq) {
+        double mean = m_blocksum / m_blockframes;
+        m_blocksum = 0;
+        m_blockframes = 0;
+        blockDone(mean);
+    }
+}
+
+void DriftCache::blockDone(double mean)
+{
+    if (m_lastmean == 0) {
+        // First block: includes the start transient, only keep it as
+        // a reference.
+        m_lastmean = mean;
+        return;
+    }
+    if (m_saved != 0 && fabs(mean - m_saved) * 1e6 > staleppm) {
+        LOGINF("DriftCache: " << key() << " ratio now " << mean <<
+               ", stored value " << m_saved << " is stale\n");
+        m_conf->erase(key(), m_dev);
+        m_saved = 0;
+    }
+    if (fabs(mean - m_lastmean) * 1e6 < convergedppm &&
+        (m_saved == 0 || fabs(mean - m_saved) * 1e6 > saveppm)) {
+        char buf[30];
+        snprintf(buf, sizeof(buf), "%.9f", mean);
+        LOGDEB("DriftCache: " << key() << " on " << m_dev <<
+               ": storing ratio " << buf << endl);
+        if (m_conf->set(key(), buf, m_dev)) {
+            m_saved = mean;
+        }
+    }
+    m_lastmean = mean;
+}
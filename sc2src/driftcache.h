@@ -0,0 +1,74 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _DRIFTCACHE_H_INCLUDED_
+#define _DRIFTCACHE_H_INCLUDED_
+
+#include <string>
+
+class ConfSimple;
+
+/**
+ * Persistent store for the converged sender/DAC clock ratios, so
+ * that the alsa rate control can start from the right value when we
+ * play the same sender again, instead of slowly converging from 1.0.
+ *
+ * The file is in the usual configuration format, with one section per
+ * alsa device and one entry per sender URI and sample rate.
+ *
+ * Tracking: the eater feeds the ratio actually used for each
+ * buffer. The means over successive blocks are compared: when two
+ * consecutive ones agree, the value is saved. When a block mean is
+ * too far from the initial (cached) value, the entry is stale (other
+ * hardware behind the same URI, or device change), and it is erased.
+ */
+class DriftCache {
+public:
+    /** @param fn the cache file. If it can't be opened, the object
+     *     still works but nothing is stored.
+     *  @param dev the alsa device name (section in the file).
+     *  @param uri the sender URI. */
+    DriftCache(const std::string& fn, const std::string& dev,
+               const std::string& uri);
+    ~DriftCache();
+
+    /** Change the sender. start() must be called next. */
+    void setUri(const std::string& uri);
+
+    /** Start tracking for a new stream (or format). Returns the
+     *  initial ratio: the cached value or 1.0 */
+    double start(unsigned int freq);
+
+    /** Account for the ratio used for a buffer of frames frames. */
+    void sample(double ratio, unsigned int frames);
+
+private:
+    std::string key();
+    void blockDone(double mean);
+
+    ConfSimple *m_conf;
+    std::string m_dev;
+    std::string m_uri;
+    unsigned int m_freq;
+    // Cached value, 0 if none
+    double m_saved;
+    // Current block accumulators, and the previous block mean (0 if none)
+    double m_blocksum;
+    unsigned long m_blockframes;
+    double m_lastmean;
+};
+
+#endif /* _DRIFTCACHE_H_INCLUDED_ */
@@ -0,0 +1,191 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "failover.h"
+#include "conftree.h"
+#include "chrono.h"
+#include "histo.h"
+#include "log.h"
+
+using namespace std;
+
+// Default max silence before switching. Songcast packets come every
+// 10 mS or less, so this is 10 missed packets.
+static const unsigned int timeoutms = 100;
+// Default max wait for the first packet from a new sender.
+static const unsigned int startms = 1000;
+// Max watchdog poll interval
+static const long long maxpollus = 10000;
+
+Failover::Failover(const vector<string>& backups, unsigned int tmoms,
+                   unsigned int stms, Switcher sw, void *arg)
+    : m_backups(backups), m_timeoutus(tmoms * 1000LL),
+      m_startus(stms * 1000LL), m_switcher(sw), m_arg(arg), m_idx(0),
+      m_active(false), m_switchat(0), m_failedat(0), m_switches(0),
+      m_lastpkt(0), m_lost(false), m_exit(false), m_running(false)
+{
+}
+
+Failover::~Failover()
+{
+    if (m_running) {
+        m_exit = true;
+        pthread_join(m_thread, 0);
+    }
+}
+
+Failover *Failover::create(ConfSimple& config, Switcher sw, void *arg)
+{
+    vector<string> uris;
+    string value;
+    if (config.get("scfailoveruris", value)) {
+        istringstream str(value);
+        string uri;
+        while (str >> uri)
+            uris.push_back(uri);
+    }
+    if (uris.empty()) {
+        return 0;
+    }
+    unsigned int tmoms = timeoutms;
+    unsigned int stms = startms;
+    if (config.get("scfailovertimeoutms", value)) {
+        tmoms = atoi(value.c_str());
+    }
+    if (config.get("scfailoverstartms", value)) {
+        stms = atoi(value.c_str());
+    }
+    LOGDEB("Failover: " << uris.size() << " backup sender(s), timeout " <<
+           tmoms << " mS, start " << stms << " mS\n");
+    return new Failover(uris, tmoms, stms, sw, arg);
+}
+
+bool Failover::start()
+{
+    if (pthread_create(&m_thread, 0, threadFunc, this) != 0) {
+        LOGERR("Failover: pthread_create failed\n");
+        return false;
+    }
+    m_running = true;
+    return true;
+}
+
+bool Failover::play(const string& uri)
+{
+    PTMutexLocker lock(m_mutex);
+    m_uris = m_backups;
+    unsigned int idx = 0;
+    for (; idx < m_uris.size(); idx++) {
+        if (m_uris[idx] == uri)
+            break;
+    }
+    if (idx == m_uris.size()) {
+        m_uris.insert(m_uris.begin(), uri);
+        idx = 0;
+    }
+    m_active = true;
+    m_failedat = 0;
+    return switchTo(idx, Chrono::monomicros());
+}
+
+void Failover::stop()
+{
+    PTMutexLocker lock(m_mutex);
+    m_active = false;
+    m_switchat = 0;
+}
+
+// Called with the lock held. If the uri can't be played, the
+// watchdog tries the next one after the start timeout.
+bool Failover::switchTo(unsigned int idx, long long now)
+{
+    m_idx = idx;
+    m_switchat = now;
+    m_lastpkt = 0;
+    bool ok = m_switcher(m_uris[m_idx], m_arg);
+    if (!ok) {
+        LOGERR("Failover: can't play " << m_uris[m_idx] << endl);
+    }
+    // Ignore the disconnection caused by the switch itself
+    m_lost = false;
+    return ok;
+}
+
+void *Failover::threadFunc(void *arg)
+{
+    ((Failover *)arg)->run();
+    return 0;
+}
+
+void Failover::run()
+{
+    long long pollus = m_timeoutus / 4;
+    if (pollus > maxpollus)
+        pollus = maxpollus;
+    if (pollus < 1000)
+        pollus = 1000;
+
+    while (!m_exit) {
+        usleep(pollus);
+        PTMutexLocker lock(m_mutex);
+        if (!m_active) {
+            continue;
+        }
+        long long now = Chrono::monomicros();
+        long long last = m_lastpkt.load(memory_order_relaxed);
+
+        if (m_switchat) {
+            // Waiting for the first packet from the new sender
+            if (last >= m_switchat) {
+                if (m_failedat) {
+                    long long us = last - m_failedat;
+                    latencyFailover(us);
+                    LOGINF("Failover: " << m_uris[m_idx] << " playing " <<
+                           us / 1000 << " mS after the last packet\n");
+                }
+                m_switchat = 0;
+            } else if (now - m_switchat > m_startus && m_uris.size() > 1) {
+                LOGINF("Failover: no audio from " << m_uris[m_idx] << endl);
+                if (m_failedat == 0)
+                    m_failedat = m_switchat;
+                m_switches++;
+                switchTo((m_idx + 1) % m_uris.size(), now);
+            }
+            m_lost = false;
+            continue;
+        }
+
+        // last is 0 after a halt: the sender stopped deliberately
+        if (last == 0 || m_uris.size() < 2) {
+            m_lost = false;
+            continue;
+        }
+        if (m_lost || now - last > m_timeoutus) {
+            LOGINF("Failover: lost " << m_uris[m_idx] << " (" <<
+                   (m_lost ? "disconnected" : "timeout") << ")\n");
+            m_failedat = last;
+            m_switches++;
+            switchTo((m_idx + 1) % m_uris.size(), now);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _FAILOVER_H_INCLUDED_
+#define _FAILOVER_H_INCLUDED_
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "ptmutex.h"
+
+class ConfSimple;
+
+/**
+ * Automatic failover to backup senders.
+ *
+ * A watchdog thread checks the packet arrival times. When the current
+ * sender has been silent for more than the timeout, or the receiver
+ * reported a disconnection, the next sender in the list is
+ * played. The switch goes through the same receiver stop/play as the
+ * daemon mode play command: the audio queue, the eater and the alsa
+ * device stay up, they just see a flush.
+ *
+ * The sender list is the played uri, followed by the backups
+ * (scfailoveruris) in order. If the played uri is in the backup list,
+ * the list is used as is, starting from it. After the last sender,
+ * we go back to the first.
+ *
+ * A halt from the sender is a deliberate stop, not a failure: the
+ * watchdog is disarmed until packets arrive again.
+ *
+ * The time from the last packet of the failed sender to the first
+ * packet of the new one is recorded in the latency statistics (see
+ * histo.h).
+ */
+class Failover {
+public:
+    /** Switch to the sender: stop the receiver and play uri. Called
+     *  from the watchdog thread or the play() caller. Returns false
+     *  if uri can't be played. */
+    typedef bool (*Switcher)(const std::string& uri, void *arg);
+
+    /** @param backups the ordered backup sender uris.
+     *  @param timeoutms max silence before switching.
+     *  @param startms max wait for the first packet after a switch,
+     *    before trying the next sender. */
+    Failover(const std::vector<std::string>& backups, unsigned int timeoutms,
+             unsigned int startms, Switcher sw, void *arg);
+    ~Failover();
+
+    /** Create from the configuration (scfailoverxxx values). Returns 0
+     *  if no backup senders are defined. */
+    static Failover *create(ConfSimple& config, Switcher sw, void *arg);
+
+    /** Start the watchdog thread */
+    bool start();
+
+    /** Play uri (with the configured backups), and watch it.
+     *  Returns false if uri can't be played. */
+    bool play(const std::string& uri);
+    /** Stop watching. Does not stop the receiver */
+    void stop();
+
+    /** The receiver got an audio packet at recvus
+     *  (Chrono::monomicros()). Lock-free, called for every packet */
+    void packet(long long recvus) {
+        m_lastpkt.store(recvus, std::memory_order_relaxed);
+    }
+    /** The receiver lost the sender (Disconnected callback) */
+    void lost() {
+        m_lost.store(true, std::memory_order_relaxed);
+    }
+    /** The sender stopped the stream */
+    void halted() {
+        m_lastpkt.store(0, std::memory_order_relaxed);
+    }
+
+    unsigned long switches() {
+        return m_switches;
+    }
+
+private:
+    static void *threadFunc(void *arg);
+    void run();
+    // Called with the lock held
+    bool switchTo(unsigned int idx, long long now);
+
+    std::vector<std::string> m_backups;
+    long long m_timeoutus;
+    long long m_startus;
+    Switcher m_switcher;
+    void *m_arg;
+    std::vector<std::string> m_uris;
+    unsigned int m_idx;
+    bool m_active;
+    // Time of the last switch, reset when the new sender is heard
+    long long m_switchat;
+    // Time of the last packet from the failed sender. 0 for an
+    // initial play (no latency to record).
+    long long m_failedat;
+    unsigned long m_switches;
+    std::atomic<long long> m_lastpkt;
+    std::atomic<bool> m_lost;
+    std::atomic<bool> m_exit;
+    pthread_t m_thread;
+    bool m_running;
+    PTMutexInit m_mutex;
+};
+
+#endif /* _FAILOVER_H_INCLUDED_ */
@@ -0,0 +1,202 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+
+#include "histo.h"
+#include "rcvqueue.h"
+#include "chrono.h"
+#include "log.h"
+
+using namespace std;
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+void Histogram::reset()
+{
+    for (int i = 0; i < nbuckets; i++) {
+        m_buckets[i].store(0, memory_order_relaxed);
+    }
+    m_count = 0;
+    m_sum = 0;
+    m_min = 0x7fffffffffffffffLL;
+    m_max = 0;
+}
+
+// Values below 2 * 32 have their own bucket. Above, a value with its
+// highest bit at position msb goes to one of the 32 buckets for this
+// power of 2, selected by the 5 bits below msb.
+int Histogram::bucketIndex(long long us)
+{
+    if (us < 0)
+        us = 0;
+    if (us < (2LL << subbits)) {
+        return int(us);
+    }
+    int msb = 63 - __builtin_clzll((unsigned long long)us);
+    if (msb >= maxbits) {
+        return nbuckets - 1;
+    }
+    int shift = msb - subbits;
+    return (shift << subbits) + int(us >> shift);
+}
+
+long long Histogram::bucketValue(int idx)
+{
+    if (idx < (2 << subbits)) {
+        return idx;
+    }
+    int shift = (idx >> subbits) - 1;
+    return (long long)(idx - (shift << subbits)) << shift;
+}
+
+void Histogram::record(long long us)
+{
+    m_buckets[bucketIndex(us)].fetch_add(1, memory_order_relaxed);
+    m_count.fetch_add(1, memory_order_relaxed);
+    m_sum.fetch_add(us, memory_order_relaxed);
+    long long v = m_min.load(memory_order_relaxed);
+    while (us < v && !m_min.compare_exchange_weak(v, us))
+        ;
+    v = m_max.load(memory_order_relaxed);
+    while (us > v && !m_max.compare_exchange_weak(v, us))
+        ;
+}
+
+long long Histogram::percentile(double p)
+{
+    unsigned long long total = count();
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(p / 100.0 * total);
+    if (target >= total)
+        target = total - 1;
+    unsigned long long cnt = 0;
+    for (int i = 0; i < nbuckets; i++) {
+        cnt += m_buckets[i].load(memory_order_relaxed);
+        if (cnt > target) {
+            return bucketValue(i);
+        }
+    }
+    return m_max.load(memory_order_relaxed);
+}
+
+string Histogram::summary()
+{
+    unsigned long long cnt = count();
+    if (cnt == 0) {
+        return "no data";
+    }
+    char buf[200];
+    snprintf(buf, sizeof(buf), "count %llu min %lld p50 %lld p90 %lld "
+             "p99 %lld p99.9 %lld max %lld mean %lld (uS)", cnt,
+             m_min.load(), percentile(50), percentile(90), percentile(99),
+             percentile(99.9), m_max.load(), m_sum.load() / (long long)cnt);
+    return buf;
+}
+
+////////// Receive pipeline latencies
+
+// Names of the intervals ending at each stage.
+static const char *stagenames[AudioMessage::STG_COUNT] = {
+    "",
+    "network to eater",
+    "eater processing",
+    "alsa queue",
+    "alsa write",
+};
+static Histogram stagehistos[AudioMessage::STG_COUNT];
+static Histogram endtoend;
+// Sender failover: last packet from the old sender to first packet
+// from the new one
+static Histogram failover;
+
+void latencyRecord(AudioMessage *m)
+{
+    const long long *st = m->m_stamps;
+    if (st[AudioMessage::STG_RECV] == 0) {
+        return;
+    }
+    // Record the intervals between the successive stamps which are
+    // set (the http output only has some of them), and the total up
+    // to the last one.
+    int prev = AudioMessage::STG_RECV;
+    for (int i = prev + 1; i < AudioMessage::STG_COUNT; i++) {
+        if (st[i] == 0)
+            continue;
+        stagehistos[i].record(st[i] - st[prev]);
+        prev = i;
+    }
+    if (prev != AudioMessage::STG_RECV) {
+        endtoend.record(st[prev] - st[AudioMessage::STG_RECV]);
+    }
+}
+
+void latencyDump()
+{
+    for (int i = AudioMessage::STG_RECV + 1; i < AudioMessage::STG_COUNT; i++) {
+        if (stagehistos[i].count()) {
+            LOGINF("Latency: " << stagenames[i] << ": " <<
+                   stagehistos[i].summary() << endl);
+        }
+    }
+    LOGINF("Latency: end to end: " << endtoend.summary() << endl);
+    if (failover.count()) {
+        LOGINF("Latency: failover: " << failover.summary() << endl);
+    }
+}
+
+void latencyReset()
+{
+    for (int i = 0; i < AudioMessage::STG_COUNT; i++) {
+        stagehistos[i].reset();
+    }
+    endtoend.reset();
+    failover.reset();
+}
+
+void latencyFailover(long long us)
+{
+    failover.record(us);
+}
+
+// Start time, reset to 0 when the first sample is reported
+static std::atomic<long long> starttime(0);
+
+void latencyStart()
+{
+    starttime = Chrono::monomicros();
+}
+
+void latencyFirstSample(AudioMessage *m)
+{
+    long long start = starttime.load(memory_order_relaxed);
+    if (start == 0 || !starttime.compare_exchange_strong(start, 0)) {
+        return;
+    }
+    long long now = Chrono::monomicros();
+    long long recv = m->m_stamps[AudioMessage::STG_RECV];
+    // The log parser in scttfs.py depends on this format
+    LOGINF("Latency: first sample output after " << (now - start) / 1000 <<
+           " mS (received after " << (recv ? (recv - start) / 1000 : -1) <<
+           " mS)\n");
+}
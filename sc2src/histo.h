@@ -0,0 +1,98 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _HISTO_H_INCLUDED_
+#define _HISTO_H_INCLUDED_
+
+#include <string>
+#include <atomic>
+
+class AudioMessage;
+
+/**
+ * Histogram of microsecond values, with log-linear buckets (HDR
+ * style): 32 buckets per power of 2, so the relative error on the
+ * percentiles is under about 3%, over the range from 1 uS to days.
+ *
+ * Recording is lock-free (relaxed atomic increments), and can be done
+ * from several threads. Reading while recording gives approximate
+ * but consistent enough results for statistics.
+ */
+class Histogram {
+public:
+    Histogram();
+
+    void record(long long us);
+
+    /** Forget all values */
+    void reset();
+
+    unsigned long long count() {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    /** Max recorded value, 0 if there is none */
+    long long max() {
+        return count() ? m_max.load(std::memory_order_relaxed) : 0;
+    }
+
+    /** Value at percentile p (0-100). Bucket lower bound. */
+    long long percentile(double p);
+
+    /** One line summary: count, min, percentiles, max, mean */
+    std::string summary();
+
+private:
+    // 32 sub-buckets per power of 2, values up to 2^41 uS
+    static const int subbits = 5;
+    static const int maxbits = 41;
+    static const int nbuckets = (maxbits - subbits + 1) << subbits;
+    static int bucketIndex(long long us);
+    static long long bucketValue(int idx);
+
+    std::atomic<unsigned int> m_buckets[nbuckets];
+    std::atomic<unsigned long long> m_count;
+    std::atomic<long long> m_sum;
+    std::atomic<long long> m_min;
+    std::atomic<long long> m_max;
+};
+
+/**
+ * Receive pipeline latency statistics. The AudioMessage stage stamps
+ * (AudioMessage::m_stamps) are turned into per-stage and end-to-end
+ * durations when the message is disposed of by the final consumer.
+ */
+extern void latencyRecord(AudioMessage *m);
+
+/** Log the latency histograms. Called on SIGUSR1 */
+extern void latencyDump();
+
+/** Reset the latency histograms */
+extern void latencyReset();
+
+/** Record a sender failover duration (see failover.h) */
+extern void latencyFailover(long long us);
+
+/**
+ * Startup latency: latencyStart() is called at launch (and in daemon
+ * mode when switching senders), and the final consumer calls
+ * latencyFirstSample() for each message it outputs. The time from
+ * start to the first sample output is logged once per start.
+ */
+extern void latencyStart();
+extern void latencyFirstSample(AudioMessage *m);
+
+#endif /* _HISTO_H_INCLUDED_ */
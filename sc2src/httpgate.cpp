@@ -31,6 +31,8 @@
 #include "rcvqueue.h"
 #include "wav.h"
 #include "conftree.h"
+#include "chrono.h"
+#include "histo.h"
 
 using namespace std;
 
@@ -93,6 +95,36 @@ static int print_out_key (void *cls, enum MHD_ValueKind kind,
 }
 #endif /* PRINT_KEYS */
 
+// Copy and swap data from a zero-copy (msb-first) message. The
+// start offset and count may not be aligned on a sample boundary,
+// because they depend on the size requested by microhttpd, so we
+// swap partial samples byte by byte.
+static void copyswapoffs(char *dest, const char *src, unsigned int offs,
+                         unsigned int cnt, unsigned int bits)
+{
+    unsigned int ssz = bits / 8;
+    if (ssz < 2) {
+        memcpy(dest, src + offs, cnt);
+        return;
+    }
+    while (cnt > 0 && offs % ssz) {
+        *dest++ = src[offs - offs % ssz + ssz - 1 - offs % ssz];
+        offs++;
+        cnt--;
+    }
+    unsigned int whole = cnt - cnt % ssz;
+    copyswap((unsigned char *)dest, (const unsigned char *)src + offs,
+             whole, bits);
+    dest += whole;
+    offs += whole;
+    cnt -= whole;
+    while (cnt > 0) {
+        *dest++ = src[offs - offs % ssz + ssz - 1 - offs % ssz];
+        offs++;
+        cnt--;
+    }
+}
+
 // This gets called by microhttpd when it needs data.
 static ssize_t
 data_generator(void *cls, uint64_t pos, char *buf, size_t max)
@@ -114,12 +146,6 @@ data_generator(void *cls, uint64_t pos, char *buf, size_t max)
         while (dataqueue.empty()) {
             //LOGDEB("data_generator: waiting for buffer" << endl);
             pthread_cond_wait(&dataqueueWaitCond, lock.getMutex());
-            if (!dataqueue.empty() && dataqueue.front()->m_buf == 0) {
-                // special buf, to be processed ?
-                LOGINF("data_generator: deleting empty buf" << endl);
-                delete dataqueue.front();
-                dataqueue.pop();
-            }
         }
 
         AudioMessage *m = dataqueue.front();
@@ -151,11 +177,19 @@ data_generator(void *cls, uint64_t pos, char *buf, size_t max)
         }
 
         size_t newbytes = MIN(max - bytes, m->m_bytes - m->m_curoffs);
-        memcpy(buf + bytes, m->m_buf + m->m_curoffs, newbytes);
+        if (m->m_needswap) {
+            copyswapoffs(buf + bytes, m->m_buf, m->m_curoffs, newbytes,
+                         m->m_bits);
+        } else {
+            memcpy(buf + bytes, m->m_buf + m->m_curoffs, newbytes);
+        }
         m->m_curoffs += newbytes;
         bytes += newbytes;
         if (m->m_curoffs == m->m_bytes) {
-            delete dataqueue.front();
+            m->m_stamps[AudioMessage::STG_WRITTEN] = Chrono::monomicros();
+            latencyRecord(m);
+            latencyFirstSample(m);
+            AudioMessage::release(dataqueue.front());
             dataqueue.pop();
         }
     }
@@ -320,7 +354,7 @@ static void *audioEater(void *cls)
         return (void *)0;
     }
 
-    WorkQueue<AudioMessage*> *queue = ctxt->queue;
+    AudioQueue *queue = ctxt->queue;
     delete ctxt;
     ctxt = 0;
 
@@ -332,13 +366,39 @@ static void *audioEater(void *cls)
             queue->workerExit();
             return (void*)1;
         }
+        tsk->m_stamps[AudioMessage::STG_DEQUEUE] = Chrono::monomicros();
         PTMutexLocker lock(dataqueueLock);
 
+        if (tsk->m_flush) {
+            // Stream stopped: drop the queued data, except a
+            // partially sent buffer (we must stay aligned on samples).
+            AudioMessage::release(tsk);
+            AudioMessage *partial = 0;
+            if (!dataqueue.empty() && dataqueue.front()->m_curoffs != 0) {
+                partial = dataqueue.front();
+                dataqueue.pop();
+            }
+            while (!dataqueue.empty()) {
+                AudioMessage::release(dataqueue.front());
+                dataqueue.pop();
+            }
+            if (partial) {
+                dataqueue.push(partial);
+            }
+            continue;
+        }
+        // The control messages are handled above: only audio goes to
+        // the client side.
+        if (tsk->m_buf == 0 || tsk->m_bytes == 0) {
+            AudioMessage::release(tsk);
+            continue;
+        }
+
         /* limit size of queuing. If there is a client but it is not
            eating blocks fast enough, there will be skips */
         while (dataqueue.size() > 2) {
             LOGDEB("audioEater: discarding buffer !" << endl);
-            delete dataqueue.front();
+            AudioMessage::release(dataqueue.front());
             dataqueue.pop();
         }
 
@@ -0,0 +1,173 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <time.h>
+
+#include "jitterbuf.h"
+#include "chrono.h"
+#include "rcvqueue.h"
+#include "log.h"
+
+using namespace std;
+
+// A frame further than this many windows away from the expected one
+// means that the sender restarted: we begin a new sequence instead of
+// declaring everything in between lost or late.
+static const int restartwindows = 8;
+
+JitterBuffer::JitterBuffer(unsigned int window, unsigned int maxwaitms,
+                           Output output, void *arg)
+    : m_window(window ? window : 1), m_maxwaitus(maxwaitms * 1000LL),
+      m_output(output), m_arg(arg), m_started(false), m_next(0),
+      m_highest(0), m_held(0), m_lost(0)
+{
+    // The held frames are in [m_next, m_next + m_window]
+    unsigned int cap = 1;
+    while (cap < m_window + 1)
+        cap <<= 1;
+    m_mask = cap - 1;
+    m_slots = new AudioMessage*[cap];
+    m_times = new long long[cap];
+    for (unsigned int i = 0; i < cap; i++) {
+        m_slots[i] = 0;
+    }
+}
+
+JitterBuffer::~JitterBuffer()
+{
+    for (unsigned int i = 0; i <= m_mask; i++) {
+        AudioMessage::release(m_slots[i]);
+    }
+    delete [] m_slots;
+    delete [] m_times;
+}
+
+void JitterBuffer::insert(AudioMessage *m, unsigned int frame)
+{
+    if (!m_started) {
+        m_started = true;
+        m_next = m_highest = frame;
+    }
+
+    int dist = int(frame - m_next);
+    int restartdist = restartwindows * int(m_window);
+    if (dist < -restartdist || dist >= restartdist) {
+        LOGDEB("JitterBuffer: frame " << frame << " expected " << m_next <<
+               ": new sequence\n");
+        flush();
+        m_started = true;
+        m_next = m_highest = frame;
+        dist = 0;
+    }
+
+    if (dist < 0) {
+        // Already output, or declared lost
+        m_stats.late++;
+        AudioMessage::release(m);
+        return;
+    }
+    if (int(frame - m_highest) < 0) {
+        m_stats.reordered++;
+    } else {
+        m_highest = frame;
+    }
+    if (dist > int(m_window)) {
+        // Make room: give up on the frames which don't fit
+        drain(false, frame - m_window);
+    }
+
+    unsigned int idx = frame & m_mask;
+    if (m_slots[idx]) {
+        m_stats.duplicates++;
+        AudioMessage::release(m);
+        return;
+    }
+    m_slots[idx] = m;
+    m_times[idx] = Chrono::monomicros();
+    if (++m_held > m_stats.maxdepth) {
+        m_stats.maxdepth = m_held;
+    }
+
+    drain(false, m_next);
+    poll();
+}
+
+void JitterBuffer::poll()
+{
+    while (m_held > 0 && m_slots[m_next & m_mask] == 0) {
+        // Waiting for m_next. Look for the first held frame and the
+        // oldest arrival time.
+        unsigned int first = 0;
+        long long oldest = 0;
+        bool found = false;
+        for (unsigned int i = 1; i <= m_window; i++) {
+            unsigned int idx = (m_next + i) & m_mask;
+            if (m_slots[idx]) {
+                if (!found) {
+                    first = m_next + i;
+                    oldest = m_times[idx];
+                    found = true;
+                } else if (m_times[idx] < oldest) {
+                    oldest = m_times[idx];
+                }
+            }
+        }
+        if (!found || Chrono::monomicros() - oldest < m_maxwaitus) {
+            return;
+        }
+        drain(false, first);
+    }
+}
+
+void JitterBuffer::flush()
+{
+    drain(true, 0);
+    m_lost = 0;
+    m_started = false;
+}
+
+void JitterBuffer::drain(bool all, unsigned int upto)
+{
+    while (m_held > 0) {
+        unsigned int idx = m_next & m_mask;
+        AudioMessage *m = m_slots[idx];
+        if (m == 0) {
+            if (!all && int(upto - m_next) <= 0) {
+                return;
+            }
+            m_lost++;
+            m_stats.lost++;
+            m_next++;
+            continue;
+        }
+        m_slots[idx] = 0;
+        m_held--;
+        m_next++;
+        unsigned int lost = m_lost;
+        m_lost = 0;
+        m_output(m, lost, m_arg);
+    }
+    // Nothing held: skip to upto if it's ahead
+    if (!all) {
+        while (int(upto - m_next) > 0) {
+            m_lost++;
+            m_stats.lost++;
+            m_next++;
+        }
+    }
+}
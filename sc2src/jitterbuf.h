@@ -0,0 +1,119 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _JITTERBUF_H_INCLUDED_
+#define _JITTERBUF_H_INCLUDED_
+
+class AudioMessage;
+
+/**
+ * Reordering buffer for the audio messages, keyed by the Songcast
+ * frame number. Runs on the network thread, between the message
+ * conversion and the audio queue.
+ *
+ * Messages are output in frame order through the output
+ * function. When all the frames are arriving in order, a message is
+ * output as soon as it is inserted, and there is no added
+ * latency. When a frame is missing, the following ones are held,
+ * until the missing one arrives, or until the first held one has been
+ * waiting for the maximum time, or the window (max count of frames
+ * ahead of the missing one) is full. The missing frames are then
+ * declared lost, and the count is passed to the output function with
+ * the next message.
+ *
+ * Frames arriving after they were output or declared lost are late,
+ * and dropped. Frame numbers are 32 bits and may wrap around.
+ *
+ * Timeouts are only checked when a message is inserted (or
+ * poll() is called).
+ */
+class JitterBuffer {
+public:
+    struct Stats {
+        Stats() : reordered(0), late(0), duplicates(0), lost(0),
+                  maxdepth(0) {}
+        // Frames which arrived after a higher numbered one, in time.
+        unsigned long reordered;
+        // Frames which arrived too late and were dropped
+        unsigned long late;
+        unsigned long duplicates;
+        // Frames never received
+        unsigned long lost;
+        // Max number of messages held
+        unsigned int maxdepth;
+    };
+
+    /** Function called with each message, in order. lost is the count
+     *  of missing frames just before this one. The function takes
+     *  ownership of the message */
+    typedef void (*Output)(AudioMessage *m, unsigned int lost, void *arg);
+
+    /**
+     * @param window max distance, in frames, between the first
+     *    missing frame and the last held one.
+     * @param maxwaitms max time we wait for a missing frame. 0
+     *    disables the reordering: messages are output as they come.
+     */
+    JitterBuffer(unsigned int window, unsigned int maxwaitms,
+                 Output output, void *arg);
+    ~JitterBuffer();
+
+    /** Insert message. This may call the output function for this
+     *  and other messages. */
+    void insert(AudioMessage *m, unsigned int frame);
+
+    /** Check timeouts, output what's due */
+    void poll();
+
+    /** Output everything held, in order, ignoring the gaps, and
+     *  forget the current sequence (e.g. on stream halt or
+     *  reconnection). */
+    void flush();
+
+    void getStats(Stats& st) {
+        st = m_stats;
+    }
+
+private:
+    // Output the held messages in order from m_next, stopping at the
+    // first missing frame which is not before upto. If all is set,
+    // output everything held.
+    void drain(bool all, unsigned int upto);
+
+    unsigned int m_window;
+    long long m_maxwaitus;
+    Output m_output;
+    void *m_arg;
+
+    // Slots indexed by frame & m_mask
+    unsigned int m_mask;
+    AudioMessage **m_slots;
+    // Arrival times for the held messages
+    long long *m_times;
+
+    bool m_started;
+    // Next frame to output
+    unsigned int m_next;
+    // Highest frame number seen
+    unsigned int m_highest;
+    // Count of held messages
+    unsigned int m_held;
+    // Missing frames accumulated since the last output
+    unsigned int m_lost;
+    Stats m_stats;
+};
+
+#endif /* _JITTERBUF_H_INCLUDED_ */
@@ -0,0 +1,196 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include "mediaclock.h"
+#include "log.h"
+
+using namespace std;
+
+// Duration of the blocks over which we compute the transit minima
+static const long long blockus = 1000000;
+// Consecutive consistent timestamps needed before we use them
+static const int goodneeded = 4;
+// Max drift value we believe in (relative)
+static const double maxslope = 1e-3;
+
+// Convert media clock ticks to uS, avoiding overflow
+static long long ticksToMicros(long long ticks, unsigned int tickspersec)
+{
+    long long secs = ticks / tickspersec;
+    long long rem = ticks % tickspersec;
+    return secs * 1000000LL + rem * 1000000LL / tickspersec;
+}
+
+MediaClock::MediaClock()
+{
+    reset();
+}
+
+void MediaClock::reset()
+{
+    m_freq = 0;
+    m_tickspersec = 0;
+    m_lastframe = 0;
+    m_lastts = 0;
+    m_lastsamples = 0;
+    m_goodcount = -1;
+    m_ticks = 0;
+    m_latencyus = 0;
+    m_blockstart = 0;
+    m_blockmin = 0;
+    m_nb = 0;
+    m_bidx = 0;
+    m_reftime = 0;
+    m_refvalue = 0;
+    m_slope = 0;
+    m_havefit = false;
+}
+
+long long MediaClock::playTime(unsigned int frame, unsigned int timestamp,
+                               unsigned int latency, unsigned int freq,
+                               unsigned int samples, long long arrival)
+{
+    if (freq == 0 || samples == 0) {
+        return 0;
+    }
+    if (freq != m_freq) {
+        reset();
+        m_freq = freq;
+        m_tickspersec = 256 * ((freq % 44100) == 0 ? 44100 : 48000);
+    }
+
+    // Position of this packet on our extended media time line
+    long long ticks;
+    int fdist = int(frame - m_lastframe);
+    if (m_goodcount < 0) {
+        // First packet
+        m_goodcount = 0;
+        ticks = m_ticks;
+    } else if (fdist > 0) {
+        long long expected = (long long)fdist * m_lastsamples *
+            m_tickspersec / m_freq;
+        long long delta = (unsigned int)(timestamp - m_lastts);
+        if (delta < expected - expected / 10 ||
+            delta > expected + expected / 10) {
+            if (m_goodcount >= goodneeded) {
+                LOGDEB("MediaClock: timestamp discontinuity\n");
+            }
+            reset();
+            m_freq = freq;
+            m_tickspersec = 256 * ((freq % 44100) == 0 ? 44100 : 48000);
+            m_goodcount = 0;
+        } else {
+            m_ticks += delta;
+            m_goodcount++;
+        }
+        ticks = m_ticks;
+    } else {
+        // Reordered packet: place it, but don't update the state
+        ticks = m_ticks + int(timestamp - m_lastts);
+    }
+    if (fdist > 0 || m_goodcount == 0) {
+        m_lastframe = frame;
+        m_lastts = timestamp;
+        m_lastsamples = samples;
+    }
+    m_latencyus = ticksToMicros(latency, m_tickspersec);
+
+    long long mediaus = ticksToMicros(ticks, m_tickspersec);
+    long long transit = arrival - mediaus;
+    if (m_blockstart == 0 || arrival - m_blockstart >= blockus) {
+        if (m_blockstart) {
+            m_btimes[m_bidx] = m_blockstart;
+            m_bmins[m_bidx] = m_blockmin;
+            m_bidx = (m_bidx + 1) % nblocks;
+            if (m_nb < nblocks)
+                m_nb++;
+            fitLine();
+        }
+        m_blockstart = arrival;
+        m_blockmin = transit;
+    } else if (transit < m_blockmin) {
+        m_blockmin = transit;
+    }
+
+    if (m_goodcount < goodneeded) {
+        return 0;
+    }
+    return mediaus + transitAt(arrival) + m_latencyus;
+}
+
+long long MediaClock::transitAt(long long t)
+{
+    if (!m_havefit) {
+        return m_blockmin;
+    }
+    return (long long)(m_refvalue + m_slope * double(t - m_reftime));
+}
+
+// Least squares line through the block minima, then lowered so that
+// it passes under all of them.
+void MediaClock::fitLine()
+{
+    if (m_nb == 0) {
+        return;
+    }
+    int last = (m_bidx + nblocks - 1) % nblocks;
+    long long t0 = m_btimes[last];
+    double st = 0, sd = 0;
+    for (int i = 0; i < m_nb; i++) {
+        st += double(m_btimes[i] - t0);
+        sd += double(m_bmins[i] - m_bmins[last]);
+    }
+    double mt = st / m_nb, md = sd / m_nb;
+    double cov = 0, var = 0;
+    for (int i = 0; i < m_nb; i++) {
+        double dt = double(m_btimes[i] - t0) - mt;
+        double dd = double(m_bmins[i] - m_bmins[last]) - md;
+        cov += dt * dd;
+        var += dt * dt;
+    }
+    double slope = var > 0 ? cov / var : 0;
+    if (slope > maxslope)
+        slope = maxslope;
+    if (slope < -maxslope)
+        slope = -maxslope;
+    // Line value at t0, relative to the last minimum
+    double v0 = md - slope * mt;
+    double maxabove = -1e300;
+    for (int i = 0; i < m_nb; i++) {
+        double above = v0 + slope * double(m_btimes[i] - t0) -
+            double(m_bmins[i] - m_bmins[last]);
+        if (above > maxabove)
+            maxabove = above;
+    }
+    m_reftime = t0;
+    m_refvalue = double(m_bmins[last]) + v0 - maxabove;
+    m_slope = slope;
+    m_havefit = true;
+}
+
+bool MediaClock::estimates(long long *transitp, double *ppmp,
+                           long long *latencyp)
+{
+    if (m_goodcount < goodneeded) {
+        return false;
+    }
+    *transitp = transitAt(m_blockstart);
+    *ppmp = m_slope * 1e6;
+    *latencyp = m_latencyus;
+    return true;
+}
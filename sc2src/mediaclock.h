@@ -0,0 +1,108 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _MEDIACLOCK_H_INCLUDED_
+#define _MEDIACLOCK_H_INCLUDED_
+
+/**
+ * Map the Songcast sender media timestamps to the local monotonic
+ * clock (Chrono::monomicros()), for scheduling the playout.
+ *
+ * Media timestamps and latencies are expressed in ticks of 256 times
+ * the base rate of the sample rate family (44100 or 48000). The
+ * timestamps are 32 bits and wrap around every few minutes, we
+ * extend them to 64 bits.
+ *
+ * For each packet, the transit value (arrival time minus media
+ * time) is the sum of the constant clock offset, of the sender/local
+ * clock drift, and of the variable network and scheduling delay.  We
+ * keep the minima of the transit over successive 1 S blocks, and fit
+ * a line under them: this estimates offset and drift, and the least
+ * delayed packets define the timing. Receivers fed from the same
+ * sender so compute the same playout times, within the precision of
+ * the minimum transit estimates.
+ *
+ * The first packet of a message should be played at:
+ *   media time + estimated transit + media latency
+ *
+ * The timestamps are only trusted after a few consecutive packets
+ * with increments matching the sample counts. Some senders don't set
+ * them.
+ */
+class MediaClock {
+public:
+    MediaClock();
+
+    /** Compute the local play time for a packet.
+     *
+     * @param frame Songcast frame number, for checking continuity.
+     * @param timestamp media timestamp (MediaTimestamp()).
+     * @param latency media latency (MediaLatency()).
+     * @param freq sample rate.
+     * @param samples sample count in the packet (per channel).
+     * @param arrival local arrival time (monomicros()).
+     * @return local monotonic time in uS for the first sample, or 0
+     *    if the timestamps are not usable (yet).
+     */
+    long long playTime(unsigned int frame, unsigned int timestamp,
+                       unsigned int latency, unsigned int freq,
+                       unsigned int samples, long long arrival);
+
+    /** Media latency of the last packet, in uS */
+    long long latencyus() {
+        return m_latencyus;
+    }
+
+    /** Forget everything (new stream) */
+    void reset();
+
+    /** Current estimates, for logging: transit (uS) at the current
+     *  time, drift in parts per million, latency in uS. */
+    bool estimates(long long *transitp, double *ppmp, long long *latencyp);
+
+private:
+    // Transit estimate at local time t
+    long long transitAt(long long t);
+    void fitLine();
+
+    static const int nblocks = 16;
+
+    unsigned int m_freq;
+    unsigned int m_tickspersec;
+    // Continuity checking
+    unsigned int m_lastframe;
+    unsigned int m_lastts;
+    unsigned int m_lastsamples;
+    int m_goodcount;
+    // 64 bits media time in ticks
+    long long m_ticks;
+    long long m_latencyus;
+
+    // Transit minima for the last blocks: block time and value
+    long long m_blockstart;
+    long long m_blockmin;
+    long long m_btimes[nblocks];
+    long long m_bmins[nblocks];
+    int m_nb;
+    int m_bidx;
+    // Transit line: value at m_reftime, slope
+    long long m_reftime;
+    double m_refvalue;
+    double m_slope;
+    bool m_havefit;
+};
+
+#endif /* _MEDIACLOCK_H_INCLUDED_ */
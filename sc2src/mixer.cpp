@@ -0,0 +1,618 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <sstream>
+
+#include <alsa/asoundlib.h>
+#include <samplerate.h>
+
+#include "mixer.h"
+#include "rcvqueue.h"
+#include "audiokern.h"
+#include "conftree.h"
+#include "chrono.h"
+#include "histo.h"
+#include "log.h"
+
+using namespace std;
+
+#ifndef MIN
+#define MIN(A,B) (((A)<(B)) ? (A) : (B))
+#endif
+
+// Max gain change per period. A full swing (duck or unduck) takes
+// about 10 periods.
+static const float gainstep = 0.1f;
+// A priority stream keeps the others ducked this long after its
+// last non-silent data, so that they don't come up between words.
+static const unsigned int duckholdms = 500;
+// Max deviation of the resampling ratio around the nominal one
+static const double maxadj = 0.05;
+
+// Single producer (stream eater), single consumer (mixer thread) FIFO
+// of float samples.
+class FloatFifo {
+public:
+    FloatFifo() : m_mask(0), m_wr(0), m_rd(0) {}
+    void init(size_t minsize) {
+        size_t cap = 1;
+        while (cap < minsize)
+            cap <<= 1;
+        m_buf.assign(cap, 0.0f);
+        m_mask = cap - 1;
+        m_wr = m_rd = 0;
+    }
+    size_t size() const {
+        return m_wr.load(memory_order_acquire) -
+            m_rd.load(memory_order_acquire);
+    }
+    // Producer side. Returns the count actually stored.
+    size_t write(const float *data, size_t n) {
+        size_t wr = m_wr.load(memory_order_relaxed);
+        size_t rd = m_rd.load(memory_order_acquire);
+        n = MIN(n, m_buf.size() - (wr - rd));
+        copyin(wr, data, n);
+        m_wr.store(wr + n, memory_order_release);
+        return n;
+    }
+    // Consumer side. Returns the count actually read.
+    size_t read(float *data, size_t n) {
+        size_t rd = m_rd.load(memory_order_relaxed);
+        size_t wr = m_wr.load(memory_order_acquire);
+        n = MIN(n, wr - rd);
+        size_t off = rd & m_mask;
+        size_t n1 = MIN(n, m_buf.size() - off);
+        memcpy(data, &m_buf[off], n1 * sizeof(float));
+        memcpy(data + n1, &m_buf[0], (n - n1) * sizeof(float));
+        m_rd.store(rd + n, memory_order_release);
+        return n;
+    }
+    // Consumer side: drop everything
+    void discard() {
+        m_rd.store(m_wr.load(memory_order_acquire), memory_order_release);
+    }
+private:
+    void copyin(size_t wr, const float *data, size_t n) {
+        size_t off = wr & m_mask;
+        size_t n1 = MIN(n, m_buf.size() - off);
+        memcpy(&m_buf[off], data, n1 * sizeof(float));
+        memcpy(&m_buf[0], data + n1, (n - n1) * sizeof(float));
+    }
+    vector<float> m_buf;
+    size_t m_mask;
+    atomic<size_t> m_wr;
+    atomic<size_t> m_rd;
+};
+
+// Per-stream state, shared by the stream eater and the mixer thread.
+struct MixStream {
+    MixStream()
+        : gain(1.0f), priority(false), primed(false), active(false),
+          flushreq(false), curgain(0.0f), underruns(0), overruns(0) {}
+    FloatFifo fifo;
+    // Configuration
+    float gain;
+    bool priority;
+    // The FIFO reached its target level, the mixer reads it. Set by
+    // the eater, reset by the mixer on underrun.
+    atomic<bool> primed;
+    // Not silent (with duckholdms hold). Set by the eater.
+    atomic<bool> active;
+    // Set by the eater on flush: the mixer discards the FIFO data
+    atomic<bool> flushreq;
+    // Mixer side
+    float curgain;
+    unsigned long underruns;
+    // Eater side
+    unsigned long overruns;
+};
+
+static vector<MixStream*> streams;
+static unsigned int mixrate = 48000;
+static snd_pcm_uframes_t mixperiod = 1024;
+static unsigned int targetframes = 4800;
+static float duckgain = 0.25f;
+static snd_pcm_t *mixpcm;
+
+// Convert the message data to float stereo, at 16 bits scale. Mono
+// is duplicated, channels after the second one are dropped.
+static bool toFloatStereo(AudioMessage *m, vector<float>& out)
+{
+    unsigned int frames = m->frames();
+    unsigned int chans = m->m_chans;
+    unsigned int bps = m->m_bits / 8;
+    // Data is in host order, except in zero-copy mode
+#ifdef WORDS_BIGENDIAN
+    bool msbfirst = true;
+#else
+    bool msbfirst = m->m_needswap;
+#endif
+    out.resize(2 * frames);
+    const unsigned char *icp = (const unsigned char *)m->m_buf;
+    unsigned int rstep = chans > 1 ? bps : 0;
+    for (unsigned int i = 0; i < frames; i++) {
+        const unsigned char *lp = icp + i * chans * bps;
+        const unsigned char *rp = lp + rstep;
+        switch (m->m_bits) {
+        case 16:
+            if (msbfirst) {
+                out[2*i] = short((lp[0] << 8) | lp[1]);
+                out[2*i+1] = short((rp[0] << 8) | rp[1]);
+            } else {
+                out[2*i] = short((lp[1] << 8) | lp[0]);
+                out[2*i+1] = short((rp[1] << 8) | rp[0]);
+            }
+            break;
+        case 24:
+            if (msbfirst) {
+                out[2*i] = ((int((signed char)lp[0]) << 16) |
+                            (lp[1] << 8) | lp[2]) / 256.0f;
+                out[2*i+1] = ((int((signed char)rp[0]) << 16) |
+                              (rp[1] << 8) | rp[2]) / 256.0f;
+            } else {
+                out[2*i] = ((int((signed char)lp[2]) << 16) |
+                            (lp[1] << 8) | lp[0]) / 256.0f;
+                out[2*i+1] = ((int((signed char)rp[2]) << 16) |
+                              (rp[1] << 8) | rp[0]) / 256.0f;
+            }
+            break;
+        case 32:
+            if (msbfirst) {
+                out[2*i] = int((unsigned(lp[0]) << 24) | (lp[1] << 16) |
+                               (lp[2] << 8) | lp[3]) / 65536.0f;
+                out[2*i+1] = int((unsigned(rp[0]) << 24) | (rp[1] << 16) |
+                                 (rp[2] << 8) | rp[3]) / 65536.0f;
+            } else {
+                out[2*i] = int((unsigned(lp[3]) << 24) | (lp[2] << 16) |
+                               (lp[1] << 8) | lp[0]) / 65536.0f;
+                out[2*i+1] = int((unsigned(rp[3]) << 24) | (rp[2] << 16) |
+                                 (rp[1] << 8) | rp[0]) / 65536.0f;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Resample the stream data to the mixer rate, and store it in the
+// stream FIFO. The ratio is corrected according to the FIFO level,
+// which compensates the clock drift between the sender and our output.
+class StreamConverter {
+public:
+    StreamConverter(int cvt_type)
+        : m_cvttype(cvt_type), m_src(0), m_freq(0), m_ratio(1.0),
+          m_silentframes(0) {}
+    ~StreamConverter() {
+        if (m_src)
+            src_delete(m_src);
+    }
+    void reset() {
+        if (m_src)
+            src_reset(m_src);
+        m_ratio = 1.0;
+    }
+    bool process(AudioMessage *m, MixStream *s);
+private:
+    int m_cvttype;
+    SRC_STATE *m_src;
+    unsigned int m_freq;
+    // Smoothed drift correction
+    double m_ratio;
+    unsigned int m_silentframes;
+    vector<float> m_in;
+    vector<float> m_out;
+};
+
+bool StreamConverter::process(AudioMessage *m, MixStream *s)
+{
+    if (m_src == 0) {
+        int err;
+        if ((m_src = src_new(m_cvttype, 2, &err)) == 0) {
+            LOGERR("mixer: src_new failed: " << src_strerror(err) << endl);
+            return false;
+        }
+    }
+    if (m->m_freq != m_freq) {
+        LOGDEB("mixer: stream rate " << m->m_freq << endl);
+        m_freq = m->m_freq;
+        reset();
+    }
+    if (!toFloatStereo(m, m_in)) {
+        LOGERR("mixer: bad m_bits: " << m->m_bits << endl);
+        return false;
+    }
+    unsigned int frames = m->frames();
+
+    if (m->m_silent) {
+        if (m_silentframes < duckholdms * m_freq / 1000)
+            m_silentframes += frames;
+    } else {
+        m_silentframes = 0;
+    }
+    s->active = m_silentframes < duckholdms * m_freq / 1000;
+
+    // Proportional control on the FIFO level, smoothed over about
+    // 128 messages like the alsa eater filter.
+    double adj = 0.0;
+    if (s->primed) {
+        double fill = s->fifo.size() / 2.0;
+        adj = 0.1 * (targetframes - fill) / targetframes;
+        if (adj > maxadj)
+            adj = maxadj;
+        else if (adj < -maxadj)
+            adj = -maxadj;
+    }
+    m_ratio += (1.0 + adj - m_ratio) / 128.0;
+    double ratio = (double(mixrate) / m_freq) * m_ratio;
+
+    size_t outframes = size_t(frames * ratio) + 16;
+    m_out.resize(2 * outframes);
+    SRC_DATA data;
+    memset(&data, 0, sizeof(data));
+    data.data_in = &m_in[0];
+    data.input_frames = frames;
+    data.data_out = &m_out[0];
+    data.output_frames = outframes;
+    data.src_ratio = ratio;
+    data.end_of_input = 0;
+    int ret = src_process(m_src, &data);
+    if (ret) {
+        LOGERR("mixer: src_process: " << src_strerror(ret) << endl);
+        return true;
+    }
+
+    // Wait for the mixer to drop the old data before adding more
+    if (s->flushreq)
+        return true;
+    size_t n = 2 * data.output_frames_gen;
+    if (s->fifo.write(&m_out[0], n) < n) {
+        if ((s->overruns++ % 100) == 0)
+            LOGDEB("mixer: stream FIFO overrun\n");
+    }
+    if (!s->primed && s->fifo.size() / 2 >= targetframes) {
+        s->primed = true;
+    }
+    return true;
+}
+
+// Mix one period of frames from the streams. mix and tmp are
+// work buffers, the result is in mix.
+static void mixPeriod(vector<float>& mix, vector<float>& tmp, size_t frames)
+{
+    size_t n = 2 * frames;
+    mix.assign(n, 0.0f);
+    tmp.resize(n);
+
+    bool duck = false;
+    for (unsigned int i = 0; i < streams.size(); i++) {
+        MixStream *s = streams[i];
+        if (s->priority && s->primed && s->active)
+            duck = true;
+    }
+
+    for (unsigned int i = 0; i < streams.size(); i++) {
+        MixStream *s = streams[i];
+        if (s->flushreq) {
+            s->fifo.discard();
+            s->primed = false;
+            s->flushreq = false;
+        }
+        if (!s->primed) {
+            // Fade in when it starts
+            s->curgain = 0.0f;
+            continue;
+        }
+        float target = s->gain;
+        if (duck && !s->priority)
+            target *= duckgain;
+        float g0 = s->curgain;
+        float g1 = target;
+        if (g1 > g0 + gainstep)
+            g1 = g0 + gainstep;
+        else if (g1 < g0 - gainstep)
+            g1 = g0 - gainstep;
+        s->curgain = g1;
+
+        size_t got = s->fifo.read(&tmp[0], n);
+        if (got < n) {
+            // Let the eater fill up to the target again
+            s->primed = false;
+            if ((s->underruns++ % 100) == 0)
+                LOGDEB("mixer: stream " << i << " underrun\n");
+        }
+        if (got)
+            audioMixAdd(&mix[0], &tmp[0], got, g0, g0 + (g1 - g0) * got / n);
+    }
+}
+
+static void *mixerThread(void *)
+{
+    vector<float> mix, tmp;
+    vector<short> out(2 * mixperiod);
+    while (true) {
+        mixPeriod(mix, tmp, mixperiod);
+        audioFloatToS16(&out[0], &mix[0], 2 * mixperiod);
+        snd_pcm_sframes_t ret = snd_pcm_writei(mixpcm, &out[0], mixperiod);
+        if (ret < 0) {
+            LOGDEB("mixer: snd_pcm_writei: " << snd_strerror(ret) << endl);
+            if (snd_pcm_recover(mixpcm, ret, 1) < 0) {
+                LOGERR("mixer: snd_pcm_recover failed: " <<
+                       snd_strerror(ret) << endl);
+                return (void*)1;
+            }
+        }
+    }
+    return (void*)0;
+}
+
+// Parse a space-separated list of values from the configuration
+static vector<string> confList(ConfSimple& config, const string& nm)
+{
+    vector<string> out;
+    string value;
+    if (config.get(nm, value)) {
+        istringstream str(value);
+        string s;
+        while (str >> s)
+            out.push_back(s);
+    }
+    return out;
+}
+
+static void setupStreams(ConfSimple& config, unsigned int nstreams)
+{
+    string value;
+    if (config.get("scmixduckgain", value)) {
+        duckgain = atof(value.c_str());
+    }
+    vector<string> gains = confList(config, "scmixgains");
+    vector<string> prios = confList(config, "scmixpriority");
+    for (unsigned int i = 0; i < nstreams; i++) {
+        MixStream *s = new MixStream;
+        // Room for the target level, plus the mixer and eater
+        // bursts, plus the controller overshoot.
+        s->fifo.init(2 * 4 * (targetframes + mixperiod));
+        if (i < gains.size())
+            s->gain = atof(gains[i].c_str());
+        streams.push_back(s);
+    }
+    for (unsigned int i = 0; i < prios.size(); i++) {
+        unsigned int idx = atoi(prios[i].c_str());
+        if (idx < streams.size())
+            streams[idx]->priority = true;
+    }
+}
+
+bool mixerInit(ConfSimple& config, unsigned int nstreams)
+{
+    string value;
+    if (config.get("scmixrate", value)) {
+        mixrate = atoi(value.c_str());
+    }
+    unsigned int targetms = 100;
+    if (config.get("scmixtargetms", value)) {
+        targetms = atoi(value.c_str());
+    }
+    string dev("default");
+    config.get("scalsadevice", dev);
+
+    int err;
+    if ((err = snd_pcm_open(&mixpcm, dev.c_str(),
+                            SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        LOGERR("mixerInit: snd_pcm_open " << dev << " " <<
+               snd_strerror(err) << endl);
+        return false;
+    }
+    if ((err = snd_pcm_set_params(mixpcm, SND_PCM_FORMAT_S16,
+                                  SND_PCM_ACCESS_RW_INTERLEAVED, 2, mixrate,
+                                  1, 100000)) < 0) {
+        LOGERR("mixerInit: snd_pcm_set_params " << mixrate << " Hz: " <<
+               snd_strerror(err) << endl);
+        snd_pcm_close(mixpcm);
+        return false;
+    }
+    snd_pcm_uframes_t bufsize;
+    if (snd_pcm_get_params(mixpcm, &bufsize, &mixperiod) < 0 ||
+        mixperiod == 0) {
+        mixperiod = 1024;
+    }
+    // The mixer takes a period at a time: the target must be above
+    targetframes = targetms * mixrate / 1000;
+    if (targetframes < 2 * mixperiod)
+        targetframes = 2 * mixperiod;
+
+    setupStreams(config, nstreams);
+
+    pthread_t thr;
+    if (pthread_create(&thr, 0, mixerThread, 0) != 0) {
+        LOGERR("mixerInit: pthread_create failed\n");
+        return false;
+    }
+    pthread_detach(thr);
+    LOGINF("mixer: " << nstreams << " streams, " << mixrate << " Hz, period " <<
+           mixperiod << " frames, target " << targetframes << " frames, " <<
+           audioKernelsImpl() << " kernels\n");
+    return true;
+}
+
+static void *mixEater(void *cls)
+{
+    AudioEater::Context *ctxt = (AudioEater::Context*)cls;
+    AudioQueue *queue = ctxt->queue;
+    unsigned int idx = ctxt->stream;
+    delete ctxt;
+
+    if (idx >= streams.size()) {
+        LOGERR("mixEater: bad stream index " << idx << endl);
+        queue->workerExit();
+        return (void*)1;
+    }
+    MixStream *s = streams[idx];
+    StreamConverter conv(SRC_SINC_FASTEST);
+
+    while (true) {
+        AudioMessage *tsk = 0;
+        size_t qsz;
+        if (!queue->take(&tsk, &qsz)) {
+            LOGDEB("mixEater: queue take failed\n");
+            queue->workerExit();
+            return (void*)1;
+        }
+        tsk->m_stamps[AudioMessage::STG_DEQUEUE] = Chrono::monomicros();
+
+        if (tsk->m_flush) {
+            LOGDEB("mixEater: stream " << idx << " flush\n");
+            s->flushreq = true;
+            s->active = false;
+            conv.reset();
+            AudioMessage::release(tsk);
+            continue;
+        }
+        if (tsk->m_bytes == 0 || tsk->m_chans == 0 || tsk->m_bits == 0) {
+            AudioMessage::release(tsk);
+            continue;
+        }
+
+        if (!conv.process(tsk, s)) {
+            AudioMessage::release(tsk);
+            queue->workerExit();
+            return (void*)1;
+        }
+        // The output time is not known here, the FIFO level is
+        // the remaining latency.
+        tsk->m_stamps[AudioMessage::STG_CONVERTED] = Chrono::monomicros();
+        latencyRecord(tsk);
+        latencyFirstSample(tsk);
+        AudioMessage::release(tsk);
+    }
+}
+
+AudioEater mixAudioEater(AudioEater::BO_HOST, &mixEater);
+
+#ifdef TEST_MIXER
+// How many streams can we mix in real time: each stream is a 44100 Hz
+// 16 bits stereo tone in 441 frames packets (Songcast 10 mS),
+// resampled to 48000 Hz and mixed, as in the receiver. Reports the
+// CPU use for one second of audio, for growing stream counts.
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static double cpuSeconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// 441 frames at 44100 Hz hold a whole number of periods of a multiple
+// of 100 Hz, so the same message can be sent repeatedly.
+static AudioMessage *makeTone(double freq)
+{
+    unsigned int frames = 441;
+    unsigned int bytes = frames * 4;
+    AudioMessage *m =
+        new AudioMessage(16, 2, frames, 44100, (char *)malloc(bytes), bytes);
+    short *sp = (short *)m->m_buf;
+    for (unsigned int i = 0; i < frames; i++) {
+        short v = short(8000 * sin(2 * M_PI * freq * i / 44100));
+        sp[2*i] = sp[2*i+1] = v;
+    }
+    return m;
+}
+
+static void Usage()
+{
+    fprintf(stderr, "trmixer [seconds [maxstreams]]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = 5;
+    unsigned int maxstreams = 32;
+    if (argc > 3)
+        Usage();
+    if (argc > 1 && (seconds = atoi(argv[1])) <= 0)
+        Usage();
+    if (argc > 2 && (maxstreams = atoi(argv[2])) == 0)
+        Usage();
+
+    Logger::getTheLog("")->setLogLevel(Logger::LLERR);
+    mixperiod = 1024;
+    targetframes = 2 * mixperiod;
+    printf("Kernels: %s, SRC_SINC_FASTEST 44100 -> %u Hz, period %u\n",
+           audioKernelsImpl(), mixrate, (unsigned int)mixperiod);
+
+    vector<float> mix, tmp;
+    vector<short> out(2 * mixperiod);
+    unsigned int best = 0;
+    for (unsigned int nstreams = 1; nstreams <= maxstreams; nstreams *= 2) {
+        for (unsigned int i = 0; i < streams.size(); i++)
+            delete streams[i];
+        streams.clear();
+        ConfSimple config(1);
+        setupStreams(config, nstreams);
+        vector<StreamConverter*> convs;
+        vector<AudioMessage*> tones;
+        for (unsigned int i = 0; i < nstreams; i++) {
+            convs.push_back(new StreamConverter(SRC_SINC_FASTEST));
+            tones.push_back(makeTone(100.0 * (i + 1)));
+            streams[i]->primed = true;
+            streams[i]->active = true;
+        }
+
+        unsigned int periods = seconds * mixrate / mixperiod;
+        double t0 = cpuSeconds();
+        for (unsigned int p = 0; p < periods; p++) {
+            for (unsigned int i = 0; i < nstreams; i++) {
+                while (streams[i]->fifo.size() / 2 < mixperiod) {
+                    convs[i]->process(tones[i], streams[i]);
+                }
+            }
+            mixPeriod(mix, tmp, mixperiod);
+            audioFloatToS16(&out[0], &mix[0], 2 * mixperiod);
+        }
+        double load = 100.0 * (cpuSeconds() - t0) /
+            (double(periods) * mixperiod / mixrate);
+        printf("%3u streams: %5.1f%% of one core\n", nstreams, load);
+        for (unsigned int i = 0; i < nstreams; i++) {
+            delete convs[i];
+            delete tones[i];
+        }
+        if (load < 70.0)
+            best = nstreams;
+        if (load > 100.0)
+            break;
+    }
+    printf("Sustainable with 30%% margin: %u streams\n", best);
+    return 0;
+}
+#endif // TEST_MIXER
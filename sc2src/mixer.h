@@ -0,0 +1,49 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _MIXER_H_INCLUDED_
+#define _MIXER_H_INCLUDED_
+
+class ConfSimple;
+
+/**
+ * Multi-stream mode: several receivers play at the same time through
+ * a single alsa output, e.g. an announcement channel over music.
+ *
+ * Each receiver has its own audio queue and eater (mixAudioEater,
+ * declared in rcvqueue.h, the stream index is in the eater
+ * context). The eater converts the data to float stereo, resamples
+ * it to the mixer rate, and puts it in the stream FIFO. The
+ * resampling ratio is adjusted to keep the FIFO at its target level,
+ * which tracks the drift between the stream clock and the output one.
+ *
+ * The mixer thread takes one alsa period from each stream FIFO,
+ * applies the stream gains and ducking (the priority streams lower
+ * the others while they are not silent), sums in float, and writes
+ * 16 bits samples to alsa. It writes continuously, silence if no
+ * stream is playing, so the output clock is always running.
+ *
+ * Configuration: scmixrate (output rate, default 48000), scmixgains
+ * (one gain per stream, default 1), scmixpriority (indexes of the
+ * streams which duck the others), scmixduckgain (default 0.25),
+ * scmixtargetms (FIFO target level, default 100).
+ */
+
+/** Open the output and start the mixer thread for nstreams streams.
+ *  Must be called before the receivers are started. */
+extern bool mixerInit(ConfSimple& config, unsigned int nstreams);
+
+#endif /* _MIXER_H_INCLUDED_ */
@@ -0,0 +1,277 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <new>
+
+#include "msgpool.h"
+#include "rcvqueue.h"
+#include "log.h"
+
+using namespace std;
+
+// Alignment for the blocks and the payload areas
+static const unsigned int blockalign = 64;
+// Huge page size used for rounding the arena size.
+static const size_t hugepagesize = 2 * 1024 * 1024;
+
+static inline size_t roundup(size_t sz, size_t align)
+{
+    return (sz + align - 1) / align * align;
+}
+
+AudioMessagePool::AudioMessagePool(unsigned int payloadbytes,
+                                   unsigned int count, bool hugepages)
+    : m_payloadbytes(roundup(payloadbytes, blockalign)),
+      m_maxblocks(4 * count), m_arena(0), m_arenabytes(0),
+      m_arenablocks(0), m_arenammapped(false), m_nblocks(0), m_head(0),
+      m_hits(0), m_misses(0), m_oversize(0), m_outstanding(0),
+      m_highwater(0)
+{
+    m_blockbytes = roundup(sizeof(AudioMessage), blockalign) + m_payloadbytes;
+    // Zeroed: a slot may stay unused if a block allocation fails
+    m_blocks = new char*[m_maxblocks]();
+    m_next = new std::atomic<uint32_t>[m_maxblocks];
+
+    m_arenabytes = size_t(m_blockbytes) * count;
+    void *cp = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+        size_t hugebytes = roundup(m_arenabytes, hugepagesize);
+        cp = mmap(0, hugebytes, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (cp == MAP_FAILED) {
+            LOGDEB("AudioMessagePool: no hugetlb pages, using madvise\n");
+        } else {
+            m_arenabytes = hugebytes;
+        }
+    }
+#endif
+    if (cp == MAP_FAILED) {
+        cp = mmap(0, m_arenabytes, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (hugepages && cp != MAP_FAILED) {
+            madvise(cp, m_arenabytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (cp == MAP_FAILED) {
+        LOGERR("AudioMessagePool: arena mmap failed. errno " << errno << endl);
+        m_arenabytes = 0;
+        return;
+    }
+    m_arena = (char *)cp;
+    m_arenammapped = true;
+    // Use the whole arena, which may have been rounded up to the
+    // huge page size
+    count = m_arenabytes / m_blockbytes;
+    if (count > m_maxblocks)
+        count = m_maxblocks;
+    m_arenablocks = count;
+    // Touch everything now so that we don't take page faults on the
+    // network thread later.
+    memset(m_arena, 0, m_arenabytes);
+
+    for (unsigned int i = 0; i < count; i++) {
+        m_blocks[i] = m_arena + size_t(i) * m_blockbytes;
+    }
+    m_nblocks = count;
+    for (unsigned int i = count; i > 0; i--) {
+        push(i - 1);
+    }
+    LOGDEB("AudioMessagePool: " << count << " blocks of " << m_payloadbytes <<
+           " bytes. Arena " << m_arenabytes << " bytes\n");
+}
+
+AudioMessagePool::~AudioMessagePool()
+{
+    for (unsigned int i = m_arenablocks; i < m_nblocks; i++) {
+        free(m_blocks[i]);
+    }
+    if (m_arenammapped) {
+        munmap(m_arena, m_arenabytes);
+    }
+    delete [] m_blocks;
+    delete [] m_next;
+}
+
+bool AudioMessagePool::pop(unsigned int *idxp)
+{
+    uint64_t head = m_head.load();
+    for (;;) {
+        uint32_t idx1 = uint32_t(head);
+        if (idx1 == 0) {
+            return false;
+        }
+        // The next value may be garbage if the block was concurrently
+        // popped, but the CAS will fail in this case because the
+        // counter changed.
+        uint64_t nhead = (((head >> 32) + 1) << 32) |
+            m_next[idx1 - 1].load();
+        if (m_head.compare_exchange_weak(head, nhead)) {
+            *idxp = idx1 - 1;
+            return true;
+        }
+    }
+}
+
+void AudioMessagePool::push(unsigned int idx)
+{
+    uint64_t head = m_head.load();
+    for (;;) {
+        m_next[idx] = uint32_t(head);
+        uint64_t nhead = (((head >> 32) + 1) << 32) | (idx + 1);
+        if (m_head.compare_exchange_weak(head, nhead)) {
+            return;
+        }
+    }
+}
+
+AudioMessage *AudioMessagePool::initblock(unsigned int idx, unsigned int bits,
+                                          unsigned int chans,
+                                          unsigned int frames,
+                                          unsigned int freq)
+{
+    char *block = m_blocks[idx];
+    char *payload = block + (m_blockbytes - m_payloadbytes);
+    AudioMessage *m =
+        new(block) AudioMessage(bits, chans, frames, freq, payload,
+                                m_payloadbytes);
+    m->m_pool = this;
+    m->m_poolidx = idx;
+    m->m_inlbuf = payload;
+
+    long outs = ++m_outstanding;
+    long hw = m_highwater.load();
+    while (outs > hw && !m_highwater.compare_exchange_weak(hw, outs))
+        ;
+    return m;
+}
+
+AudioMessage *AudioMessagePool::get(unsigned int bits, unsigned int chans,
+                                    unsigned int frames, unsigned int freq)
+{
+    unsigned int bytes = (bits / 8) * chans * frames;
+    if (bytes <= m_payloadbytes) {
+        unsigned int idx;
+        if (pop(&idx)) {
+            m_hits++;
+            return initblock(idx, bits, chans, frames, freq);
+        }
+        // Grow the pool. The new block will be recycled
+        idx = m_nblocks.load();
+        while (idx < m_maxblocks &&
+               !m_nblocks.compare_exchange_weak(idx, idx + 1))
+            ;
+        if (idx < m_maxblocks) {
+            void *block;
+            if (posix_memalign(&block, blockalign, m_blockbytes) == 0) {
+                m_misses++;
+                m_blocks[idx] = (char *)block;
+                return initblock(idx, bits, chans, frames, freq);
+            }
+            // Can't undo the increment: the slot stays unused.
+            LOGERR("AudioMessagePool::get: out of memory\n");
+        }
+    } else {
+        m_oversize++;
+    }
+
+    // Plain heap message.
+    m_misses++;
+    // We allocate a bit more space to avoid reallocations in the resampler
+    unsigned int allocbytes = bytes + 100;
+    char *buf = (char *)malloc(allocbytes);
+    if (buf == 0) {
+        LOGERR("AudioMessagePool::get: can't allocate " << bytes <<
+               " bytes\n");
+        return 0;
+    }
+    return new AudioMessage(bits, chans, frames, freq, buf, allocbytes);
+}
+
+void AudioMessagePool::put(AudioMessage *m)
+{
+    unsigned int idx = m->m_poolidx;
+    m->~AudioMessage();
+    m_outstanding--;
+    push(idx);
+}
+
+void AudioMessagePool::getStats(Stats& st)
+{
+    st.hits = m_hits;
+    st.misses = m_misses;
+    st.oversize = m_oversize;
+    st.outstanding = m_outstanding;
+    st.highwater = m_highwater;
+    st.blocks = m_nblocks;
+}
+
+bool AudioMessage::reserve(unsigned int bytes, bool keep)
+{
+    if (m_ref == 0 && bytes <= m_allocbytes) {
+        return true;
+    }
+    char *buf;
+    if (m_ref || m_buf == m_inlbuf) {
+        // External or pool buffer: can't realloc. Use the pool
+        // payload area if it is free and big enough, else move the
+        // data to the heap. This will be freed by the destructor when
+        // the message is released.
+        if (m_ref && m_inlbuf && bytes <= m_pool->payloadBytes()) {
+            buf = m_inlbuf;
+            bytes = m_pool->payloadBytes();
+        } else {
+            buf = (char *)malloc(bytes);
+        }
+        if (buf && m_buf && keep) {
+            memcpy(buf, m_buf, m_bytes);
+        }
+    } else {
+        buf = (char *)realloc(m_buf, bytes);
+    }
+    if (buf == 0) {
+        return false;
+    }
+    if (m_ref) {
+        m_unref(m_ref);
+        m_ref = 0;
+        m_unref = 0;
+    }
+    m_buf = buf;
+    m_allocbytes = bytes;
+    return true;
+}
+
+void AudioMessage::release(AudioMessage *m)
+{
+    if (m == 0) {
+        return;
+    }
+    if (m->m_pool) {
+        m->m_pool->put(m);
+    } else {
+        delete m;
+    }
+}
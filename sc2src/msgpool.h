@@ -0,0 +1,115 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _MSGPOOL_H_INCLUDED_
+#define _MSGPOOL_H_INCLUDED_
+
+#include <stdint.h>
+
+#include <atomic>
+
+class AudioMessage;
+
+/**
+ * Recycling allocator for AudioMessage objects.
+ *
+ * Each pool block holds the message header immediately followed by
+ * a fixed-size payload area, so that getting a message is a single
+ * free list pop, and releasing it (AudioMessage::release()) a single
+ * push, with no heap operation. The initial blocks are carved out of
+ * one arena, which we try to get from huge pages.
+ *
+ * When the free list is empty, a new block is allocated and will be
+ * recycled from then on, so the pool grows to the steady-state need
+ * of the pipeline, up to a fixed maximum. Requests for more than the
+ * block payload size, or beyond the maximum block count, get a plain
+ * heap message, which is deleted when released.
+ *
+ * get() and put() are lock-free and can be called from any thread.
+ */
+class AudioMessagePool {
+public:
+    struct Stats {
+        Stats() : hits(0), misses(0), oversize(0), outstanding(0),
+                  highwater(0), blocks(0) {}
+        // get() calls satisfied from the free list
+        unsigned long hits;
+        // get() calls which needed an allocation (new pool block or
+        // plain heap message)
+        unsigned long misses;
+        // misses because the request was bigger than a pool block
+        unsigned long oversize;
+        // pool blocks currently in use, and max value
+        unsigned long outstanding;
+        unsigned long highwater;
+        // total pool blocks (preallocated + grown)
+        unsigned long blocks;
+    };
+
+    /**
+     * @param payloadbytes the buffer size for each block.
+     * @param count number of preallocated blocks. The pool can grow
+     *    to 4 times this.
+     * @param hugepages try to back the arena with huge pages.
+     */
+    AudioMessagePool(unsigned int payloadbytes, unsigned int count,
+                     bool hugepages);
+    ~AudioMessagePool();
+
+    /** Get a message with a buffer for at least the specified
+     *  audio data. m_bytes is set for the data, m_buf is uninitialized */
+    AudioMessage *get(unsigned int bits, unsigned int chans,
+                      unsigned int frames, unsigned int freq);
+
+    /** Give back a message. Normally called by AudioMessage::release() */
+    void put(AudioMessage *m);
+
+    unsigned int payloadBytes() {
+        return m_payloadbytes;
+    }
+    void getStats(Stats& st);
+
+private:
+    // Free list operations. Blocks are designated by their index in
+    // m_blocks. The list head holds index+1 (0 for empty) in the low
+    // 32 bits and a change counter in the high bits to avoid ABA
+    // problems.
+    bool pop(unsigned int *idxp);
+    void push(unsigned int idx);
+    AudioMessage *initblock(unsigned int idx, unsigned int bits,
+                            unsigned int chans, unsigned int frames,
+                            unsigned int freq);
+
+    unsigned int m_payloadbytes;
+    unsigned int m_blockbytes;
+    unsigned int m_maxblocks;
+    char *m_arena;
+    size_t m_arenabytes;
+    unsigned int m_arenablocks;
+    bool m_arenammapped;
+    char **m_blocks;
+    std::atomic<unsigned int> m_nblocks;
+    std::atomic<uint32_t> *m_next;
+    std::atomic<uint64_t> m_head;
+
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_oversize;
+    std::atomic<long> m_outstanding;
+    std::atomic<long> m_highwater;
+};
+
+#endif /* _MSGPOOL_H_INCLUDED_ */
@@ -0,0 +1,570 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nativerecv.h"
+#include "chrono.h"
+#include "log.h"
+
+using namespace std;
+
+// Ohm message header: "Ohm ", version, type, total bytes (be16)
+static const unsigned int ohmheaderbytes = 8;
+enum OhmType {OHM_JOIN = 0, OHM_LISTEN = 1, OHM_LEAVE = 2, OHM_AUDIO = 3,
+              OHM_TRACK = 4, OHM_METATEXT = 5, OHM_SLAVE = 6};
+// Fixed part of the audio message header, before the codec name
+static const unsigned int audioheaderbytes = 50;
+static const unsigned char audioflaghalt = 1;
+
+// Receive buffer size per message. The Songcast packets are much
+// smaller, even at 192 kHz.
+static const unsigned int bufsize = 16384;
+// Join until we get audio, then Listen, to stay in the sender list
+static const long long joinus = 300000;
+static const long long listenus = 1000000;
+// Back to Join after this many Listen intervals without audio (the
+// sender restarted, or dropped us from its list)
+static const unsigned int listenmisses = 3;
+// Statistics log interval
+static const long long statsus = 10000000;
+
+static inline unsigned int be16(const unsigned char *cp)
+{
+    return (cp[0] << 8) | cp[1];
+}
+static inline unsigned int be32(const unsigned char *cp)
+{
+    return (unsigned(cp[0]) << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+NativeReceiver::NativeReceiver(uint32_t adapter, unsigned int ttl,
+                               unsigned int batch, Handler handler, void *arg)
+    : m_adapter(adapter), m_ttl(ttl), m_batch(batch ? batch : 1),
+      m_handler(handler), m_arg(arg), m_fd(-1), m_multicast(false),
+      m_addr(0), m_port(0), m_running(false), m_stop(false),
+      m_joined(false), m_slavewarned(false), m_havelast(false),
+      m_lastframe(0), m_lastrecv(0), m_lastdurus(0)
+{
+#ifndef HAVE_RECVMMSG
+    m_batch = 1;
+#endif
+    m_bufs.resize(m_batch * bufsize);
+}
+
+NativeReceiver::~NativeReceiver()
+{
+    stop();
+}
+
+void NativeReceiver::getStats(Stats& st)
+{
+    PTMutexLocker lock(m_statsmutex);
+    st = m_stats;
+}
+
+bool NativeReceiver::play(const string& uri)
+{
+    stop();
+
+    string::size_type sep = uri.find("://");
+    if (sep == string::npos) {
+        LOGERR("NativeReceiver: bad uri " << uri << endl);
+        return false;
+    }
+    string scheme = uri.substr(0, sep);
+    if (scheme == "ohm") {
+        m_multicast = true;
+    } else if (scheme == "ohu") {
+        m_multicast = false;
+    } else {
+        LOGERR("NativeReceiver: unsupported uri (not ohm:// or ohu://): " <<
+               uri << endl);
+        return false;
+    }
+    string hostport = uri.substr(sep + 3);
+    string::size_type colon = hostport.find(':');
+    struct in_addr addr;
+    if (colon == string::npos ||
+        inet_pton(AF_INET, hostport.substr(0, colon).c_str(), &addr) != 1) {
+        LOGERR("NativeReceiver: bad uri " << uri << endl);
+        return false;
+    }
+    m_addr = addr.s_addr;
+    m_port = htons(atoi(hostport.substr(colon + 1).c_str()));
+
+    if (!setupSocket()) {
+        return false;
+    }
+    m_stop = false;
+    m_joined = false;
+    m_havelast = false;
+    if (pthread_create(&m_thread, 0, threadFunc, this) != 0) {
+        LOGERR("NativeReceiver: pthread_create failed\n");
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_running = true;
+    LOGDEB("NativeReceiver: receiving from " << uri << ", batch " <<
+           m_batch << endl);
+    return true;
+}
+
+void NativeReceiver::stop()
+{
+    if (!m_running) {
+        return;
+    }
+    m_stop = true;
+    pthread_join(m_thread, 0);
+    m_running = false;
+    sendCtl(OHM_LEAVE);
+    close(m_fd);
+    m_fd = -1;
+
+    OhmAudio halt;
+    memset(&halt, 0, sizeof(halt));
+    halt.halt = true;
+    halt.recvus = Chrono::monomicros();
+    m_handler(halt, m_arg);
+}
+
+bool NativeReceiver::setupSocket()
+{
+    if ((m_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        LOGERR("NativeReceiver: socket: errno " << errno << endl);
+        return false;
+    }
+    int one = 1;
+    if (setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+        LOGINF("NativeReceiver: no kernel timestamps: errno " << errno << endl);
+    }
+    // Room for a few hundred mS of audio if we are late
+    int rcvbuf = 1024 * 1024;
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (m_multicast) {
+        // All the receivers listen on the group port
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sa.sin_port = m_port;
+    }
+    if (bind(m_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        LOGERR("NativeReceiver: bind: errno " << errno << endl);
+        goto error;
+    }
+    if (m_multicast) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = m_addr;
+        mreq.imr_interface.s_addr = m_adapter;
+        if (setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                       &mreq, sizeof(mreq)) < 0) {
+            LOGERR("NativeReceiver: IP_ADD_MEMBERSHIP: errno " << errno <<
+                   endl);
+            goto error;
+        }
+        struct in_addr ifaddr;
+        ifaddr.s_addr = m_adapter;
+        setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+        unsigned char ttl = m_ttl;
+        setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    }
+    return true;
+
+error:
+    close(m_fd);
+    m_fd = -1;
+    return false;
+}
+
+// Join, Listen and Leave go to the sender, or to the group, where
+// the sender is listening.
+void NativeReceiver::sendCtl(int type)
+{
+    unsigned char msg[ohmheaderbytes] =
+        {'O', 'h', 'm', ' ', 1, (unsigned char)type, 0, ohmheaderbytes};
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = m_addr;
+    sa.sin_port = m_port;
+    if (sendto(m_fd, msg, sizeof(msg), 0, (struct sockaddr *)&sa,
+               sizeof(sa)) < 0) {
+        LOGDEB("NativeReceiver: sendto: errno " << errno << endl);
+    }
+}
+
+void *NativeReceiver::threadFunc(void *arg)
+{
+    ((NativeReceiver *)arg)->run();
+    return 0;
+}
+
+void NativeReceiver::processPacket(const unsigned char *cp, unsigned int len,
+                                   long long recvus)
+{
+    if (len < ohmheaderbytes || memcmp(cp, "Ohm ", 4) || cp[4] != 1 ||
+        be16(cp + 6) > len || be16(cp + 6) < ohmheaderbytes) {
+        m_cur.invalid++;
+        return;
+    }
+    unsigned int total = be16(cp + 6);
+    switch (cp[5]) {
+    case OHM_AUDIO:
+        break;
+    case OHM_SLAVE:
+        if (!m_slavewarned) {
+            LOGINF("NativeReceiver: the sender asks us to forward the "
+                   "stream, which we don't do. Use multicast, or the "
+                   "ohNet receiver.\n");
+            m_slavewarned = true;
+        }
+        return;
+    default:
+        // Track, metatext, and other receivers' Join/Listen (multicast)
+        return;
+    }
+
+    const unsigned char *ap = cp + ohmheaderbytes;
+    unsigned int alen = total - ohmheaderbytes;
+    if (alen < audioheaderbytes || ap[0] < audioheaderbytes ||
+        unsigned(ap[0]) + ap[49] > alen) {
+        m_cur.invalid++;
+        return;
+    }
+    OhmAudio msg;
+    msg.halt = (ap[1] & audioflaghalt) != 0;
+    msg.samples = be16(ap + 2);
+    msg.frame = be32(ap + 4);
+    msg.medialatency = be32(ap + 12);
+    msg.mediatimestamp = be32(ap + 16);
+    msg.freq = be32(ap + 36);
+    msg.bits = ap[46];
+    msg.chans = ap[47];
+    unsigned int offs = ap[0] + ap[49];
+    msg.data = ap + offs;
+    msg.bytes = alen - offs;
+    msg.recvus = recvus;
+    if (msg.freq == 0 || msg.chans == 0 || (msg.bits != 16 && msg.bits != 24 &&
+                                            msg.bits != 32)) {
+        m_cur.invalid++;
+        return;
+    }
+    m_joined = true;
+
+    // Interarrival jitter, on consecutive frames: difference between
+    // the arrival interval and the audio duration, smoothed as in
+    // RFC 3550.
+    if (m_havelast && msg.frame == m_lastframe + 1) {
+        long long d = (recvus - m_lastrecv) - m_lastdurus;
+        if (d < 0)
+            d = -d;
+        m_cur.jitterus += (d - m_cur.jitterus) / 16.0;
+    }
+    m_havelast = true;
+    m_lastframe = msg.frame;
+    m_lastrecv = recvus;
+    m_lastdurus = (long long)msg.samples * 1000000 / msg.freq;
+
+    m_handler(msg, m_arg);
+}
+
+static long long realmicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Kernel receive time of a message, converted to the monotonic time base
+static long long recvTime(struct msghdr *mh, long long realnow,
+                          long long mononow)
+{
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(mh); cm != 0;
+         cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            long long real = (long long)ts.tv_sec * 1000000LL +
+                ts.tv_nsec / 1000;
+            return mononow - (realnow - real);
+        }
+    }
+    return mononow;
+}
+
+void NativeReceiver::run()
+{
+    const size_t ctlsize = CMSG_SPACE(sizeof(struct timespec));
+    vector<struct iovec> iovs(m_batch);
+    vector<char> ctls(m_batch * ctlsize);
+#ifdef HAVE_RECVMMSG
+    vector<struct mmsghdr> msgs(m_batch);
+#else
+    vector<struct msghdr> hdrs(m_batch);
+#endif
+    for (unsigned int i = 0; i < m_batch; i++) {
+        iovs[i].iov_base = &m_bufs[i * bufsize];
+        iovs[i].iov_len = bufsize;
+    }
+
+    sendCtl(OHM_JOIN);
+    long long lastctl = Chrono::monomicros();
+    long long laststats = lastctl;
+    while (!m_stop) {
+        struct pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, 100);
+        long long now = Chrono::monomicros();
+        if (m_joined && now - m_lastrecv >= listenmisses * listenus) {
+            LOGINF("NativeReceiver: no audio for " <<
+                   (now - m_lastrecv) / 1000 << " mS: joining again\n");
+            m_joined = false;
+            lastctl = 0;
+        }
+        if (now - lastctl >= (m_joined ? listenus : joinus)) {
+            sendCtl(m_joined ? OHM_LISTEN : OHM_JOIN);
+            lastctl = now;
+        }
+        if (now - laststats >= statsus) {
+            LOGDEB("NativeReceiver: packets " << m_cur.packets << " calls " <<
+                   m_cur.calls << " maxbatch " << m_cur.maxbatch <<
+                   " truncated " << m_cur.truncated << " invalid " <<
+                   m_cur.invalid << " jitter-uS " << int(m_cur.jitterus) <<
+                   endl);
+            laststats = now;
+        }
+        if (ret <= 0) {
+            if (ret < 0 && errno != EINTR) {
+                LOGERR("NativeReceiver: poll: errno " << errno << endl);
+                break;
+            }
+            continue;
+        }
+
+        // The msghdr lengths are updated by the calls: reset them
+        for (unsigned int i = 0; i < m_batch; i++) {
+#ifdef HAVE_RECVMMSG
+            struct msghdr *mh = &msgs[i].msg_hdr;
+#else
+            struct msghdr *mh = &hdrs[i];
+#endif
+            memset(mh, 0, sizeof(*mh));
+            mh->msg_iov = &iovs[i];
+            mh->msg_iovlen = 1;
+            mh->msg_control = &ctls[i * ctlsize];
+            mh->msg_controllen = ctlsize;
+        }
+#ifdef HAVE_RECVMMSG
+        int n = recvmmsg(m_fd, &msgs[0], m_batch, MSG_DONTWAIT, 0);
+#else
+        ssize_t len = recvmsg(m_fd, &hdrs[0], MSG_DONTWAIT);
+        int n = len < 0 ? -1 : 1;
+#endif
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+                LOGERR("NativeReceiver: recv: errno " << errno << endl);
+                break;
+            }
+            continue;
+        }
+
+        long long realnow = realmicros();
+        long long mononow = Chrono::monomicros();
+        for (int i = 0; i < n; i++) {
+#ifdef HAVE_RECVMMSG
+            struct msghdr *mh = &msgs[i].msg_hdr;
+            unsigned int len = msgs[i].msg_len;
+#else
+            struct msghdr *mh = &hdrs[i];
+#endif
+            if (mh->msg_flags & MSG_TRUNC) {
+                m_cur.truncated++;
+                continue;
+            }
+            m_cur.packets++;
+            m_cur.bytes += len;
+            processPacket(&m_bufs[i * bufsize], len,
+                          recvTime(mh, realnow, mononow));
+        }
+        m_cur.calls++;
+        if (unsigned(n) > m_cur.maxbatch)
+            m_cur.maxbatch = n;
+        PTMutexLocker lock(m_statsmutex);
+        m_stats = m_cur;
+    }
+}
+
+#ifdef TEST_NATIVERECV
+// Loopback benchmark: a sender thread sends Songcast-like audio
+// messages (441 frames, 16 bits stereo) to the receiver, which reads
+// them in batches, or one per syscall like the ohNet OhmReceiver
+// (batch 1). Reports the receive rate and the receive thread CPU
+// time per packet.
+
+#include <stdio.h>
+
+static unsigned long long received;
+static unsigned long long cpustartns, cpuendns;
+static long long firstus, lastus;
+
+static unsigned long long threadCpuNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void handler(const OhmAudio& msg, void *)
+{
+    if (msg.halt)
+        return;
+    if (received++ == 0) {
+        cpustartns = threadCpuNs();
+        firstus = Chrono::monomicros();
+    }
+    cpuendns = threadCpuNs();
+    lastus = Chrono::monomicros();
+}
+
+static int makeSender(uint16_t *port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        return -1;
+    }
+    socklen_t salen = sizeof(sa);
+    getsockname(fd, (struct sockaddr *)&sa, &salen);
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+static void runOne(unsigned int batch, unsigned int count, unsigned int burst)
+{
+    uint16_t port;
+    int sfd = makeSender(&port);
+    if (sfd < 0) {
+        fprintf(stderr, "Can't create sender socket\n");
+        exit(1);
+    }
+    received = 0;
+    NativeReceiver rcv(htonl(INADDR_LOOPBACK), 1, batch, handler, 0);
+    char uri[100];
+    sprintf(uri, "ohu://127.0.0.1:%u", (unsigned int)port);
+    if (!rcv.play(uri)) {
+        fprintf(stderr, "play failed\n");
+        exit(1);
+    }
+
+    // Wait for the Join to know where to send
+    unsigned char buf[bufsize];
+    struct sockaddr_in to;
+    socklen_t tolen = sizeof(to);
+    if (recvfrom(sfd, buf, sizeof(buf), 0, (struct sockaddr *)&to, &tolen) < 8
+        || buf[5] != OHM_JOIN) {
+        fprintf(stderr, "No Join from the receiver\n");
+        exit(1);
+    }
+
+    const unsigned int frames = 441;
+    unsigned int total = ohmheaderbytes + audioheaderbytes + 3 + frames * 4;
+    memset(buf, 0, total);
+    memcpy(buf, "Ohm ", 4);
+    buf[4] = 1;
+    buf[5] = OHM_AUDIO;
+    buf[6] = total >> 8;
+    buf[7] = total & 0xff;
+    unsigned char *ap = buf + ohmheaderbytes;
+    ap[0] = audioheaderbytes;
+    ap[2] = frames >> 8;
+    ap[3] = frames & 0xff;
+    ap[36] = 0; ap[37] = 0; ap[38] = 44100 >> 8; ap[39] = 44100 & 0xff;
+    ap[46] = 16;
+    ap[47] = 2;
+    ap[49] = 3;
+    memcpy(ap + audioheaderbytes, "PCM", 3);
+
+    for (unsigned int i = 0; i < count; i++) {
+        ap[4] = i >> 24; ap[5] = (i >> 16) & 0xff;
+        ap[6] = (i >> 8) & 0xff; ap[7] = i & 0xff;
+        sendto(sfd, buf, total, 0, (struct sockaddr *)&to, tolen);
+        if ((i % burst) == burst - 1) {
+            // Let the receiver keep up, the loopback does not queue
+            // much.
+            usleep(50);
+        }
+    }
+    // Let the receiver drain
+    usleep(200000);
+    rcv.stop();
+    close(sfd);
+
+    NativeReceiver::Stats st;
+    rcv.getStats(st);
+    double secs = (lastus - firstus) / 1e6;
+    printf("batch %2u: received %llu/%u packets in %llu calls, "
+           "%.0f packets/S, %.2f uS CPU/packet\n", batch, received, count,
+           st.calls, secs > 0 ? received / secs : 0.0,
+           received ? (cpuendns - cpustartns) / 1000.0 / received : 0.0);
+}
+
+static void Usage()
+{
+    fprintf(stderr, "trnativerecv [packets [burst]]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int count = 200000;
+    unsigned int burst = 16;
+    if (argc > 3)
+        Usage();
+    if (argc > 1 && (count = atoi(argv[1])) == 0)
+        Usage();
+    if (argc > 2 && (burst = atoi(argv[2])) == 0)
+        Usage();
+    Logger::getTheLog("")->setLogLevel(Logger::LLERR);
+#ifndef HAVE_RECVMMSG
+    printf("No recvmmsg: all runs use one recvmsg call per packet\n");
+#endif
+    runOne(1, count, burst);
+    runOne(32, count, burst);
+    return 0;
+}
+#endif // TEST_NATIVERECV
@@ -0,0 +1,134 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _NATIVERECV_H_INCLUDED_
+#define _NATIVERECV_H_INCLUDED_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "ptmutex.h"
+
+/** An Ohm audio message, as parsed by the native receiver. The data
+ *  points into the receive buffer, and is only valid during the
+ *  handler call. */
+struct OhmAudio {
+    bool halt;
+    unsigned int frame;
+    unsigned int samples;
+    unsigned int freq;
+    unsigned int bits;
+    unsigned int chans;
+    unsigned int medialatency;
+    unsigned int mediatimestamp;
+    const unsigned char *data;
+    unsigned int bytes;
+    // Arrival time, in the Chrono::monomicros() time base. From the
+    // kernel timestamp if available.
+    long long recvus;
+};
+
+/**
+ * Native Ohm receive path, replacing the ohNet OhmReceiver for the
+ * ohu:// (unicast) and ohm:// (multicast) audio streams.
+ *
+ * The datagrams are read in batches with recvmmsg() (one per syscall
+ * if it is not available), and timestamped by the kernel
+ * (SO_TIMESTAMPNS). The interarrival jitter is computed from these
+ * timestamps, as in RFC 3550.
+ *
+ * The receiver sends the Join and Listen messages to the sender, and
+ * Leave when stopping. Track, metatext and slave messages are
+ * ignored: a unicast sender which asks us to forward the stream to
+ * other receivers won't be obeyed.
+ */
+class NativeReceiver {
+public:
+    typedef void (*Handler)(const OhmAudio& msg, void *arg);
+
+    /** @param adapter network interface address (network order), used
+     *    for the multicast membership.
+     *  @param ttl multicast ttl for our messages.
+     *  @param batch max messages per recvmmsg call. */
+    NativeReceiver(uint32_t adapter, unsigned int ttl, unsigned int batch,
+                   Handler handler, void *arg);
+    ~NativeReceiver();
+
+    /** Start receiving from the sender (stops the current one
+     *  first). Returns false if the uri is not ohu:// or ohm://, or the
+     *  socket can't be set up. */
+    bool play(const std::string& uri);
+    /** Stop receiving. The handler is called with a halt message. */
+    void stop();
+
+    struct Stats {
+        Stats() : packets(0), bytes(0), calls(0), maxbatch(0), truncated(0),
+                  invalid(0), jitterus(0) {}
+        unsigned long long packets;
+        unsigned long long bytes;
+        // Receive syscalls which returned data
+        unsigned long long calls;
+        unsigned int maxbatch;
+        unsigned long truncated;
+        unsigned long invalid;
+        // Interarrival jitter estimate (RFC 3550)
+        double jitterus;
+    };
+    void getStats(Stats& st);
+
+private:
+    static void *threadFunc(void *arg);
+    void run();
+    bool setupSocket();
+    void sendCtl(int type);
+    void processPacket(const unsigned char *cp, unsigned int len,
+                       long long recvus);
+
+    uint32_t m_adapter;
+    unsigned int m_ttl;
+    unsigned int m_batch;
+    Handler m_handler;
+    void *m_arg;
+    int m_fd;
+    bool m_multicast;
+    // Sender (unicast) or group (multicast) address, network order
+    uint32_t m_addr;
+    uint16_t m_port;
+    pthread_t m_thread;
+    bool m_running;
+    std::atomic<bool> m_stop;
+    // Receive buffers, m_batch slots of bufsize bytes
+    std::vector<unsigned char> m_bufs;
+    // Got audio from the sender recently: send Listen instead of Join
+    bool m_joined;
+    bool m_slavewarned;
+    // Jitter computation: previous packet
+    bool m_havelast;
+    unsigned int m_lastframe;
+    long long m_lastrecv;
+    long long m_lastdurus;
+    // Updated by the receive thread, and copied to m_stats after
+    // each batch
+    Stats m_cur;
+    PTMutexInit m_statsmutex;
+    Stats m_stats;
+};
+
+#endif /* _NATIVERECV_H_INCLUDED_ */
@@ -0,0 +1,338 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "plc.h"
+#include "rcvqueue.h"
+#include "msgpool.h"
+#include "audiokern.h"
+#include "log.h"
+
+using namespace std;
+
+// Pitch period search range
+static const unsigned int minperiodus = 2500;
+static const unsigned int maxperiodms = 20;
+// Length of the segment matched at the end of the history
+static const unsigned int corrwinms = 5;
+// The pitch search runs on a mono signal decimated to about this rate
+static const unsigned int analysisfreq = 22050;
+// Minimum normalized correlation for considering the signal periodic
+static const float periodicthreshold = 0.5;
+// Periodic signal: repeat at full level for holdms, then fade out
+// over fadems. Else fade out over shortfadems
+static const unsigned int holdms = 10;
+static const unsigned int fadems = 50;
+static const unsigned int shortfadems = 10;
+// Crossfade length at the start of the next real message
+static const unsigned int xfadems = 2;
+
+// Sample conversions. Sample i in buf, bps bytes per sample, float
+// values in [-1, 1)
+static inline float getsample(const char *buf, unsigned int i,
+                              unsigned int bps, bool msb)
+{
+    const unsigned char *p = (const unsigned char *)buf + i * bps;
+    uint32_t v = 0;
+    if (msb) {
+        for (unsigned int b = 0; b < bps; b++)
+            v = (v << 8) | p[b];
+    } else {
+        for (unsigned int b = bps; b > 0; b--)
+            v = (v << 8) | p[b-1];
+    }
+    v <<= 8 * (4 - bps);
+    return float(int32_t(v)) * (1.0f / 2147483648.0f);
+}
+
+static inline void putsample(char *buf, unsigned int i, unsigned int bps,
+                             bool msb, float f)
+{
+    float scale = float(1U << (8 * bps - 1));
+    float s = f * scale;
+    int32_t iv;
+    if (s >= scale) {
+        iv = int32_t(scale - 1);
+    } else if (s <= -scale) {
+        iv = -int32_t(scale - 1) - 1;
+    } else {
+        iv = int32_t(lrintf(s));
+    }
+    uint32_t v = uint32_t(iv);
+    unsigned char *p = (unsigned char *)buf + i * bps;
+    if (msb) {
+        for (unsigned int b = bps; b > 0; b--) {
+            p[b-1] = v & 0xff;
+            v >>= 8;
+        }
+    } else {
+        for (unsigned int b = 0; b < bps; b++) {
+            p[b] = v & 0xff;
+            v >>= 8;
+        }
+    }
+}
+
+LossConcealer::LossConcealer(AudioMessagePool *pool, bool msbfirst)
+    : m_pool(pool), m_msbfirst(msbfirst), m_bits(0), m_chans(0), m_freq(0),
+      m_histframes(0), m_periodframes(0), m_holdframes(0), m_fadeframes(1)
+{
+}
+
+LossConcealer::~LossConcealer()
+{
+}
+
+void LossConcealer::reset()
+{
+    m_bits = m_chans = m_freq = 0;
+    m_histframes = 0;
+}
+
+void LossConcealer::feed(AudioMessage *m)
+{
+    if (m == 0 || m->m_bytes == 0 || m->m_chans == 0) {
+        return;
+    }
+    unsigned int bps = m->m_bits / 8;
+    if (bps < 2 || bps > 4) {
+        return;
+    }
+    if (m->m_bits != m_bits || m->m_chans != m_chans ||
+        m->m_freq != m_freq) {
+        m_bits = m->m_bits;
+        m_chans = m->m_chans;
+        m_freq = m->m_freq;
+        unsigned int cap = (2 * maxperiodms + corrwinms) * m_freq / 1000;
+        m_hist.assign(size_t(cap) * m_chans, 0.0);
+        m_histframes = 0;
+    }
+
+    unsigned int cap = m_hist.size() / m_chans;
+    unsigned int frames = m->frames();
+    unsigned int skip = 0;
+    if (frames > cap) {
+        skip = frames - cap;
+        frames = cap;
+    }
+    float *hist = &m_hist[0];
+    memmove(hist, hist + size_t(frames) * m_chans,
+            size_t(cap - frames) * m_chans * sizeof(float));
+    float *dest = hist + size_t(cap - frames) * m_chans;
+    bool msb = m->m_needswap || m_msbfirst;
+    unsigned int first = skip * m_chans;
+    unsigned int cnt = frames * m_chans;
+    for (unsigned int i = 0; i < cnt; i++) {
+        dest[i] = getsample(m->m_buf, first + i, bps, msb);
+    }
+    m_histframes += frames;
+    if (m_histframes > cap)
+        m_histframes = cap;
+}
+
+// Returns the period in frames (0 if none usable), and the
+// correlation value.
+unsigned int LossConcealer::findPeriod(float *corrp)
+{
+    *corrp = 0;
+    unsigned int step = m_freq / analysisfreq;
+    if (step == 0)
+        step = 1;
+    unsigned int afreq = m_freq / step;
+    unsigned int win = corrwinms * afreq / 1000;
+    unsigned int minlag = afreq / (1000000 / minperiodus);
+    unsigned int maxlag = maxperiodms * afreq / 1000;
+    // Repeating the period with the loop point overlap needs 2
+    // periods of history, the search needs win + maxlag.
+    unsigned int avail = m_histframes / step;
+    if (avail < win + minlag) {
+        // Not enough history yet (the clamps below would wrap)
+        return 0;
+    }
+    if (maxlag > avail / 2)
+        maxlag = avail / 2;
+    if (win + maxlag > avail)
+        maxlag = avail - win;
+    if (win == 0 || minlag == 0 || maxlag < minlag) {
+        return 0;
+    }
+
+    // Mono decimated analysis signal, ending at the end of history
+    unsigned int cnt = win + maxlag;
+    m_mono.resize(cnt);
+    float *x = &m_mono[0];
+    unsigned int cap = m_hist.size() / m_chans;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const float *fp = &m_hist[size_t(cap - (cnt - i) * step) * m_chans];
+        float s = 0;
+        for (unsigned int c = 0; c < m_chans; c++)
+            s += fp[c];
+        x[i] = s;
+    }
+
+    const float *target = x + cnt - win;
+    double et = audioDotProduct(target, target, win);
+    if (et < 1e-10 * win) {
+        // Silence
+        return 0;
+    }
+    const float *cand = x + cnt - win - minlag;
+    double ec = audioDotProduct(cand, cand, win);
+    float best = -1;
+    unsigned int bestlag = 0;
+    for (unsigned int lag = minlag; lag <= maxlag; lag++) {
+        cand = x + cnt - win - lag;
+        if (lag > minlag) {
+            // Slide the energy window by one
+            ec += double(cand[0]) * cand[0] - double(cand[win]) * cand[win];
+        }
+        if (ec <= 1e-10 * win)
+            continue;
+        float r = audioDotProduct(target, cand, win) / sqrt(et * ec);
+        if (r > best) {
+            best = r;
+            bestlag = lag;
+        }
+    }
+    *corrp = best;
+    return bestlag * step;
+}
+
+// Synthesized signal level for frame k from the gap start
+float LossConcealer::gain(unsigned int k)
+{
+    if (m_periodframes == 0 || k >= m_holdframes + m_fadeframes) {
+        return 0;
+    }
+    if (k < m_holdframes) {
+        return 1;
+    }
+    return 1.0f - float(k - m_holdframes + 1) / m_fadeframes;
+}
+
+void LossConcealer::conceal(unsigned int msgcount, AudioMessage *next,
+                            vector<AudioMessage*>& out)
+{
+    unsigned int fpm = next ? next->frames() : 0;
+    if (msgcount == 0 || fpm == 0) {
+        return;
+    }
+    unsigned int bits = next->m_bits, chans = next->m_chans,
+        freq = next->m_freq;
+    unsigned int bps = bits / 8;
+    if (bps < 2 || bps > 4) {
+        return;
+    }
+    m_stats.events++;
+
+    // Period, with an overlap-add over the last quarter so that
+    // looping over it is smooth: the end blends into the signal which
+    // preceded its start.
+    float corr = 0;
+    unsigned int period = 0;
+    if (bits == m_bits && chans == m_chans && freq == m_freq) {
+        period = findPeriod(&corr);
+    }
+    m_periodframes = period;
+    m_holdframes = 0;
+    m_fadeframes = 1;
+    if (period) {
+        unsigned int cap = m_hist.size() / m_chans;
+        const float *h1 = &m_hist[size_t(cap - period) * chans];
+        const float *h2 = &m_hist[size_t(cap - 2 * period) * chans];
+        unsigned int ola = period / 4;
+        unsigned int olastart = period - ola;
+        m_period.resize(size_t(period) * chans);
+        for (unsigned int j = 0; j < period; j++) {
+            float w = j < olastart ? 0 : float(j - olastart + 1) / (ola + 1);
+            for (unsigned int c = 0; c < chans; c++) {
+                size_t i = size_t(j) * chans + c;
+                m_period[i] = (1 - w) * h1[i] + w * h2[i];
+            }
+        }
+        if (corr >= periodicthreshold) {
+            m_holdframes = holdms * freq / 1000;
+            m_fadeframes = fadems * freq / 1000;
+        } else {
+            m_fadeframes = shortfadems * freq / 1000;
+        }
+        if (m_fadeframes == 0)
+            m_fadeframes = 1;
+    }
+    LOGDEB1("LossConcealer: " << msgcount << " messages, period " << period <<
+             " corr " << corr << endl);
+
+    unsigned int k = 0;
+    for (unsigned int n = 0; n < msgcount; n++) {
+        AudioMessage *m;
+        unsigned int bytes = fpm * chans * bps;
+        if (m_pool) {
+            m = m_pool->get(bits, chans, fpm, freq);
+        } else {
+            char *buf = (char *)malloc(bytes);
+            m = buf ? new AudioMessage(bits, chans, fpm, freq, buf, bytes) : 0;
+        }
+        if (m == 0 || !m->reserve(bytes)) {
+            LOGERR("LossConcealer: can't allocate message\n");
+            AudioMessage::release(m);
+            break;
+        }
+        unsigned int silent = 0;
+        for (unsigned int f = 0; f < fpm; f++, k++) {
+            float g = gain(k);
+            if (g == 0) {
+                silent++;
+            }
+            for (unsigned int c = 0; c < chans; c++) {
+                putsample(m->m_buf, f * chans + c, bps, m_msbfirst,
+                          synth(k, c, g));
+            }
+        }
+        m->m_silent = silent == fpm;
+        m_stats.silentframes += silent;
+        m_stats.frames += fpm;
+        out.push_back(m);
+    }
+
+    // Crossfade the start of the real message with the continuation
+    // (this is a fade in if the synthesized signal reached silence)
+    unsigned int xfade = xfadems * freq / 1000;
+    if (xfade > fpm)
+        xfade = fpm;
+    if (next->m_ref && !next->reserve(next->m_bytes)) {
+        return;
+    }
+    bool msb = next->m_needswap || m_msbfirst;
+    for (unsigned int j = 0; j < xfade; j++, k++) {
+        float w = float(j + 1) / (xfade + 1);
+        float g = gain(k);
+        if (g != 0) {
+            next->m_silent = false;
+        }
+        for (unsigned int c = 0; c < chans; c++) {
+            unsigned int i = j * chans + c;
+            float v = w * getsample(next->m_buf, i, bps, msb) +
+                (1 - w) * synth(k, c, g);
+            putsample(next->m_buf, i, bps, msb, v);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _PLC_H_INCLUDED_
+#define _PLC_H_INCLUDED_
+
+#include <stddef.h>
+
+#include <vector>
+
+class AudioMessage;
+class AudioMessagePool;
+
+/**
+ * Packet loss concealment.
+ *
+ * When Songcast frames are lost, we synthesize the same number of
+ * samples so that the sample clock stays continuous for the
+ * downstream rate control.
+ *
+ * The recent signal history is kept as float samples. When a gap
+ * occurs, we look for the pitch period maximizing the normalized
+ * autocorrelation at the end of the history, and repeat the last
+ * period, with an overlap-add at the loop point. The first samples of
+ * the next real message are crossfaded with the synthesized
+ * continuation. Long gaps (or a signal with no clear periodicity)
+ * fade to silence.
+ *
+ * Runs on the network thread, after the jitter buffer.
+ */
+class LossConcealer {
+public:
+    struct Stats {
+        Stats() : events(0), frames(0), silentframes(0) {}
+        // Count of gaps
+        unsigned long events;
+        // Total synthesized frames, and how many of them were silence
+        unsigned long frames;
+        unsigned long silentframes;
+    };
+
+    /**
+     * @param pool for allocating the synthesized messages (may be 0).
+     * @param msbfirst byte order of the message data when m_needswap
+     *    is not set (depends on the audio eater).
+     */
+    LossConcealer(AudioMessagePool *pool, bool msbfirst);
+    ~LossConcealer();
+
+    /** Record the signal. Must be called, in order, for each message
+     *  going downstream, including the synthesized ones. */
+    void feed(AudioMessage *m);
+
+    /** Synthesize msgcount messages for the gap before next, with the
+     *  same format and size as next, and append them to out.  The
+     *  beginning of next is modified for the crossfade (its data is
+     *  copied first if it is external). */
+    void conceal(unsigned int msgcount, AudioMessage *next,
+                 std::vector<AudioMessage*>& out);
+
+    /** Forget the history (stream halt, etc.) */
+    void reset();
+
+    void getStats(Stats& st) {
+        st = m_stats;
+    }
+
+private:
+    // Find the best period for the history end
+    unsigned int findPeriod(float *corrp);
+    float gain(unsigned int k);
+    // Synthesized sample for frame k, channel c, with gain g
+    float synth(unsigned int k, unsigned int c, float g) {
+        return g == 0 ? 0 :
+            g * m_period[size_t(k % m_periodframes) * m_chans + c];
+    }
+
+    AudioMessagePool *m_pool;
+    bool m_msbfirst;
+
+    // History format and data (interleaved, m_histframes valid frames
+    // at the end of m_hist)
+    unsigned int m_bits;
+    unsigned int m_chans;
+    unsigned int m_freq;
+    std::vector<float> m_hist;
+    unsigned int m_histframes;
+    // Work buffers
+    std::vector<float> m_mono;
+    // Current concealment: the period which we repeat, and the level
+    // envelope.
+    std::vector<float> m_period;
+    unsigned int m_periodframes;
+    unsigned int m_holdframes;
+    unsigned int m_fadeframes;
+
+    Stats m_stats;
+};
+
+#endif /* _PLC_H_INCLUDED_ */
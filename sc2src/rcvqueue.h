@@ -18,14 +18,25 @@
 #define _RCVQUEUE_H_INCLUDED_
 
 #include "workqueue.h"
+#include "spscqueue.h"
+
+class AudioMessagePool;
 
 /* 
  * The audio messages which get passed between the songcast receiver
  * and the http server part. We could probably use ohSongcast own audio 
  * messages, but I prefer to stop the custom type usage asap.
+ *
+ * Messages are normally obtained from an AudioMessagePool (see
+ * msgpool.h), and the final consumer must dispose of them with
+ * AudioMessage::release(), not delete.
  */
 class AudioMessage {
 public:
+    // Pipeline stages, for the latency statistics (see histo.h)
+    enum Stage {STG_RECV, STG_DEQUEUE, STG_CONVERTED, STG_ALSADEQUEUE,
+                STG_WRITTEN, STG_COUNT};
+
     // If buf is not 0, it is a malloced buffer, and we take
     // ownership. The caller MUST NOT free it. Its size must be at
     // least (bits/8) * chans * samples
@@ -33,11 +44,18 @@ public:
                  unsigned int sampfreq, char *buf, unsigned int allocbytes) 
         : m_bits(bits), m_chans(channels), m_freq(sampfreq),
           m_bytes(buf ? (bits/8) * channels * frames : 0),
-          m_allocbytes(allocbytes), m_buf(buf), m_curoffs(0) {
+          m_allocbytes(allocbytes), m_buf(buf), m_curoffs(0),
+          m_playat(0), m_latencyus(0), m_needswap(false), m_silent(false), m_flush(false),
+          m_reconfig(false), m_unref(0), m_ref(0),
+          m_pool(0), m_poolidx(0), m_inlbuf(0) {
+        for (int i = 0; i < STG_COUNT; i++)
+            m_stamps[i] = 0;
     }
 
     ~AudioMessage() {
-        if (m_buf)
+        if (m_ref)
+            m_unref(m_ref);
+        else if (m_buf && m_buf != m_inlbuf)
             free(m_buf);
     }
     unsigned int samples() {
@@ -46,6 +64,29 @@ public:
     unsigned int frames() {
         return samples() / m_chans;
     }
+
+    /** Make sure that the buffer can hold at least bytes, and that we
+     *  can write to it. Replaces realloc(m_buf...), which can't
+     *  be used on a pool buffer. If the data is external (see
+     *  setExternal()), it is copied to our own buffer if keep is set,
+     *  and the reference is dropped.
+     *  @param keep preserve the current contents. */
+    bool reserve(unsigned int bytes, bool keep = true);
+
+    /** Point the message to external read-only data which we don't
+     *  own (zero-copy mode). unref(ref) will be called when the
+     *  message is released or the buffer replaced by reserve(). */
+    void setExternal(char *data, unsigned int bytes,
+                     void (*unref)(void *), void *ref) {
+        m_buf = data;
+        m_bytes = m_allocbytes = bytes;
+        m_unref = unref;
+        m_ref = ref;
+    }
+
+    /** Dispose of a message: give it back to its pool, or delete it */
+    static void release(AudioMessage *m);
+
     unsigned int m_bits;
     unsigned int m_chans;
     unsigned int m_freq;
@@ -53,10 +94,43 @@ public:
     unsigned int m_allocbytes; // buffer size
     char *m_buf;
     unsigned int m_curoffs; /* Used by the http data emitter */
+    // Local time (Chrono::monomicros()) at which the first sample
+    // should be played, computed from the Songcast media
+    // timestamp. 0 if unknown.
+    long long m_playat;
+    // Sender media latency (uS) included in m_playat
+    long long m_latencyus;
+    // The data is still in Songcast (msb-first) order and the
+    // consumer must swap it while processing (zero-copy mode).
+    bool m_needswap;
+    // All samples are zero (set on ingest)
+    bool m_silent;
+    // Control message, no data: the stream stopped, discard what is
+    // still queued and not played yet.
+    bool m_flush;
+    // Control message, no data: the format changes to m_freq/m_chans,
+    // reconfigure the output.
+    bool m_reconfig;
+    // Time (Chrono::monomicros()) at which the message went through
+    // each stage. 0 if it did not.
+    long long m_stamps[STG_COUNT];
+    // External data reference, see setExternal()
+    void (*m_unref)(void *);
+    void *m_ref;
+
+    // Pool management. m_pool is 0 if the message was not allocated
+    // from a pool. m_inlbuf is the payload area which follows the
+    // header inside the pool block.
+    AudioMessagePool *m_pool;
+    unsigned int m_poolidx;
+    char *m_inlbuf;
 };
 
 class ConfSimple;
 
+// The queue between the network thread and the audio eater.
+typedef SPSCQueue<AudioMessage*> AudioQueue;
+
 // Def for the downstream module which can be using either http to mpd
 // or direct alsa. No effort is done for easy expansion to other
 // modules, e.g. this would need to add stuff to the Context thing
@@ -67,9 +141,12 @@ class AudioEater {
 public:
     enum BOrder {BO_MSB, BO_LSB, BO_HOST};
     struct Context {
-        Context(WorkQueue<AudioMessage*> *q) : queue(q) {}
-        WorkQueue<AudioMessage*> *queue;
+        Context(AudioQueue *q) : queue(q), config(0), pool(0), stream(0) {}
+        AudioQueue *queue;
         ConfSimple *config;
+        AudioMessagePool *pool;
+        // Stream index, for the multi-stream mixer (see mixer.h)
+        unsigned int stream;
     };
 
     // Constructor called by downstream module to set its params
@@ -86,7 +163,15 @@ public:
 extern void copyswap(unsigned char *dest, const unsigned char *src, 
                      unsigned int bytes, unsigned int bits);
 
+/** URI of the sender we are currently playing. It can change
+ * during the session in daemon mode: the eaters check it for
+ * per-sender state when they get a flush message. */
+extern std::string senderUri();
+extern void setSenderUri(const std::string& uri);
+
 extern AudioEater httpAudioEater;
 extern AudioEater alsaAudioEater;
+extern AudioEater relayAudioEater;
+extern AudioEater mixAudioEater;
 
 #endif /* _RCVQUEUE_H_INCLUDED_ */
@@ -0,0 +1,175 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <OpenHome/OhNetTypes.h>
+#include <OpenHome/Net/Core/DvDevice.h>
+#include <OpenHome/Net/Core/OhNet.h>
+
+#include "OhmSender.h"
+
+#include "relay.h"
+#include "rcvqueue.h"
+#include "conftree.h"
+#include "chrono.h"
+#include "histo.h"
+#include "log.h"
+#include "../mpd2src/icon.h"
+
+using namespace std;
+using namespace OpenHome;
+using namespace OpenHome::Net;
+using namespace OpenHome::Av;
+
+static DvDeviceStandard *device;
+static OhmSenderDriver *sdriver;
+static OhmSender *sender;
+
+bool relayInit(Library *lib, ConfSimple& config, TIpAddress adapter, TUint ttl)
+{
+    string value;
+    string name("sc2mpd relay");
+    config.get("screlayname", name);
+    // The udn must be stable and unique on the network
+    string udn;
+    if (!config.get("screlayudn", udn)) {
+        char hostname[256];
+        if (gethostname(hostname, sizeof(hostname)) != 0) {
+            hostname[0] = 0;
+        }
+        hostname[sizeof(hostname) - 1] = 0;
+        udn = string("sc2mpd-relay-") + hostname + "-" + name;
+    }
+    TUint channel = 0;
+    if (config.get("screlaychannel", value)) {
+        channel = atoi(value.c_str());
+    }
+    TUint latency = 100;
+    if (config.get("screlaylatency", value)) {
+        latency = atoi(value.c_str());
+    }
+    TBool multicast = false;
+    if (config.get("screlaymulticast", value)) {
+        multicast = atoi(value.c_str()) != 0;
+    }
+
+    DvStack* dvStack = lib->StartDv();
+    device = new DvDeviceStandard(*dvStack, Brn(udn.c_str()));
+    device->SetAttribute("Upnp.Domain", "av.openhome.org");
+    device->SetAttribute("Upnp.Type", "Sender");
+    device->SetAttribute("Upnp.Version", "1");
+    device->SetAttribute("Upnp.FriendlyName", name.c_str());
+    device->SetAttribute("Upnp.Manufacturer", "Openhome");
+    device->SetAttribute("Upnp.ManufacturerUrl", "http://www.openhome.org");
+    device->SetAttribute("Upnp.ModelDescription", "sc2mpd Songcast relay");
+    device->SetAttribute("Upnp.ModelName", "sc2mpd relay");
+    device->SetAttribute("Upnp.ModelNumber", "1");
+    device->SetAttribute("Upnp.ModelUrl", "http://www.openhome.org");
+    device->SetAttribute("Upnp.SerialNumber", "");
+    device->SetAttribute("Upnp.Upc", "");
+
+    sdriver = new OhmSenderDriver(lib->Env());
+    Brn icon(icon_png, icon_png_len);
+    sender = new OhmSender(lib->Env(), *device, *sdriver, Brn(name.c_str()),
+                           channel, adapter, ttl, latency, multicast, true,
+                           icon, Brn("image/png"), 0);
+    device->SetEnabled();
+
+    const Brx& suri(sender->SenderUri());
+    LOGINF("relay: sender " << name << " uri " <<
+           string((const char*)suri.Ptr(), suri.Bytes()) << " latency " <<
+           latency << " mS " << (multicast ? "multicast" : "unicast") << endl);
+    return true;
+}
+
+void relayTrack(const Brx& uri, const Brx& meta)
+{
+    if (sender) {
+        sender->SetTrack(uri, meta, 0, 0);
+    }
+}
+
+void relayMetatext(const Brx& text)
+{
+    if (sender) {
+        sender->SetMetatext(text);
+    }
+}
+
+static void *relayEater(void *cls)
+{
+    AudioEater::Context *ctxt = (AudioEater::Context*)cls;
+    AudioQueue *queue = ctxt->queue;
+    delete ctxt;
+
+    // Current format
+    unsigned int freq = 0, bits = 0, chans = 0;
+    // A halt was sent and nothing since
+    bool halted = true;
+
+    while (true) {
+        AudioMessage *tsk = 0;
+        size_t qsz;
+        if (!queue->take(&tsk, &qsz)) {
+            LOGDEB("relayEater: queue take failed\n");
+            queue->workerExit();
+            return (void*)1;
+        }
+        tsk->m_stamps[AudioMessage::STG_DEQUEUE] = Chrono::monomicros();
+
+        if (tsk->m_flush) {
+            // The stream stopped: tell the downstream receivers.
+            if (!halted) {
+                LOGDEB("relayEater: halt\n");
+                sdriver->SendAudio(0, 0, true);
+                halted = true;
+            }
+            AudioMessage::release(tsk);
+            continue;
+        }
+        if (tsk->m_bytes == 0 || tsk->m_chans == 0 || tsk->m_bits == 0) {
+            AudioMessage::release(tsk);
+            continue;
+        }
+
+        if (tsk->m_freq != freq || tsk->m_bits != bits ||
+            tsk->m_chans != chans) {
+            freq = tsk->m_freq;
+            bits = tsk->m_bits;
+            chans = tsk->m_chans;
+            LOGDEB("relayEater: format " << freq << " Hz " << bits <<
+                   " bits " << chans << " channels\n");
+            sdriver->SetAudioFormat(freq, freq * bits * chans, chans, bits,
+                                    true, Brn("PCM"));
+        }
+
+        // We asked for msb-first data, which is the Songcast
+        // order. The sender copies it into its own message.
+        sdriver->SendAudio((const TByte *)tsk->m_buf, tsk->m_bytes);
+        halted = false;
+
+        tsk->m_stamps[AudioMessage::STG_WRITTEN] = Chrono::monomicros();
+        latencyRecord(tsk);
+        latencyFirstSample(tsk);
+        AudioMessage::release(tsk);
+    }
+}
+
+AudioEater relayAudioEater(AudioEater::BO_MSB, &relayEater);
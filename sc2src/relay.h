@@ -0,0 +1,51 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _RELAY_H_INCLUDED_
+#define _RELAY_H_INCLUDED_
+
+#include <OpenHome/OhNetTypes.h>
+#include <OpenHome/Net/Core/OhNet.h>
+
+class ConfSimple;
+
+/**
+ * Relay mode: instead of playing the received stream, re-send it
+ * through an OhmSender (the same classes as mpd2sc), e.g. to another
+ * subnet, or to more receivers than the original sender can serve.
+ *
+ * The relay eater gets the messages in Songcast (msb-first) order
+ * after the jitter buffer and loss concealment, so that the new
+ * stream is in order and continuous. With sczerocopy, the data is
+ * not copied before the sender packs it in its own message.
+ *
+ * The sender makes its own frame numbers and media timestamps: the
+ * downstream receivers are synchronized with the relay, not with
+ * the original sender.
+ */
+
+/** Create the Sender device and the OhmSender. Must be called before
+ *  the receiver is started. The parameters are from the configuration
+ *  (screlayxxx values). */
+extern bool relayInit(OpenHome::Net::Library *lib, ConfSimple& config,
+                      TIpAddress adapter, TUint ttl);
+
+/** Forward the track and metatext information to the downstream
+ *  receivers. Called from the receiver network thread. */
+extern void relayTrack(const OpenHome::Brx& uri, const OpenHome::Brx& meta);
+extern void relayMetatext(const OpenHome::Brx& text);
+
+#endif /* _RELAY_H_INCLUDED_ */
@@ -37,21 +37,76 @@ Unless otherwise stated, all code in this project is licensed under the 2-clause
 
 #include "workqueue.h"
 #include "rcvqueue.h"
+#include "msgpool.h"
+#include "jitterbuf.h"
+#include "plc.h"
+#include "mediaclock.h"
+#include "audiokern.h"
+#include "histo.h"
+#include "wqstats.h"
 #include "log.h"
 #include "conftree.h"
 #include "chrono.h"
+#include "ctlsock.h"
+#include "relay.h"
+#include "mixer.h"
+#include "nativerecv.h"
+#include "capture.h"
+#include "failover.h"
+#include "ptmutex.h"
 
 #include <vector>
+#include <atomic>
 #include <stdio.h>
 #include <iostream>
+#include <sstream>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 
 using namespace std;
 
-WorkQueue<AudioMessage*> audioqueue("audioqueue", 4);
+static PTMutexInit senderurimutex;
+static string senderuri;
+
+string senderUri()
+{
+    PTMutexLocker lock(senderurimutex);
+    return senderuri;
+}
+
+void setSenderUri(const string& uri)
+{
+    PTMutexLocker lock(senderurimutex);
+    senderuri = uri;
+}
+
+#ifndef MIN
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+// Nominal duration of a Songcast audio packet. Used for translating
+// the audio queue size from milliseconds to slots.
+static const unsigned int packetms = 10;
+
+// Default audio queue size. The queue does not block the network
+// thread when full (it drops data instead), so give it some slack.
+static const unsigned int audioqueuems = 160;
+
+// Default message pool dimensions. The count covers the audio queue
+// plus the alsa queue, the size is enough for 10 mS of 192 kHz 24
+// bits stereo, with margin for the resampler.
+static const unsigned int poolbufs = 128;
+static const unsigned int poolbufbytes = 16384;
+
+// Default jitter buffer parameters: max frames held behind a missing
+// one, and max wait for it. This only adds latency when frames are
+// missing or out of order.
+static const unsigned int jitterframes = 32;
+static const unsigned int jitterms = 40;
 
 #ifdef _WIN32
 
@@ -97,6 +152,27 @@ class OhmReceiverDriver : public IOhmReceiverDriver, public IOhmMsgProcessor {
 public:
     OhmReceiverDriver(AudioEater* eater, AudioEater::Context *ctxt);
 
+    /** Receiver state, as set by the last state callback */
+    const char *state() {
+        return m_state;
+    }
+
+    /** Audio from the native receive path (see nativerecv.h). There
+     *  are no state callbacks in this case: the state is "playing"
+     *  when we get audio, and "stopped" after a halt. */
+    void nativeAudio(const OhmAudio& msg);
+
+    /** Report the packet arrivals and disconnections to the failover
+     *  watchdog. Must be called before the receiver is started. */
+    void setFailover(Failover *failover) {
+        m_failover = failover;
+    }
+
+    /** End of input (replay): send what the jitter buffer holds, wait
+     *  until the eater has processed everything, and stop it. Called
+     *  on the receive thread. */
+    void finish();
+
 private:
     // IOhmReceiverDriver
     virtual void Add(OhmMsg& aMsg);
@@ -113,15 +189,40 @@ private:
     virtual void Process(OhmMsgMetatext& aMsg);
 
 private:
+    // Called by the jitter buffer with the messages in order
+    static void jitterOutput(AudioMessage *ap, unsigned int lost, void *arg);
+    void output(AudioMessage *ap, unsigned int lost);
+    void enqueue(AudioMessage *ap);
+    // Allocate a message and copy the Songcast data into it
+    AudioMessage *copyAudio(unsigned int bits, unsigned int chans,
+                            unsigned int samples, unsigned int freq,
+                            const unsigned char *data, unsigned int bytes);
+    // Common end of the audio processing for both receive paths:
+    // timestamps, and insertion in the jitter buffer.
+    void insert(AudioMessage *ap, const unsigned char *data,
+                unsigned int bytes, unsigned int frame, unsigned int mediats,
+                unsigned int medialatency, long long recvus);
+    // Stream stopped: reset our state and tell the eater to discard
+    // the queued audio.
+    void flush();
+    // Tell the eater to discard the queued audio. Lock-free, may be
+    // called from any thread.
+    void sendFlush();
+    // Act on the requests from the state callbacks
+    void checkRequests();
+
     // Debug, stats, etc while we get to understand the Songcast streams
     class Observer {
     public:
-        TBool iReset;
         TUint iCount;
-        TUint iFrame;
         int dumpfd;
         Chrono chron;
-        Observer() : iReset(true), iCount(0), iFrame(0), dumpfd(-1) {
+        AudioMessagePool *pool;
+        JitterBuffer *jitter;
+        LossConcealer *plc;
+        MediaClock *clock;
+        Observer()
+            : iCount(0), dumpfd(-1), pool(0), jitter(0), plc(0), clock(0) {
 #if 0
             dumpfd = 
                 open("/y/av/tmp/sc2dump", O_WRONLY|O_CREAT|O_TRUNC, 0666);
@@ -131,21 +232,111 @@ private:
 #endif
         }
 
-        void reset() {
-            iReset = true;
-        }
-
         void process(OhmMsgAudio& aMsg);
     };
     Observer m_obs;
     AudioEater *m_eater;
+    AudioQueue *m_queue;
+    AudioMessagePool *m_pool;
+    unsigned long m_overruns;
+    // Reorders the messages according to the frame numbers
+    JitterBuffer *m_jitter;
+    // Fills the gaps left by lost frames. May be 0 if disabled
+    LossConcealer *m_plc;
+    // Maps the media timestamps to local play times. 0 if disabled
+    MediaClock *m_clock;
+    // Zero-copy mode: hold a ref on the ohNet message instead of
+    // copying the data.
+    bool m_zerocopy;
+    // The eater wants the data swapped (Songcast is msb-first)
+    bool m_needswap;
+    // Records the received messages (sccapturefile). May be 0
+    CaptureWriter *m_capture;
+    // Backup senders watchdog. May be 0
+    Failover *m_failover;
+    // Last state callback. Points to a static string.
+    const char * volatile m_state;
+    // The state callbacks may come from another thread than the audio
+    // messages. The above objects are only used by the receive thread:
+    // the callbacks set these for it to reset its state on the next
+    // message (m_flushreq also discards what the jitter buffer holds).
+    std::atomic<bool> m_resetreq;
+    std::atomic<bool> m_flushreq;
+    // Set while discarding the jitter buffer contents
+    bool m_discard;
 };
 
 OhmReceiverDriver::OhmReceiverDriver(AudioEater *eater, 
                                      AudioEater::Context *ctxt)
-    : m_eater(eater)
+    : m_eater(eater), m_queue(ctxt->queue), m_pool(ctxt->pool),
+      m_overruns(0), m_plc(0), m_clock(0), m_zerocopy(false),
+      m_needswap(false), m_capture(0), m_failover(0), m_state("stopped"),
+      m_resetreq(false), m_flushreq(false), m_discard(false)
 {
-    audioqueue.start(1, m_eater->worker, ctxt);
+    string value;
+    if (ctxt->config && ctxt->config->get("sccapturefile", value)) {
+        m_capture = new CaptureWriter(value);
+    }
+    if (ctxt->config && ctxt->config->get("sczerocopy", value)) {
+        m_zerocopy = atoi(value.c_str()) != 0;
+    }
+    unsigned int frames = jitterframes;
+    unsigned int ms = jitterms;
+    if (ctxt->config && ctxt->config->get("scjitterframes", value)) {
+        frames = atoi(value.c_str());
+    }
+    if (ctxt->config && ctxt->config->get("scjitterms", value)) {
+        ms = atoi(value.c_str());
+    }
+    m_jitter = new JitterBuffer(frames, ms, jitterOutput, this);
+
+    // Songcast data is always msb-first.  Convert to desired order:
+    // depends on what downstream wants. We do it when we copy the
+    // buf anyway, else the consumer does it in its first pass.
+    switch (m_eater->input_border) {
+    case AudioEater::BO_MSB: 
+        break;
+    case AudioEater::BO_LSB: 
+        m_needswap = true; 
+        break;
+    case AudioEater::BO_HOST:
+#ifdef WORDS_BIGENDIAN
+        m_needswap = false;
+#else
+        m_needswap = true;
+#endif
+        break;
+    }
+
+    bool plc = true;
+    if (ctxt->config && ctxt->config->get("scplc", value)) {
+        plc = atoi(value.c_str()) != 0;
+    }
+    if (plc) {
+        // Byte order of the data we queue, when not left for the
+        // consumer to swap.
+        bool msbfirst = m_eater->input_border == AudioEater::BO_MSB;
+#ifdef WORDS_BIGENDIAN
+        if (m_eater->input_border == AudioEater::BO_HOST)
+            msbfirst = true;
+#endif
+        m_plc = new LossConcealer(m_pool, msbfirst);
+    }
+    bool timestamps = true;
+    if (ctxt->config && ctxt->config->get("sctimestamps", value)) {
+        timestamps = atoi(value.c_str()) != 0;
+    }
+    if (timestamps) {
+        m_clock = new MediaClock();
+    }
+    m_obs.pool = m_pool;
+    m_obs.jitter = m_jitter;
+    m_obs.plc = m_plc;
+    m_obs.clock = m_clock;
+    LOGDEB("OhmReceiverDriver: zero-copy: " << m_zerocopy << " jitter: " <<
+           frames << " frames " << ms << " mS. Concealment: " << plc <<
+           " timestamps: " << timestamps << endl);
+    m_queue->start(1, m_eater->worker, ctxt);
 }
 
 void OhmReceiverDriver::Add(OhmMsg& aMsg)
@@ -161,11 +352,13 @@ void OhmReceiverDriver::Timestamp(OhmMsg& /*aMsg*/)
 void OhmReceiverDriver::Started()
 {
     LOGDEB("=== STARTED ====\n");
+    m_state = "started";
 }
 
 void OhmReceiverDriver::Connected()
 {
-    m_obs.reset();
+    m_resetreq = true;
+    m_state = "connected";
     printf("CONNECTED\n");
     fflush(stdout);
     LOGDEB("=== CONNECTED ====\n");
@@ -174,16 +367,78 @@ void OhmReceiverDriver::Connected()
 void OhmReceiverDriver::Playing()
 {
     LOGDEB("=== PLAYING ====\n");
+    m_state = "playing";
 }
 
 void OhmReceiverDriver::Disconnected()
 {
     LOGDEB("=== DISCONNECTED ====\n");
+    m_state = "disconnected";
+    if (m_failover)
+        m_failover->lost();
+    m_flushreq = true;
+    sendFlush();
 }
 
 void OhmReceiverDriver::Stopped()
 {
     LOGDEB("=== STOPPED ====\n");
+    m_state = "stopped";
+    m_flushreq = true;
+    sendFlush();
+}
+
+// Called on the receive thread, before processing a message
+void OhmReceiverDriver::checkRequests()
+{
+    bool flushreq = m_flushreq.exchange(false);
+    if (!m_resetreq.exchange(false) && !flushreq) {
+        return;
+    }
+    // The eater already got a flush message for what was queued: drop
+    // what the jitter buffer holds instead of queueing it after.
+    m_discard = flushreq;
+    m_jitter->flush();
+    m_discard = false;
+    if (m_plc)
+        m_plc->reset();
+    if (m_clock)
+        m_clock->reset();
+}
+
+// Called on the receive thread
+void OhmReceiverDriver::flush()
+{
+    // The jitter buffer outputs what it holds, which the flush
+    // message will then discard with the rest of the queue.
+    m_jitter->flush();
+    if (m_plc)
+        m_plc->reset();
+    if (m_clock)
+        m_clock->reset();
+    sendFlush();
+}
+
+void OhmReceiverDriver::sendFlush()
+{
+    AudioMessage *ap = m_pool->get(0, 0, 0, 0);
+    if (ap == 0) {
+        return;
+    }
+    ap->m_flush = true;
+    // The eater gets the message ahead of the queued audio
+    if (!m_queue->putControl(ap, true)) {
+        LOGERR("sc2mpd: queue dead: exiting\n");
+        exit(1);
+    }
+}
+
+void OhmReceiverDriver::finish()
+{
+    checkRequests();
+    m_jitter->flush();
+    m_queue->waitIdle();
+    m_queue->setTerminateAndWait();
 }
 
 // Debug and stats only, not needed for main function
@@ -198,17 +453,39 @@ void OhmReceiverDriver::Observer::process(OhmMsgAudio& aMsg)
                " Halted ? " << aMsg.Halt() << endl);
 
         if (last_timestamp) {
+            unsigned int tps = 256 * (aMsg.SampleRate() % 44100 == 0 ?
+                                      44100 : 48000);
             long long intervalus = 
-                ((timestamp - last_timestamp) * 1000000) / (256*48000);
-            long long atsus = 
-                ((timestamp) * 1000000) / (256*48000);
-            long long absus = chron.amicros() - 1430477861905884LL;
+                ((unsigned int)(timestamp - last_timestamp) * 1000000LL) / tps;
             LOGDEB("Computed-uS: " << intervalus  << 
-                   " Elapsed-uS: " << chron.urestart() << 
-                   " Timestamp-uS: " << atsus <<
-                   " Abs-uS: " << absus << 
-                   " Diff-mS " << (absus - atsus) / 1000 <<
-                   endl);
+                   " Elapsed-uS: " << chron.urestart() << endl);
+        }
+        long long transit, latency;
+        double ppm;
+        if (clock && clock->estimates(&transit, &ppm, &latency)) {
+            LOGDEB("Media clock: transit-uS " << transit << " drift-ppm " <<
+                   ppm << " latency-uS " << latency << endl);
+        }
+        if (pool) {
+            AudioMessagePool::Stats st;
+            pool->getStats(st);
+            LOGDEB("Msg pool: hits " << st.hits << " misses " << st.misses <<
+                   " oversize " << st.oversize << " outstanding " << 
+                   st.outstanding << " highwater " << st.highwater << 
+                   " blocks " << st.blocks << endl);
+        }
+        if (jitter) {
+            JitterBuffer::Stats st;
+            jitter->getStats(st);
+            LOGDEB("Jitter buffer: reordered " << st.reordered << " late " <<
+                   st.late << " duplicates " << st.duplicates << " lost " <<
+                   st.lost << " maxdepth " << st.maxdepth << endl);
+        }
+        if (plc) {
+            LossConcealer::Stats st;
+            plc->getStats(st);
+            LOGDEB("Concealment: events " << st.events << " frames " <<
+                   st.frames << " silent frames " << st.silentframes << endl);
         }
         last_timestamp = timestamp;
 
@@ -223,14 +500,7 @@ void OhmReceiverDriver::Observer::process(OhmMsgAudio& aMsg)
             }
             const unsigned char *icp = 
                 (const unsigned char *)aMsg.Audio().Ptr();
-            bool silence = true;
-            for (unsigned int i = 0; i < bytes; i++) {
-                if (icp[i]) {
-                    silence = false;
-                    break;
-                }
-            }
-            if (silence) {
+            if (audioIsZero(icp, bytes)) {
                 LOGDEB("OhmRcvDrv::Process:audio: silence buffer" << endl);
             }
             if (dumpfd >= 0) {
@@ -242,102 +512,205 @@ void OhmReceiverDriver::Observer::process(OhmMsgAudio& aMsg)
 
         iCount = 0;
     }
-
-    if (iReset) {
-        iFrame = aMsg.Frame();
-        iReset = false;
-    } else {
-        if (aMsg.Frame() != iFrame + 1) {
-            LOGINF("Missed frames between " << iFrame << " and " << 
-                   aMsg.Frame() << endl);
-        }
-        iFrame = aMsg.Frame();
-    }
 }
 
 void copyswap(unsigned char *dest, const unsigned char *src, 
               unsigned int bytes, unsigned int bits)
 {
-    unsigned char *ocp = dest;
-    const unsigned char *icp = src;
-    if (bits == 16) {
-        swab(src, dest, bytes);
-    } else if (bits == 24) {
-        while (icp - src <= int(bytes) - 3) {
-            *ocp++ = icp[2];
-            *ocp++ = icp[1];
-            *ocp++ = *icp;
-            icp += 3;
-        }
-    } else if (bits == 32) {
-        // Never seen this but whatever...
-        while (icp - src <= int(bytes) - 4) {
-            *ocp++ = icp[3];
-            *ocp++ = icp[2];
-            *ocp++ = icp[1];
-            *ocp++ = *icp;
-            icp += 4;
-        }
-    }
+    bswapSamples(dest, src, bytes, bits);
+}
+
+// Called when a consumer releases a zero-copy message.
+static void unrefOhmMsg(void *ref)
+{
+    ((OhmMsg *)ref)->RemoveRef();
 }
 
 void OhmReceiverDriver::Process(OhmMsgAudio& aMsg)
 {
+    if (m_capture) {
+        OhmAudio msg;
+        msg.halt = aMsg.Halt();
+        msg.frame = aMsg.Frame();
+        msg.samples = aMsg.Samples();
+        msg.freq = aMsg.SampleRate();
+        msg.bits = aMsg.BitDepth();
+        msg.chans = aMsg.Channels();
+        msg.medialatency = aMsg.MediaLatency();
+        msg.mediatimestamp = aMsg.MediaTimestamp();
+        msg.data = aMsg.Audio().Ptr();
+        msg.bytes = aMsg.Audio().Bytes();
+        msg.recvus = Chrono::monomicros();
+        m_capture->write(msg);
+    }
+    m_obs.process(aMsg);
+    checkRequests();
+    if (aMsg.Halt()) {
+        // End of stream: no use waiting for missing frames or
+        // playing what's queued. The halt message usually carries
+        // no audio, so this must come before the empty test.
+        if (m_failover)
+            m_failover->halted();
+        flush();
+        return;
+    }
     if (aMsg.Audio().Bytes() == 0) {
         LOGDEB("OhmReceiverDriver::Process: empty message\n");
         return;
     }
 
-    m_obs.process(aMsg);
-    if (aMsg.Halt()) {
+    long long now = Chrono::monomicros();
+    if (m_failover)
+        m_failover->packet(now);
+    unsigned int bytes = aMsg.Audio().Bytes();
+    AudioMessage *ap;
+    if (m_zerocopy) {
+        // Keep a reference on the ohNet message and use its
+        // buffer. The ref is dropped when the consumer releases the
+        // message (possibly from another thread). Note that the
+        // OhmReceiver message factory has a limited capacity, so
+        // the audio queue should not be too big in this mode.
+        ap = m_pool->get(aMsg.BitDepth(), aMsg.Channels(), 0,
+                         aMsg.SampleRate());
+        if (ap == 0) {
+            LOGERR("OhmReceiverDriver::Process: can't allocate message\n");
+            return;
+        }
+        unsigned int databytes = aMsg.Samples() * (aMsg.BitDepth() / 8) *
+            aMsg.Channels();
+        aMsg.AddRef();
+        ap->setExternal((char *)aMsg.Audio().Ptr(), MIN(bytes, databytes),
+                        unrefOhmMsg, &aMsg);
+        ap->m_needswap = m_needswap;
+    } else {
+        ap = copyAudio(aMsg.BitDepth(), aMsg.Channels(), aMsg.Samples(),
+                       aMsg.SampleRate(), aMsg.Audio().Ptr(), bytes);
+        if (ap == 0) {
+            return;
+        }
+    }
+    insert(ap, aMsg.Audio().Ptr(), bytes, aMsg.Frame(),
+           aMsg.MediaTimestamp(), aMsg.MediaLatency(), now);
+}
+
+void OhmReceiverDriver::nativeAudio(const OhmAudio& msg)
+{
+    if (m_capture) {
+        m_capture->write(msg);
+    }
+    checkRequests();
+    if (msg.halt) {
+        m_state = "stopped";
+        if (m_failover)
+            m_failover->halted();
+        flush();
+        return;
+    }
+    m_state = "playing";
+    if (m_failover)
+        m_failover->packet(msg.recvus);
+    if (msg.bytes == 0) {
         return;
     }
+    // The receive buffer is reused: always copy
+    AudioMessage *ap = copyAudio(msg.bits, msg.chans, msg.samples, msg.freq,
+                                 msg.data, msg.bytes);
+    if (ap == 0) {
+        return;
+    }
+    insert(ap, msg.data, msg.bytes, msg.frame, msg.mediatimestamp,
+           msg.medialatency, msg.recvus);
+}
 
-    unsigned int bytes = aMsg.Audio().Bytes();
-    // We allocate a bit more space to avoir reallocations in the resampler
-    unsigned int allocbytes = bytes + 100; 
-    char *buf = (char *)malloc(allocbytes);
-    if (buf == 0) {
+// Called on the receive thread
+AudioMessage *OhmReceiverDriver::copyAudio(
+    unsigned int bits, unsigned int chans, unsigned int samples,
+    unsigned int freq, const unsigned char *data, unsigned int bytes)
+{
+    AudioMessage *ap = m_pool->get(bits, chans, samples, freq);
+    if (ap == 0 || !ap->reserve(bytes)) {
         LOGERR("OhmReceiverDriver::Process: can't allocate " << 
                bytes << " bytes\n");
-        return;
+        AudioMessage::release(ap);
+        return 0;
     }
-
-    // Songcast data is always msb-first.  Convert to desired order:
-    // depends on what downstream wants, and just as well we do it
-    // here because we copy the buf anyway.
-    bool needswap = false;
-    switch (m_eater->input_border) {
-    case AudioEater::BO_MSB: 
-        break;
-    case AudioEater::BO_LSB: 
-        needswap = true; 
-        break;
-    case AudioEater::BO_HOST:
-#ifdef WORDS_BIGENDIAN
-        needswap = false;
-#else
-        needswap = true;
-#endif
-        break;
+    if (m_needswap) {
+        copyswap((unsigned char *)ap->m_buf, data, bytes, bits);
+    } else {
+        memcpy(ap->m_buf, data, bytes);
     }
+    return ap;
+}
 
-    if (needswap) {
-        copyswap((unsigned char *)buf, aMsg.Audio().Ptr(), bytes, aMsg.BitDepth());
-    } else {
-        memcpy(buf, aMsg.Audio().Ptr(), bytes);
+// Called on the receive thread
+void OhmReceiverDriver::insert(AudioMessage *ap, const unsigned char *data,
+                               unsigned int bytes, unsigned int frame,
+                               unsigned int mediats, unsigned int medialatency,
+                               long long recvus)
+{
+    ap->m_silent = audioIsZero(data, bytes);
+    ap->m_stamps[AudioMessage::STG_RECV] = recvus;
+    if (m_clock) {
+        ap->m_playat =
+            m_clock->playTime(frame, mediats, medialatency, ap->m_freq,
+                              ap->frames(), recvus);
+        ap->m_latencyus = m_clock->latencyus();
     }
+    m_jitter->insert(ap, frame);
+}
 
-    AudioMessage *ap = new 
-        AudioMessage(aMsg.BitDepth(), aMsg.Channels(), aMsg.Samples(),
-                     aMsg.SampleRate(), buf, allocbytes);
+void OhmReceiverDriver::jitterOutput(AudioMessage *ap, unsigned int lost,
+                                     void *arg)
+{
+    ((OhmReceiverDriver *)arg)->output(ap, lost);
+}
+
+void OhmReceiverDriver::output(AudioMessage *ap, unsigned int lost)
+{
+    if (m_discard) {
+        AudioMessage::release(ap);
+        return;
+    }
+    if (lost) {
+        LOGINF("OhmReceiverDriver: lost " << lost << " frame(s)\n");
+        if (m_plc) {
+            // Fill the gap so that the sample clock stays continuous
+            vector<AudioMessage*> msgs;
+            m_plc->conceal(lost, ap, msgs);
+            for (unsigned int i = 0; i < msgs.size(); i++) {
+                if (ap->m_playat) {
+                    msgs[i]->m_playat = ap->m_playat - 
+                        (long long)(msgs.size() - i) * ap->frames() *
+                        1000000 / ap->m_freq;
+                    msgs[i]->m_latencyus = ap->m_latencyus;
+                }
+                msgs[i]->m_stamps[AudioMessage::STG_RECV] =
+                    ap->m_stamps[AudioMessage::STG_RECV];
+                m_plc->feed(msgs[i]);
+                enqueue(msgs[i]);
+            }
+        }
+    }
+    if (m_plc) {
+        m_plc->feed(ap);
+    }
+    enqueue(ap);
+}
 
-    // There is nothing special we can do if put fails: no way to
-    // return status. Should we just exit ?
-    if (!audioqueue.put(ap, false)) {
+void OhmReceiverDriver::enqueue(AudioMessage *ap)
+{
+    // put() never blocks: if the eater is late, the queue drops
+    // data. It only fails if the eater is gone. There is nothing
+    // special we can do then: no way to return status.
+    if (!m_queue->put(ap)) {
         LOGERR("sc2mpd: queue dead: exiting\n");
         exit(1);
     }
+    if (m_queue->overruns() != m_overruns) {
+        m_overruns = m_queue->overruns();
+        LOGINF("OhmReceiverDriver::Process: audio queue overrun. Total: " <<
+               m_overruns << endl);
+    }
 }
 
 void OhmReceiverDriver::Process(OhmMsgTrack& aMsg)
@@ -347,6 +720,9 @@ void OhmReceiverDriver::Process(OhmMsgTrack& aMsg)
     LOGDEB("OhmRcvDrv::Process:trk: TRACK SEQ " << aMsg.Sequence() <<
            " URI " << uri.CString() <<
            " METADATA " << metadata.CString() << endl);
+    if (m_eater == &relayAudioEater) {
+        relayTrack(aMsg.Uri(), aMsg.Metadata());
+    }
 }
 
 void OhmReceiverDriver::Process(OhmMsgMetatext& aMsg)
@@ -354,10 +730,274 @@ void OhmReceiverDriver::Process(OhmMsgMetatext& aMsg)
     Brhz metatext(aMsg.Metatext());
     LOGDEB("OhmRcvDrv::Process:meta: METATEXT SEQUENCE " <<  aMsg.Sequence() <<
            " METATEXT " << metatext.CString() << endl);
+    if (m_eater == &relayAudioEater) {
+        relayMetatext(aMsg.Metatext());
+    }
+}
+
+static void disposeAudioMessage(AudioMessage *m)
+{
+    AudioMessage::release(m);
+}
+
+// Create the audio queue according to the configuration: size in
+// milliseconds (scqueuems) and overflow policy (scqueueoverflow,
+// dropoldest or dropnewest)
+static AudioQueue *makeAudioQueue(ConfSimple& config)
+{
+    unsigned int ms = audioqueuems;
+    AudioQueue::Overflow ovf = AudioQueue::OVF_DROPOLDEST;
+    string value;
+    if (config.get("scqueuems", value)) {
+        ms = atoi(value.c_str());
+    }
+    if (config.get("scqueueoverflow", value)) {
+        if (!value.compare("dropnewest")) {
+            ovf = AudioQueue::OVF_DROPNEWEST;
+        } else if (value.compare("dropoldest")) {
+            LOGERR("Bad scqueueoverflow value [" << value << 
+                   "] using dropoldest" << endl);
+        }
+    }
+    unsigned int slots = ms / packetms;
+    if (slots < 2)
+        slots = 2;
+    AudioQueue *queue = new AudioQueue("audioqueue", slots, ovf,
+                                       disposeAudioMessage);
+    LOGDEB("makeAudioQueue: " << ms << " mS, " << queue->capacity() <<
+           " slots, overflow: " << (ovf == AudioQueue::OVF_DROPOLDEST ? 
+                                    "dropoldest" : "dropnewest") << endl);
+    return queue;
+}
+
+// Create the message pool: block count (scpoolbufs), payload size
+// (scpoolbufbytes) and huge pages use (scpoolhugepages)
+static AudioMessagePool *makeMessagePool(ConfSimple& config)
+{
+    unsigned int count = poolbufs;
+    unsigned int bytes = poolbufbytes;
+    bool hugepages = true;
+    string value;
+    if (config.get("scpoolbufs", value)) {
+        count = atoi(value.c_str());
+    }
+    if (config.get("scpoolbufbytes", value)) {
+        bytes = atoi(value.c_str());
+    }
+    if (config.get("scpoolhugepages", value)) {
+        hugepages = atoi(value.c_str()) != 0;
+    }
+    return new AudioMessagePool(bytes, count, hugepages);
+}
+
+// The receive path: the ohNet OhmReceiver, or our own (scnativerecv,
+// ohu:// and ohm:// uris only).
+class Receiver {
+public:
+    Receiver(OhmReceiver *ohm, NativeReceiver *native)
+        : m_ohm(ohm), m_native(native) {}
+    ~Receiver() {
+        delete m_ohm;
+        delete m_native;
+    }
+    // Returns false if the native receiver can't play uri (the
+    // OhmReceiver does not report errors).
+    bool play(const string& uri) {
+        if (m_native) {
+            return m_native->play(uri);
+        }
+        m_ohm->Play(Brhz(Brn(uri.c_str())));
+        return true;
+    }
+    void stop() {
+        if (m_native) {
+            m_native->stop();
+        } else {
+            m_ohm->Stop();
+        }
+    }
+private:
+    OhmReceiver *m_ohm;
+    NativeReceiver *m_native;
+};
+
+static void nativeAudio(const OhmAudio& msg, void *arg)
+{
+    ((OhmReceiverDriver *)arg)->nativeAudio(msg);
+}
+
+// Failover switch to a backup sender. The pipeline stays up, it only
+// sees the flush from the stop.
+static bool switchSender(const string& uri, void *arg)
+{
+    Receiver *receiver = (Receiver *)arg;
+    setSenderUri(uri);
+    receiver->stop();
+    return receiver->play(uri);
+}
+
+// Start playing, through the failover watchdog if there are backup
+// senders (scfailoveruris)
+static bool playSender(Receiver *receiver, Failover *failover,
+                       const string& uri)
+{
+    bool ok = failover ? failover->play(uri) : receiver->play(uri);
+    if (!ok) {
+        LOGERR("sc2mpd: can't play " << uri << endl);
+    }
+    return ok;
+}
+
+static void stopSender(Receiver *receiver, Failover *failover)
+{
+    if (failover) {
+        failover->stop();
+    }
+    receiver->stop();
+}
+
+// Log the latency and queue statistics. Called on SIGUSR1
+static void statsDump()
+{
+    latencyDump();
+    workQueueStatsDump();
+}
+
+// Daemon mode. Commands on the control socket, one per line:
+//  play <uri>  switch to the sender (the pipeline and the audio
+//              output stay open)
+//  stop        stop receiving
+//  state       returns "OK <receiver state> <uri>"
+//  latency     log the latency and queue statistics
+//  queues      returns "OK" followed by one "name depth peak tasks
+//              putblocked-mS takewait-p99-uS residence-p99-uS"
+//              group per queue, separated by ';'
+//  quit        exit sc2mpd
+// Replies are "OK [data]" or "ERR <message>".
+struct ControlContext {
+    Receiver *receiver;
+    OhmReceiverDriver *driver;
+    Failover *failover;
+};
+
+static string controlCommand(const string& cmd, bool& quit, void *arg)
+{
+    ControlContext *ctl = (ControlContext *)arg;
+    string verb(cmd), param;
+    string::size_type sp = cmd.find(' ');
+    if (sp != string::npos) {
+        verb = cmd.substr(0, sp);
+        string::size_type start = cmd.find_first_not_of(' ', sp);
+        if (start != string::npos)
+            param = cmd.substr(start);
+    }
+
+    if (verb == "play") {
+        if (param.empty()) {
+            return "ERR no uri";
+        }
+        LOGINF("scmpdcli: play " << param << endl);
+        // Set the uri first: the eater checks it when it gets the
+        // flush resulting from the stop.
+        setSenderUri(param);
+        latencyStart();
+        if (!ctl->failover) {
+            ctl->receiver->stop();
+        }
+        if (!playSender(ctl->receiver, ctl->failover, param)) {
+            return "ERR can't play " + param;
+        }
+        return "OK";
+    } else if (verb == "stop") {
+        LOGINF("scmpdcli: stop\n");
+        stopSender(ctl->receiver, ctl->failover);
+        return "OK";
+    } else if (verb == "state") {
+        return string("OK ") + ctl->driver->state() + " " + senderUri();
+    } else if (verb == "latency") {
+        statsDump();
+        return "OK";
+    } else if (verb == "queues") {
+        vector<WorkQueueStats> stats;
+        workQueueStats(stats);
+        ostringstream out;
+        out << "OK";
+        for (unsigned int i = 0; i < stats.size(); i++) {
+            out << (i ? "; " : " ") << stats[i].name << " " <<
+                stats[i].depth << " " << stats[i].peakdepth << " " <<
+                stats[i].tasks << " " << stats[i].putblockedus / 1000 <<
+                " " << stats[i].takewaitp99 << " " << stats[i].residencep99;
+        }
+        return out.str();
+    } else if (verb == "quit") {
+        quit = true;
+        return "OK";
+    }
+    return "ERR unknown command";
+}
+
+// Daemon mode: the main thread serves the control socket, this one
+// waits for the signals.
+static void *sigThread(void *arg)
+{
+    sigset_t *sigs = (sigset_t *)arg;
+    for (;;) {
+        int sig;
+        if (sigwait(sigs, &sig) == 0 && sig == SIGUSR1) {
+            statsDump();
+        }
+    }
+    return 0;
+}
+
+// Multi-stream mode: one receiver per sender in scmixuris, all mixed
+// into the alsa output (see mixer.h). Does not return.
+static int mixMain(Library *lib, ConfSimple& config, TIpAddress adapter,
+                   TUint ttl, sigset_t *sigs)
+{
+    vector<string> uris;
+    string value;
+    if (config.get("scmixuris", value)) {
+        istringstream str(value);
+        string uri;
+        while (str >> uri)
+            uris.push_back(uri);
+    }
+    if (uris.empty()) {
+        cerr << "Mix mode: no sender uris (scmixuris)" << endl;
+        return 1;
+    }
+    if (!mixerInit(config, uris.size())) {
+        return 1;
+    }
+    vector<OhmReceiver*> receivers;
+    for (unsigned int i = 0; i < uris.size(); i++) {
+        AudioEater::Context *ctxt = 
+            new AudioEater::Context(makeAudioQueue(config));
+        ctxt->config = &config;
+        ctxt->pool = makeMessagePool(config);
+        ctxt->stream = i;
+        OhmReceiverDriver* driver = new OhmReceiverDriver(&mixAudioEater, ctxt);
+        receivers.push_back(new OhmReceiver(lib->Env(), adapter, ttl, *driver));
+    }
+    for (unsigned int i = 0; i < receivers.size(); i++) {
+        LOGINF("scmpdcli: mix stream " << i << " " << uris[i] << endl);
+        receivers[i]->Play(Brhz(Brn(uris[i].c_str())));
+    }
+    for (;;) {
+        int sig;
+        if (sigwait(sigs, &sig) == 0 && sig == SIGUSR1) {
+            statsDump();
+        }
+    }
+    return 0;
 }
 
 int CDECL main(int aArgc, char* aArgv[])
 {
+    // For the time to first sample
+    latencyStart();
+
     string logfilename;
     int loglevel(Logger::LLINF);
 
@@ -386,10 +1026,37 @@ int CDECL main(int aArgc, char* aArgv[])
                             "http stream");
     parser.AddOption(&optionDevice);
 
+    OptionBool optionRelay("-r", "--relay", 
+                           "[relay] re-send the stream as a Songcast sender "
+                           "instead of playing it");
+    parser.AddOption(&optionRelay);
+
+    OptionBool optionMix("-m", "--mix", 
+                         "[mix] receive the senders listed in scmixuris and "
+                         "mix them to alsa");
+    parser.AddOption(&optionMix);
+
+    OptionString optionSocket("-s", "--socket", Brn(""), 
+                              "[path] daemon mode: control socket path");
+    parser.AddOption(&optionSocket);
+
+    OptionString optionReplay("-f", "--replay", Brn(""), 
+                              "[file] play a capture (sccapturefile) instead "
+                              "of receiving");
+    parser.AddOption(&optionReplay);
+
     if (!parser.Parse(aArgc, aArgv)) {
         return (1);
     }
 
+    // SIGUSR1 dumps the latency statistics. Block it before any
+    // thread is created (they inherit the mask): the main thread
+    // waits for it.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, 0);
+
     InitialisationParams* initParams = InitialisationParams::Create();
 
     Library* lib = new Library(initParams);
@@ -402,6 +1069,10 @@ int CDECL main(int aArgc, char* aArgv[])
 
     TUint ttl = optionTtl.Value();
     Brhz uri(optionUri.Value());
+    Brhz sockpath(optionSocket.Value());
+    Brhz replayfile(optionReplay.Value());
+    // In daemon mode, we only start playing if a uri was given.
+    bool autoplay = !uri.Equals(Brn("mpus://0.0.0.0:0"));
 
     string uconfigfile = (const char *)optionConfig.Value().Ptr();
 
@@ -430,22 +1101,119 @@ int CDECL main(int aArgc, char* aArgv[])
     LOGINF("scmpdcli: using subnet " << (subnet & 0xff) << "." << 
            ((subnet >> 8) & 0xff) << "." << ((subnet >> 16) & 0xff) << "." <<
            ((subnet >> 24) & 0xff) << endl);
+    LOGDEB("scmpdcli: audio kernels: " << audioKernelsImpl() << endl);
+
+    // The receiver only needs the network environment, not the UPnP
+    // control point stack, which takes time to start (and threads).
+    // scstartcp restores the old behaviour, just in case.
+    bool startcp = false;
+    if (config.get("scstartcp", value)) {
+        startcp = atoi(value.c_str()) != 0;
+    }
+    if (startcp) {
+        CpStack* cpStack = lib->StartCp(subnet);
+        cpStack = cpStack; // avoid unused variable warning
+    } else {
+        lib->SetCurrentSubnet(subnet);
+    }
 
-    AudioEater::Context *ctxt = new AudioEater::Context(&audioqueue);
+    if (optionMix.Value()) {
+        Debug::SetLevel(Debug::kMedia);
+        return mixMain(lib, config, adapter, ttl, &sigs);
+    }
+
+    if (replayfile.Bytes() && config.get("sccapturefile", value) &&
+        value == replayfile.CString()) {
+        cerr << "The capture file would overwrite the replayed one" << endl;
+        return 1;
+    }
+
+    AudioQueue *audioqueue = makeAudioQueue(config);
+    AudioEater::Context *ctxt = new AudioEater::Context(audioqueue);
     ctxt->config = &config;
+    ctxt->pool = makeMessagePool(config);
+    if (sockpath.Bytes() == 0 || autoplay) {
+        setSenderUri(uri.CString());
+    }
 
-    OhmReceiverDriver* driver = 
-        new OhmReceiverDriver(optionDevice.Value() ? 
-                              &alsaAudioEater : &httpAudioEater, ctxt);
+    AudioEater *eater = &httpAudioEater;
+    if (optionRelay.Value()) {
+        if (!relayInit(lib, config, adapter, ttl)) {
+            return 1;
+        }
+        eater = &relayAudioEater;
+    } else if (optionDevice.Value()) {
+        eater = &alsaAudioEater;
+    }
+    OhmReceiverDriver* driver = new OhmReceiverDriver(eater, ctxt);
+
+    if (replayfile.Bytes()) {
+        // Impairments, to test the receive pipeline
+        Impairments imp;
+        if (config.get("screplayloss", value))
+            imp.loss = atof(value.c_str());
+        if (config.get("screplayreorder", value))
+            imp.reorder = atof(value.c_str());
+        if (config.get("screplayjitterms", value))
+            imp.jitterms = atoi(value.c_str());
+        if (config.get("screplayskewppm", value))
+            imp.skewppm = atof(value.c_str());
+        if (config.get("screplayspeed", value))
+            imp.speed = atof(value.c_str());
+        if (config.get("screplayseed", value))
+            imp.seed = atoi(value.c_str());
+        bool ok = replayCapture(replayfile.CString(), imp, nativeAudio, driver);
+        // Let the eater play what is queued
+        driver->finish();
+        return ok ? 0 : 1;
+    }
 
-    OhmReceiver* receiver = new OhmReceiver(lib->Env(), adapter, ttl, *driver);
+    bool native = false;
+    if (config.get("scnativerecv", value)) {
+        native = atoi(value.c_str()) != 0;
+    }
+    Receiver *receiver;
+    if (native) {
+        unsigned int batch = 32;
+        if (config.get("screcvbatch", value)) {
+            batch = atoi(value.c_str());
+        }
+        receiver = new Receiver(0, new NativeReceiver(adapter, ttl, batch,
+                                                      nativeAudio, driver));
+    } else {
+        receiver = new Receiver(new OhmReceiver(lib->Env(), adapter, ttl,
+                                                *driver), 0);
+    }
 
-    CpStack* cpStack = lib->StartCp(subnet);
-    cpStack = cpStack; // avoid unused variable warning
+    Failover *failover = Failover::create(config, switchSender, receiver);
+    if (failover) {
+        if (!failover->start()) {
+            return 1;
+        }
+        driver->setFailover(failover);
+    }
 
     Debug::SetLevel(Debug::kMedia);
 
-    if (optionInteract.Value()) {
+    if (sockpath.Bytes()) {
+        ControlContext ctl;
+        ctl.receiver = receiver;
+        ctl.driver = driver;
+        ctl.failover = failover;
+        ControlServer server(sockpath.CString(), controlCommand, &ctl);
+        if (!server.ok()) {
+            cerr << "Can't create control socket " << sockpath.CString() <<
+                endl;
+            return 1;
+        }
+        pthread_t sigthr;
+        pthread_create(&sigthr, 0, sigThread, &sigs);
+        if (autoplay) {
+            playSender(receiver, failover, uri.CString());
+        }
+        server.run();
+        stopSender(receiver, failover);
+    } else if (optionInteract.Value()) {
         printf("q = quit\n");
         for (;;) {
             int key = mygetch();
@@ -455,19 +1223,27 @@ int CDECL main(int aArgc, char* aArgv[])
                 break;
             } else if (key == 'p') {
                 printf("PLAY %s\n", uri.CString());
-                receiver->Play(uri);
+                playSender(receiver, failover, uri.CString());
             } else if (key == 's') {
                 printf("STOP\n");
-                receiver->Stop();
+                stopSender(receiver, failover);
+            } else if (key == 'l') {
+                statsDump();
             }
         }
     } else {
-        receiver->Play(uri);
+        if (!playSender(receiver, failover, uri.CString())) {
+            return 1;
+        }
         for (;;) {
-            sleep(1000);
+            int sig;
+            if (sigwait(&sigs, &sig) == 0 && sig == SIGUSR1) {
+                statsDump();
+            }
         }
     }
 
+    delete failover;
     delete(receiver);
 
     delete lib;
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+# Copyright (C) 2016 J.F.Dockes
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the
+#   Free Software Foundation, Inc.,
+#   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+#
+from __future__ import print_function
+
+# Time to first sample harness: start sc2mpd repeatedly on a playing
+# sender, and report the delay between the process launch and the
+# first audio sample output (written to alsa, or sent to the http
+# client).
+#
+# sc2mpd logs the delay from the start of main() (see latencyStart()
+# in histo.cpp). We also measure it from here, which adds the process
+# creation and the dynamic linking.
+#
+# The configuration (-c) is copied to a temporary file, with the log
+# parameters replaced, so that the other settings (e.g. scstartms,
+# scpreopenfreq, scstartcp) can be compared.
+
+import tempfile
+import time
+import subprocess
+import os
+import re
+import sys
+import getopt
+import signal
+import shutil
+
+def usage(f):
+    print("Usage: scttfs.py [-h] [-n runs] [-c config] [-d] [-t timeout] "
+          "[-p sc2mpd] -u uri", file=f)
+    sys.exit(1)
+
+runs = 5
+config = ""
+direct = False
+timeout = 10.0
+sc2mpd = "sc2mpd"
+uri = ""
+
+opts, args = getopt.getopt(sys.argv[1:], "hn:c:dt:p:u:")
+for opt, arg in opts:
+    if opt in ['-h']:
+        usage(sys.stdout)
+    elif opt in ['-n']:
+        runs = int(arg)
+    elif opt in ['-c']:
+        config = arg
+    elif opt in ['-d']:
+        direct = True
+    elif opt in ['-t']:
+        timeout = float(arg)
+    elif opt in ['-p']:
+        sc2mpd = arg
+    elif opt in ['-u']:
+        uri = arg
+if args or not uri:
+    usage(sys.stderr)
+
+firstre = re.compile(r"first sample output after (-?[0-9]+) mS "
+                     r"\(received after (-?[0-9]+) mS\)")
+
+def makeconfig(tmpdir):
+    cf = os.path.join(tmpdir, "sc2mpd.conf")
+    logfn = os.path.join(tmpdir, "sc2mpd.log")
+    lines = []
+    if config:
+        for line in open(config):
+            name = line.split("=")[0].strip()
+            if name not in ("sclogfilename", "scloglevel"):
+                lines.append(line.rstrip("\n"))
+    lines.append("sclogfilename = " + logfn)
+    lines.append("scloglevel = 3")
+    f = open(cf, "w")
+    f.write("\n".join(lines) + "\n")
+    f.close()
+    return cf, logfn
+
+def onerun(tmpdir):
+    cf, logfn = makeconfig(tmpdir)
+    if os.path.exists(logfn):
+        os.unlink(logfn)
+    cmd = [sc2mpd, "-c", cf, "-u", uri]
+    if direct:
+        cmd.append("-d")
+    devnull = open(os.devnull, "w")
+    start = time.time()
+    proc = subprocess.Popen(cmd, stdout=devnull, stderr=devnull)
+    result = None
+    try:
+        while time.time() - start < timeout:
+            if proc.poll() is not None:
+                print("sc2mpd exited with status %d" % proc.returncode,
+                      file=sys.stderr)
+                break
+            if os.path.exists(logfn):
+                m = firstre.search(open(logfn).read())
+                if m:
+                    outside = int(1000 * (time.time() - start))
+                    result = (outside, int(m.group(1)), int(m.group(2)))
+                    break
+            time.sleep(0.005)
+    finally:
+        if proc.poll() is None:
+            proc.send_signal(signal.SIGTERM)
+            proc.wait()
+        devnull.close()
+    return result
+
+def stats(values):
+    values = sorted(values)
+    return "min %d median %d max %d" % \
+           (values[0], values[len(values) // 2], values[-1])
+
+tmpdir = tempfile.mkdtemp(prefix="scttfs")
+results = []
+try:
+    for i in range(runs):
+        r = onerun(tmpdir)
+        if r is None:
+            print("run %d: no sample output after %.1f S" % (i, timeout))
+        else:
+            print("run %d: launch to first sample %d mS (in process %d mS, "
+                  "first packet at %d mS)" % (i, r[0], r[1], r[2]))
+            results.append(r)
+        # Let the audio device be released
+        time.sleep(1)
+finally:
+    shutil.rmtree(tmpdir)
+
+if not results:
+    sys.exit(1)
+print("launch to first sample: " + stats([r[0] for r in results]) + " mS")
+print("in process:             " + stats([r[1] for r in results]) + " mS")
+print("first packet:           " + stats([r[2] for r in results]) + " mS")
@@ -0,0 +1,488 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _SPSCQUEUE_H_INCLUDED_
+#define _SPSCQUEUE_H_INCLUDED_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include <string>
+#include <atomic>
+
+#include "chrono.h"
+#include "log.h"
+#include "wqstats.h"
+
+/**
+ * A single-producer / single-consumer ring used for the hop between
+ * the ohNet network thread and the audio eater.
+ *
+ * The interface mimics the parts of WorkQueue used by the eaters
+ * (start/take/workerExit/setTerminateAndWait), but put() never
+ * blocks and never takes a lock: when the ring is full, an item is
+ * dropped according to the overflow policy, and the overrun counter
+ * is incremented. The dropped item is handed to the disposer
+ * function if one was set.
+ *
+ * The consumer sleeps on a semaphore when the ring is empty. The
+ * producer only calls sem_post() if the consumer advertised that it
+ * was going to sleep, so there is no system call in the normal case.
+ * As with WorkQueue, take() has a variant with a CLOCK_MONOTONIC
+ * deadline (see wqDeadline() in workqueue.h).
+ *
+ * Control items (flush...) go through a small second ring with
+ * putControl(), and are taken before the normal items. Unlike put(),
+ * putControl() may be called from several threads.
+ *
+ * T must be a type which can be stored in a std::atomic (in
+ * practise, a pointer). The control items must not be T() (null).
+ *
+ * The queue statistics (see wqstats.h) are registered under the
+ * queue name.
+ */
+template <class T> class SPSCQueue : public QueueStatsSource {
+public:
+    enum Overflow {OVF_DROPOLDEST, OVF_DROPNEWEST};
+    /** Status for the calls with a deadline */
+    enum WaitStatus {WQ_OK, WQ_TIMEOUT, WQ_FAILED};
+
+    /** Create the ring
+     * @param name for message printing
+     * @param capacity slot count. This is rounded up to a power of 2.
+     * @param ovf what to do when the ring is full.
+     * @param disposer called on the producer thread for dropped items.
+     */
+    SPSCQueue(const std::string& name, size_t capacity,
+              Overflow ovf = OVF_DROPOLDEST, void (*disposer)(T) = 0)
+        : QueueStatsSource(name), m_name(name), m_ovf(ovf), m_disposer(disposer), m_ok(false),
+          m_worker_exited(false), m_worker(false), m_head(0), m_tail(0),
+          m_waiting(false), m_idle(false), m_ctlhead(0), m_ctltail(0),
+          m_ctlfull(false),
+          m_puts(0), m_overruns(0), m_tottasks(0), m_workersleeps(0)
+        {
+            m_capacity = 1;
+            while (m_capacity < capacity)
+                m_capacity <<= 1;
+            m_mask = m_capacity - 1;
+            m_slots = new std::atomic<T>[m_capacity];
+            for (size_t i = 0; i < ctlcapacity; i++) {
+                m_ctlslots[i] = T();
+            }
+            m_stamps = new std::atomic<long long>[m_capacity];
+            m_ok = sem_init(&m_sem, 0, 0) == 0;
+        }
+
+    ~SPSCQueue()
+        {
+            setTerminateAndWait();
+            sem_destroy(&m_sem);
+            delete [] m_slots;
+            delete [] m_stamps;
+        }
+
+    /** Start the consumer thread. There can be only one. */
+    bool start(int nworkers, void *(*workproc)(void *), void *arg)
+        {
+            if (nworkers != 1 || m_worker.load()) {
+                return false;
+            }
+            pthread_t thr;
+            if (pthread_create(&thr, 0, workproc, arg)) {
+                return false;
+            }
+            m_thread = thr;
+            m_worker = true;
+            return true;
+        }
+
+    /** Add item to the ring, called from the producer. Never blocks.
+     *
+     * @return false only if the consumer is gone (the item is then
+     *   still owned by the caller).
+     */
+    bool put(T t)
+        {
+            if (!ok()) {
+                return false;
+            }
+            m_puts.fetch_add(1, std::memory_order_relaxed);
+            size_t head = m_head.load(std::memory_order_relaxed);
+            size_t tail = m_tail.load(std::memory_order_acquire);
+            if (head - tail >= m_capacity) {
+                if (m_ovf == OVF_DROPNEWEST) {
+                    m_overruns.fetch_add(1, std::memory_order_relaxed);
+                    if (m_disposer)
+                        m_disposer(t);
+                    return true;
+                }
+                // Drop oldest. We compete with the consumer for the
+                // tail slot: whoever advances m_tail owns the item.
+                while (head - tail >= m_capacity) {
+                    T old = m_slots[tail & m_mask].load(
+                        std::memory_order_relaxed);
+                    if (m_tail.compare_exchange_weak(tail, tail + 1)) {
+                        m_overruns.fetch_add(1, std::memory_order_relaxed);
+                        if (m_disposer)
+                            m_disposer(old);
+                        break;
+                    }
+                }
+            }
+            m_slots[head & m_mask].store(t, std::memory_order_relaxed);
+            m_stamps[head & m_mask].store(Chrono::monomicros(),
+                                          std::memory_order_relaxed);
+            recordDepth(head + 1 - tail);
+            // seq_cst: must be ordered with the m_waiting read below
+            m_head.store(head + 1);
+            if (m_waiting.exchange(false)) {
+                sem_post(&m_sem);
+            }
+            return true;
+        }
+
+    /** Add control item. Never blocks.
+     *
+     * This can be called from the producer or from any other thread
+     * (e.g. a state callback), without a lock: the slots are reserved
+     * with a CAS on the control head, and an empty (null) slot tells
+     * the consumer that the item is not stored yet.
+     *
+     * The item is taken before the normal items still in the ring
+     * (after the previous control items). Control items are never
+     * dropped: if the control ring is full (the consumer is stuck),
+     * we wait for a slot. This is the only case where the caller
+     * can block.
+     *
+     * @param flush dispose of the items in the ring first.
+     * @return false only if the consumer is gone (the item is then
+     *   still owned by the caller).
+     */
+    bool putControl(T t, bool flush = false)
+        {
+            if (!ok()) {
+                return false;
+            }
+            if (flush) {
+                // Acquire: we may not be the producer thread
+                size_t head = m_head.load(std::memory_order_acquire);
+                size_t tail = m_tail.load(std::memory_order_acquire);
+                // As for drop oldest: whoever advances m_tail owns
+                // the item.
+                while (tail != head) {
+                    T old = m_slots[tail & m_mask].load(
+                        std::memory_order_relaxed);
+                    if (m_tail.compare_exchange_weak(tail, tail + 1)) {
+                        tail++;
+                        if (m_disposer)
+                            m_disposer(old);
+                    }
+                }
+            }
+            size_t head = m_ctlhead.load(std::memory_order_relaxed);
+            for (;;) {
+                if (head - m_ctltail.load(std::memory_order_acquire) >=
+                    ctlcapacity) {
+                    if (!ok()) {
+                        return false;
+                    }
+                    if (!m_ctlfull.exchange(true)) {
+                        LOGERR("SPSCQueue: " << m_name <<
+                               ": control ring full, waiting\n");
+                    }
+                    usleep(1000);
+                    head = m_ctlhead.load(std::memory_order_relaxed);
+                    continue;
+                }
+                // Reserve the slot. On failure, head is reloaded.
+                if (m_ctlhead.compare_exchange_weak(head, head + 1)) {
+                    break;
+                }
+            }
+            m_ctlfull = false;
+            // seq_cst: publishes the item, and must be ordered with
+            // the m_waiting read below
+            m_ctlslots[head % ctlcapacity].store(t);
+            if (m_waiting.exchange(false)) {
+                sem_post(&m_sem);
+            }
+            return true;
+        }
+
+    /** Take item from the ring. Called from the consumer thread.
+     *
+     * Sleeps while the ring is empty. The control items come first.
+     */
+    bool take(T* tp, size_t *szp = 0)
+        {
+            return doTake(tp, szp, 0) == WQ_OK;
+        }
+
+    /** Take item from the ring, sleeping at most until deadline if it
+     *  is empty. */
+    WaitStatus take(T* tp, const struct timespec& deadline, size_t *szp = 0)
+        {
+            return doTake(tp, szp, &deadline);
+        }
+
+    /** Wait until the ring is empty and the consumer is back
+     *  sleeping, so that it is done with all the items put so far.
+     *  Called from the producer side, once it has stopped putting.
+     *  This polls: the consumer does not signal when it goes idle.
+     *  @return false if the consumer is gone. */
+    bool waitIdle()
+        {
+            while (ok()) {
+                if (m_idle && qsize() == 0 &&
+                    m_ctltail.load() == m_ctlhead.load()) {
+                    return true;
+                }
+                usleep(1000);
+            }
+            return false;
+        }
+
+    /** Advertise exit and abort queue. Called from the consumer. */
+    void workerExit()
+        {
+            m_worker_exited = true;
+        }
+
+    /** Tell the consumer to exit, and wait for it. Items still in
+     *  the ring are disposed of. */
+    void* setTerminateAndWait()
+        {
+            if (!m_worker.load()) {
+                return (void*)0;
+            }
+            m_ok = false;
+            sem_post(&m_sem);
+            void *status = 0;
+            pthread_join(m_thread, &status);
+            m_worker = false;
+            T t;
+            long long stamp;
+            while (trypopctl(&t, 0) || trypop(&t, 0, &stamp)) {
+                if (m_disposer)
+                    m_disposer(t);
+            }
+            m_ok = true;
+            m_worker_exited = false;
+            return status;
+        }
+
+    /** Current item count. Approximate by nature if called from
+     *  another thread than the producer or consumer. */
+    size_t qsize()
+        {
+            return m_head.load() - m_tail.load();
+        }
+
+    size_t capacity()
+        {
+            return m_capacity;
+        }
+
+    /** Count of items dropped because the ring was full */
+    unsigned long overruns()
+        {
+            return m_overruns.load(std::memory_order_relaxed);
+        }
+
+    const std::string& name()
+        {
+            return m_name;
+        }
+
+private:
+    virtual void queueStats(WorkQueueStats& st)
+        {
+            // The counters are read from another thread (stats
+            // dump): relaxed atomics, no ordering needed.
+            st.tasks = m_tottasks.load(std::memory_order_relaxed);
+            st.workersleeps = m_workersleeps.load(std::memory_order_relaxed);
+            st.overruns = m_overruns.load(std::memory_order_relaxed);
+            st.depth = qsize();
+        }
+
+    bool ok()
+        {
+            return m_ok && !m_worker_exited;
+        }
+
+    // Common part of the take() variants. deadline is on the
+    // monotonic clock, but sem_timedwait() wants a CLOCK_REALTIME
+    // one: we convert the remaining time.
+    WaitStatus doTake(T* tp, size_t *szp, const struct timespec *deadline)
+        {
+            long long stamp;
+            while (ok()) {
+                if (trypopctl(tp, szp)) {
+                    return WQ_OK;
+                }
+                if (trypop(tp, szp, &stamp)) {
+                    recordResidence(Chrono::monomicros() - stamp);
+                    return WQ_OK;
+                }
+                // Advertise that we are going to sleep, then check
+                // again: the producer may have pushed an item between
+                // the first check and the store. The fence orders the
+                // store before the (acquire) loads of the check, as
+                // the producer does with its seq_cst store of m_head
+                // and the m_waiting exchange. Else, except on x86,
+                // both sides could miss each other.
+                m_waiting = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (trypopctl(tp, szp)) {
+                    m_waiting = false;
+                    return WQ_OK;
+                }
+                if (trypop(tp, szp, &stamp)) {
+                    m_waiting = false;
+                    recordResidence(Chrono::monomicros() - stamp);
+                    return WQ_OK;
+                }
+                long long start = Chrono::monomicros();
+                long long left = 0;
+                if (deadline) {
+                    left = deadline->tv_sec * 1000000LL +
+                        deadline->tv_nsec / 1000 - start;
+                    if (left <= 0) {
+                        // A post from the producer may still come:
+                        // this only causes a spurious wakeup later.
+                        m_waiting = false;
+                        return WQ_TIMEOUT;
+                    }
+                }
+                m_workersleeps.fetch_add(1, std::memory_order_relaxed);
+                m_idle = true;
+                if (deadline) {
+                    struct timespec ts;
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    long long ns = ts.tv_nsec + (left % 1000000) * 1000;
+                    ts.tv_sec += left / 1000000 + ns / 1000000000;
+                    ts.tv_nsec = ns % 1000000000;
+                    // On timeout, we loop to check the ring again
+                    // before returning.
+                    while (sem_timedwait(&m_sem, &ts) != 0 &&
+                           errno == EINTR && ok())
+                        ;
+                } else {
+                    while (sem_wait(&m_sem) != 0 && ok())
+                        ;
+                }
+                m_idle = false;
+                recordTakeWait(Chrono::monomicros() - start);
+            }
+            return WQ_FAILED;
+        }
+
+    bool trypop(T *tp, size_t *szp, long long *stampp)
+        {
+            size_t tail = m_tail.load(std::memory_order_acquire);
+            for (;;) {
+                size_t head = m_head.load(std::memory_order_acquire);
+                if (tail == head) {
+                    return false;
+                }
+                T t = m_slots[tail & m_mask].load(std::memory_order_relaxed);
+                long long stamp =
+                    m_stamps[tail & m_mask].load(std::memory_order_relaxed);
+                // If this fails, the producer dropped the item we
+                // just read and tail was updated: retry.
+                if (m_tail.compare_exchange_weak(tail, tail + 1)) {
+                    m_tottasks.fetch_add(1, std::memory_order_relaxed);
+                    *tp = t;
+                    *stampp = stamp;
+                    if (szp)
+                        *szp = head - tail;
+                    return true;
+                }
+            }
+        }
+
+    // Only the consumer advances m_ctltail, no need for a CAS. A
+    // reserved slot may still be empty: its producer will post the
+    // semaphore once the item is stored.
+    bool trypopctl(T *tp, size_t *szp)
+        {
+            size_t tail = m_ctltail.load(std::memory_order_relaxed);
+            if (tail == m_ctlhead.load(std::memory_order_acquire)) {
+                return false;
+            }
+            std::atomic<T>& slot = m_ctlslots[tail % ctlcapacity];
+            T t = slot.load(std::memory_order_acquire);
+            if (t == T()) {
+                return false;
+            }
+            *tp = t;
+            slot.store(T(), std::memory_order_relaxed);
+            m_ctltail.store(tail + 1, std::memory_order_release);
+            m_tottasks.fetch_add(1, std::memory_order_relaxed);
+            if (szp)
+                *szp = qsize();
+            return true;
+        }
+
+    // Control ring size
+    static const size_t ctlcapacity = 8;
+
+    // Configuration
+    std::string m_name;
+    size_t m_capacity;
+    size_t m_mask;
+    Overflow m_ovf;
+    void (*m_disposer)(T);
+    std::atomic<T> *m_slots;
+    // Queueing time of the items (Chrono::monomicros())
+    std::atomic<long long> *m_stamps;
+
+    // Status
+    std::atomic<bool> m_ok;
+    std::atomic<bool> m_worker_exited;
+    std::atomic<bool> m_worker;
+    pthread_t m_thread;
+    sem_t m_sem;
+
+    // Keep the producer and consumer indexes on separate cache lines
+    // to avoid false sharing.
+    char m_pad0[64];
+    std::atomic<size_t> m_head;
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;
+    char m_pad2[64];
+    std::atomic<bool> m_waiting;
+    // Consumer sleeping on the semaphore (for waitIdle())
+    std::atomic<bool> m_idle;
+
+    // Control ring
+    std::atomic<T> m_ctlslots[ctlcapacity];
+    std::atomic<size_t> m_ctlhead;
+    std::atomic<size_t> m_ctltail;
+    // For logging the full control ring once
+    std::atomic<bool> m_ctlfull;
+
+    // Statistics
+    std::atomic<unsigned long> m_puts;
+    std::atomic<unsigned long> m_overruns;
+    std::atomic<unsigned long> m_tottasks;
+    std::atomic<unsigned long> m_workersleeps;
+};
+
+#endif /* _SPSCQUEUE_H_INCLUDED_ */
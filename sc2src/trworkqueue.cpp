@@ -0,0 +1,229 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+///////////////////// Benchmark: WorkQueue single item vs batched transfers
+// Also checks the control lane first (items overtaking the tasks,
+// waking the waits, flush and termination disposal).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <vector>
+#include <atomic>
+
+#include "workqueue.h"
+#include "chrono.h"
+
+using namespace std;
+
+#ifndef MIN
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+static char *thisprog;
+static void
+Usage(void)
+{
+    fprintf(stderr, "Usage : %s [-p producers] [-n items per producer]\n",
+            thisprog);
+    exit(1);
+}
+
+// Same bound as alsaqueue
+static const size_t qhigh = 100;
+
+static WorkQueue<long> *wq;
+static size_t batch;
+static std::atomic<long long> consumed;
+
+static void *consumer(void *)
+{
+    vector<long> items(batch);
+    for (;;) {
+        if (batch == 1) {
+            if (!wq->take(&items[0])) {
+                break;
+            }
+            consumed++;
+        } else {
+            size_t n = wq->takeUpTo(&items[0], batch);
+            if (n == 0) {
+                break;
+            }
+            consumed += n;
+        }
+    }
+    wq->workerExit();
+    return (void *)1;
+}
+
+static long nitems;
+
+static void *producer(void *)
+{
+    vector<long> items(batch);
+    for (long i = 0; i < nitems; i += batch) {
+        if (batch == 1) {
+            wq->put(i);
+        } else {
+            size_t n = MIN(batch, size_t(nitems - i));
+            for (size_t j = 0; j < n; j++)
+                items[j] = i + j;
+            if (wq->putMany(&items[0], n) != n)
+                break;
+        }
+    }
+    return 0;
+}
+
+// Control lane check. The tasks are positive, the control items
+// negative. The worker wants 10 tasks (lo), so it only wakes up for
+// control items until the end.
+static const size_t ctllow = 10;
+static std::atomic<long> disposedsum;
+static std::atomic<int> disposedcnt;
+static std::atomic<bool> ctlworkdone;
+static std::atomic<bool> ctlexit;
+static long ctltaken[ctllow + 2];
+static size_t ctlntaken;
+static bool ctlwaitok;
+
+static void ctldispose(long v)
+{
+    disposedsum += v;
+    disposedcnt++;
+}
+
+static size_t ctlweight(long)
+{
+    return 1;
+}
+
+static void *ctlworker(void *)
+{
+    // Both waits would block forever without the control items
+    ctlwaitok = wq->waitminsz(1000, wqDeadline(Chrono::monomicros() +
+                                               2000000)) ==
+        WorkQueue<long>::WQ_OK;
+    wq->take(&ctltaken[0]);
+    ctlwaitok = wq->waitminweight(1000) && ctlwaitok;
+    wq->take(&ctltaken[1]);
+    ctlntaken = 2 + wq->takeUpTo(&ctltaken[2], ctllow);
+    ctlworkdone = true;
+    while (!ctlexit)
+        usleep(1000);
+    wq->workerExit();
+    return (void *)1;
+}
+
+static bool ctlcheck()
+{
+    wq = new WorkQueue<long>("trworkqueue", qhigh, ctllow);
+    wq->setWeight(ctlweight, 0);
+    wq->setDisposer(ctldispose);
+    wq->start(1, ctlworker, 0);
+    for (long i = 1; i <= 3; i++)
+        wq->put(i);
+    // Goes ahead of 1, 2, 3
+    wq->putControl(-1);
+    // Discards 1, 2, 3
+    wq->putControl(-2, true);
+    for (long i = 4; i < 4 + long(ctllow); i++)
+        wq->put(i);
+    while (!ctlworkdone)
+        usleep(1000);
+    // Not taken: disposed of on termination
+    wq->putControl(-3);
+    ctlexit = true;
+    wq->setTerminateAndWait();
+    delete wq;
+
+    bool ok = ctlwaitok && ctlntaken == ctllow + 2 &&
+        ctltaken[0] == -1 && ctltaken[1] == -2 && disposedcnt == 4 &&
+        disposedsum == 1 + 2 + 3 - 3;
+    for (size_t i = 2; i < ctlntaken; i++) {
+        if (ctltaken[i] != long(i) + 2)
+            ok = false;
+    }
+    printf("control lane: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    thisprog = argv[0];
+    argc--;
+    argv++;
+
+    int nproducers = 2;
+    nitems = 1000000;
+    while (argc > 0 && **argv == '-') {
+        if (argc < 2)
+            Usage();
+        if (!strcmp(argv[0], "-p")) {
+            nproducers = atoi(argv[1]);
+        } else if (!strcmp(argv[0], "-n")) {
+            nitems = atol(argv[1]);
+        } else {
+            Usage();
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 0 || nproducers <= 0 || nitems <= 0)
+        Usage();
+
+    if (!ctlcheck())
+        return 1;
+
+    const size_t batches[] = {1, 4, 16, 64};
+    double base = 0;
+    for (unsigned int b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        batch = batches[b];
+        consumed = 0;
+        wq = new WorkQueue<long>("trworkqueue", qhigh);
+        long long start = Chrono::monomicros();
+        wq->start(1, consumer, 0);
+        vector<pthread_t> thrs(nproducers);
+        for (int i = 0; i < nproducers; i++) {
+            pthread_create(&thrs[i], 0, producer, 0);
+        }
+        for (int i = 0; i < nproducers; i++) {
+            pthread_join(thrs[i], 0);
+        }
+        wq->waitIdle();
+        long long us = Chrono::monomicros() - start;
+        WorkQueueStats st;
+        wq->getStats(st);
+        wq->setTerminateAndWait();
+        delete wq;
+        double rate = consumed * 1e6 / (us ? us : 1);
+        if (b == 0)
+            base = rate;
+        printf("batch %3u: %d producer(s), %lld items, %8.0f items/S (%.2f)\n",
+               (unsigned int)batch, nproducers, (long long)consumed, rate,
+               base > 0 ? rate / base : 1.0);
+        printf("           peak depth %u, put blocked %lld mS, take waits "
+               "%llu (p99 %lld uS), residence p50 %lld p99 %lld uS\n",
+               (unsigned int)st.peakdepth, st.putblockedus / 1000,
+               st.takewaits, st.takewaitp99, st.residencep50,
+               st.residencep99);
+    }
+    return 0;
+}
@@ -19,20 +19,25 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
 
 #include <string>
 #include <queue>
-#include <unordered_map>
+#include <vector>
 
 #include "ptmutex.h"
-
-/// Store per-worker-thread data. Just an initialized timespec, and
-/// used at the moment.
-class WQTData {
-public:
-    WQTData() {wstart.tv_sec = 0; wstart.tv_nsec = 0;}
-    struct timespec wstart;
-};
+#include "chrono.h"
+#include "wqstats.h"
+
+/// Absolute deadline for the WorkQueue timed waits, from a
+/// CLOCK_MONOTONIC time in microseconds (Chrono::monomicros()).
+inline struct timespec wqDeadline(long long monous)
+{
+    struct timespec ts;
+    ts.tv_sec = monous / 1000000;
+    ts.tv_nsec = (monous % 1000000) * 1000;
+    return ts;
+}
 
 /**
  * A WorkQueue manages the synchronisation around a queue of work items,
@@ -46,9 +51,25 @@ public:
  * the client or worker sets an end condition on the queue. A second
  * queue could conceivably be used for returning individual task
  * status.
+ *
+ * put(), take() and waitminsz() have variants with an absolute
+ * CLOCK_MONOTONIC deadline (see wqDeadline()), so that a thread
+ * can act when nothing happened in time instead of sleeping on.
+ *
+ * Control items (flush, format change...) can be queued on a separate
+ * lane with putControl(). They are taken before the normal tasks,
+ * whatever the low water marks, and are never blocked by a full
+ * queue. Discarded tasks (flush(), putControl() with flush, put() with
+ * flushprevious) are handed to the disposer function, see
+ * setDisposer().
+ *
+ * The queue statistics (see wqstats.h) are registered under the
+ * queue name.
  */
-template <class T> class WorkQueue {
+template <class T> class WorkQueue : public QueueStatsSource {
 public:
+    /** Status for the calls with a deadline */
+    enum WaitStatus {WQ_OK, WQ_TIMEOUT, WQ_FAILED};
 
     /** Create a WorkQueue
      * @param name for message printing
@@ -57,12 +78,19 @@ public:
      * @param lo minimum count of tasks before worker starts. Default 1.
      */
     WorkQueue(const std::string& name, size_t hi = 0, size_t lo = 1)
-        : m_name(name), m_high(hi), m_low(lo),
-          m_workers_exited(0), m_clients_waiting(0), m_workers_waiting(0),
+        : QueueStatsSource(name), m_name(name), m_high(hi), m_low(lo),
+          m_weightf(0), m_hiweight(0), m_loweight(0), m_disposer(0),
+          m_workers_exited(0), m_weight(0), m_clients_waiting(0),
+          m_workers_waiting(0),
           m_tottasks(0), m_nowake(0), m_workersleeps(0), m_clientsleeps(0)
 	{
-            m_ok = (pthread_cond_init(&m_ccond, 0) == 0) &&
-                (pthread_cond_init(&m_wcond, 0) == 0);
+            // The deadlines are on the monotonic clock
+            pthread_condattr_t attr;
+            m_ok = (pthread_condattr_init(&attr) == 0) &&
+                (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0) &&
+                (pthread_cond_init(&m_ccond, &attr) == 0) &&
+                (pthread_cond_init(&m_wcond, &attr) == 0);
+            pthread_condattr_destroy(&attr);
 	}
 
     ~WorkQueue()
@@ -88,7 +116,7 @@ public:
                 if ((err = pthread_create(&thr, 0, workproc, arg))) {
                     return false;
                 }
-                m_worker_threads.insert(std::pair<pthread_t, WQTData>(thr, WQTData()));
+                m_worker_threads.push_back(thr);
             }
             return true;
 	}
@@ -96,36 +124,85 @@ public:
     /** Add item to work queue, called from client.
      *
      * Sleeps if there are already too many.
+     * @param flushprevious discard the queued tasks first.
      */
     bool put(T t, bool flushprevious = false)
+	{
+            return doPut(t, flushprevious, 0) == WQ_OK;
+	}
+
+    /** Add item to work queue, sleeping at most until deadline if
+     *  there are already too many. */
+    WaitStatus put(T t, const struct timespec& deadline)
+	{
+            return doPut(t, false, &deadline);
+	}
+
+    /** Add n items to work queue, called from client.
+     *
+     * Same as put(), but the items are moved under one lock
+     * acquisition, with one wakeup for the workers. If the queue
+     * is bounded and there is not enough room, we queue what fits,
+     * wake up the workers and sleep until we can queue the rest.
+     *
+     * @return the count of items queued, tp[0] to tp[count-1]. This
+     *   is less than n only if the queue was terminated, in which
+     *   case the caller still owns the rest.
+     */
+    size_t putMany(const T *tp, size_t n)
 	{
             PTMutexLocker lock(m_mutex);
             if (!lock.ok() || !ok()) {
-                return false;
+                return 0;
             }
 
-            while (ok() && m_high > 0 && m_queue.size() >= m_high) {
-                m_clientsleeps++;
-                // Keep the order: we test ok() AFTER the sleep...
-                m_clients_waiting++;
-                if (pthread_cond_wait(&m_ccond, lock.getMutex()) || !ok()) {
-                    m_clients_waiting--;
-                    return false;
+            size_t done = 0;
+            while (done < n) {
+                if (waitRoom(lock, 0) != WQ_OK) {
+                    return done;
+                }
+                long long now = Chrono::monomicros();
+                size_t cnt = 0;
+                while (done < n && !full()) {
+                    qpush(tp[done++], now);
+                    cnt++;
+                }
+                if (m_workers_waiting > 1 && cnt > 1) {
+                    pthread_cond_broadcast(&m_wcond);
+                } else if (m_workers_waiting > 0) {
+                    pthread_cond_signal(&m_wcond);
+                } else {
+                    m_nowake++;
                 }
-                m_clients_waiting--;
             }
-            if (flushprevious) {
-                while (!m_queue.empty())
-                    m_queue.pop();
+            return done;
+	}
+
+    /** Add control item, called from client.
+     *
+     * The item goes ahead of the queued tasks (after the previous
+     * control items), and the workers are woken up even if the low
+     * water marks are not reached. Never sleeps: the control lane is
+     * not bounded, it is only meant for rare events.
+     *
+     * @param flush discard the queued tasks first (the tasks already
+     *   taken by the workers are their business).
+     */
+    bool putControl(T t, bool flush = false)
+	{
+            PTMutexLocker lock(m_mutex);
+            if (!lock.ok() || !ok()) {
+                return false;
+            }
+            if (flush) {
+                discard(0);
             }
-            m_queue.push(t);
+            m_ctlqueue.push(t);
             if (m_workers_waiting > 0) {
-                // Just wake one worker, there is only one new task.
                 pthread_cond_signal(&m_wcond);
             } else {
                 m_nowake++;
             }
-
             return true;
 	}
 
@@ -154,7 +231,7 @@ public:
 
             // We're done when the queue is empty AND all workers are back
             // waiting for a task.
-            while (ok() && (m_queue.size() > 0 ||
+            while (ok() && (m_queue.size() > 0 || m_ctlqueue.size() > 0 ||
                             m_workers_waiting != m_worker_threads.size())) {
                 m_clients_waiting++;
                 if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
@@ -172,7 +249,8 @@ public:
     /** Tell the workers to exit, and wait for them.
      *
      * Does not bother about tasks possibly remaining on the queue, so
-     * should be called after waitIdle() for an orderly shutdown.
+     * should be called after waitIdle() for an orderly shutdown. The
+     * control items which were not taken are handed to the disposer.
      */
     void* setTerminateAndWait()
 	{
@@ -198,14 +276,17 @@ public:
             // Perform the thread joins and compute overall status
             // Workers return (void*)1 if ok
             void *statusall = (void*)1;
-            std::unordered_map<pthread_t,  WQTData>::iterator it;
-            while (!m_worker_threads.empty()) {
+            for (size_t i = 0; i < m_worker_threads.size(); i++) {
                 void *status;
-                it = m_worker_threads.begin();
-                pthread_join(it->first, &status);
+                pthread_join(m_worker_threads[i], &status);
                 if (status == (void *)0)
                     statusall = status;
-                m_worker_threads.erase(it);
+            }
+            m_worker_threads.clear();
+            while (!m_ctlqueue.empty()) {
+                if (m_disposer)
+                    m_disposer(m_ctlqueue.front());
+                m_ctlqueue.pop();
             }
 
             // Reset to start state.
@@ -222,58 +303,109 @@ public:
      * queue: client may be waiting for our going idle.
      */
     bool take(T* tp, size_t *szp = 0)
+	{
+            return doTake(tp, szp, 0) == WQ_OK;
+	}
+
+    /** Take task from queue, sleeping at most until deadline if there
+     *  are not enough. */
+    WaitStatus take(T* tp, const struct timespec& deadline, size_t *szp = 0)
+	{
+            return doTake(tp, szp, &deadline);
+	}
+
+
+    /** Take up to n tasks from queue. Called from worker.
+     *
+     * Same as take(), but all the available tasks, up to n, are moved
+     * under one lock acquisition, so that a worker which runs behind
+     * can catch up in one go. Sleeps while there are less than the
+     * low water mark. If there are control items, only these are
+     * returned.
+     *
+     * @param tp array of at least n elements.
+     * @param szp if not null, receives the queue size before the take.
+     * @return the count of tasks taken, 0 if the queue is terminated.
+     */
+    size_t takeUpTo(T* tp, size_t n, size_t *szp = 0)
 	{
             PTMutexLocker lock(m_mutex);
-            if (!lock.ok() || !ok()) {
-                return false;
+            if (!lock.ok() || !ok() || n == 0) {
+                return 0;
             }
 
-            while (ok() && m_queue.size() < m_low) {
-                m_workersleeps++;
-                m_workers_waiting++;
-                if (m_queue.empty())
-                    pthread_cond_broadcast(&m_ccond);
-                if (pthread_cond_wait(&m_wcond, lock.getMutex()) || !ok()) {
-                    m_workers_waiting--;
-                    return false;
-                }
-                m_workers_waiting--;
+            if (waitWork(m_low ? m_low : 1, m_loweight, lock, 0) != WQ_OK) {
+                return 0;
             }
 
-            m_tottasks++;
-            *tp = m_queue.front();
             if (szp)
                 *szp = m_queue.size();
-            m_queue.pop();
-            if (m_clients_waiting > 0) {
-                // No reason to wake up more than one client thread
+            size_t cnt = 0;
+            if (!m_ctlqueue.empty()) {
+                while (cnt < n && !m_ctlqueue.empty()) {
+                    tp[cnt++] = m_ctlqueue.front();
+                    m_ctlqueue.pop();
+                }
+            } else {
+                long long now = Chrono::monomicros();
+                while (cnt < n && !m_queue.empty()) {
+                    tp[cnt++] = qpop(now);
+                }
+            }
+            m_tottasks += cnt;
+            if (m_clients_waiting > 1 && cnt > 1) {
+                pthread_cond_broadcast(&m_ccond);
+            } else if (m_clients_waiting > 0) {
                 pthread_cond_signal(&m_ccond);
             } else {
                 m_nowake++;
             }
-            return true;
+            return cnt;
 	}
     	
+    /** Wait until there are at least sz tasks, or a control
+     *  item. Called from worker. */
     bool waitminsz(size_t sz) {
         PTMutexLocker lock(m_mutex);
         if (!lock.ok() || !ok()) {
             return false;
         }
+        return waitWork(sz, 0, lock, 0) == WQ_OK;
+    }
 
-        while (ok() && m_queue.size() < sz) {
-            m_workersleeps++;
-            m_workers_waiting++;
-            if (m_queue.empty())
-                pthread_cond_broadcast(&m_ccond);
-            if (pthread_cond_wait(&m_wcond, lock.getMutex()) || !ok()) {
-                m_workers_waiting--;
-                return false;
-            }
-            m_workers_waiting--;
+    /** Wait until there are at least sz tasks, a control item, or
+     *  the deadline */
+    WaitStatus waitminsz(size_t sz, const struct timespec& deadline) {
+        PTMutexLocker lock(m_mutex);
+        if (!lock.ok() || !ok()) {
+            return WQ_FAILED;
+        }
+        return waitWork(sz, 0, lock, &deadline);
+    }
+
+    /** Wait until the total weight of the queued tasks is at least
+     *  wsz (see setWeight()), or there is a control item. Called
+     *  from worker. */
+    bool waitminweight(size_t wsz) {
+        PTMutexLocker lock(m_mutex);
+        if (!lock.ok() || !ok()) {
+            return false;
         }
-        return true;
+        return waitWork(1, wsz, lock, 0) == WQ_OK;
     }
 
+    /** Discard the queued tasks (not the control items). Called
+     *  from client.
+     *
+     * The tasks are handed to the disposer parameter if it is set,
+     * else to the queue disposer (see setDisposer()).
+     */
+    void flush(void (*disposer)(T) = 0)
+	{
+            PTMutexLocker lock(m_mutex);
+            discard(disposer);
+	}
+
     /** Advertise exit and abort queue. Called from worker
      *
      * This would happen after an unrecoverable error, or when
@@ -290,6 +422,7 @@ public:
             pthread_cond_broadcast(&m_ccond);
 	}
 
+    /** Count of queued tasks, not including the control items */
     size_t qsize()
 	{
             PTMutexLocker lock(m_mutex);
@@ -297,6 +430,43 @@ public:
             return sz;
 	}
 
+    /** Total weight of the queued tasks. This is the task count if
+     *  no weight function was set. */
+    size_t qweight()
+	{
+            PTMutexLocker lock(m_mutex);
+            return m_weightf ? m_weight : m_queue.size();
+	}
+
+    /** Measure the queue contents with a weight per task (e.g. bytes
+     *  or audio duration) in addition to the task count. Call before
+     *  starting the workers.
+     *
+     * @param weightf returns the weight of a task. It must return the
+     *    same value when the task is queued and taken.
+     * @param hiweight the queue is full when the total weight reaches
+     *    this. 0 for no limit. A task is always accepted by a queue
+     *    which is not full, so the total may exceed hiweight by
+     *    one task.
+     * @param loweight the worker take() calls wait for this total
+     *    weight (in addition to the lo task count).
+     */
+    void setWeight(size_t (*weightf)(T), size_t hiweight, size_t loweight = 0)
+	{
+            PTMutexLocker lock(m_mutex);
+            m_weightf = weightf;
+            m_hiweight = hiweight;
+            m_loweight = loweight;
+	}
+
+    /** Set the function which gets the discarded tasks, e.g. to
+     *  free them. Without one, discarded tasks are just dropped. */
+    void setDisposer(void (*disposer)(T))
+	{
+            PTMutexLocker lock(m_mutex);
+            m_disposer = disposer;
+	}
+
 private:
     bool ok()
 	{
@@ -304,6 +474,192 @@ private:
             return isok;
 	}
 
+    // Wait on cond, with a deadline if it is not null
+    int condwait(pthread_cond_t *cond, PTMutexLocker& lock,
+                 const struct timespec *deadline)
+	{
+            if (deadline)
+                return pthread_cond_timedwait(cond, lock.getMutex(), deadline);
+            return pthread_cond_wait(cond, lock.getMutex());
+	}
+
+    bool full()
+	{
+            return (m_high > 0 && m_queue.size() >= m_high) ||
+                (m_hiweight > 0 && m_weight >= m_hiweight);
+	}
+
+    bool enough(size_t sz, size_t wsz)
+	{
+            return !m_ctlqueue.empty() ||
+                (m_queue.size() >= sz && (wsz == 0 || m_weight >= wsz));
+	}
+
+    // Drop the queued tasks. Called with the lock held.
+    void discard(void (*disposer)(T))
+	{
+            if (disposer == 0)
+                disposer = m_disposer;
+            while (!m_queue.empty()) {
+                T t = qpop(0);
+                if (disposer)
+                    disposer(t);
+            }
+            if (m_clients_waiting > 0) {
+                pthread_cond_broadcast(&m_ccond);
+            }
+	}
+
+    // now is the current Chrono::monomicros() value
+    void qpush(T t, long long now)
+	{
+            if (m_weightf)
+                m_weight += m_weightf(t);
+            m_queue.push(std::pair<T, long long>(t, now));
+            recordDepth(m_queue.size());
+	}
+
+    // now is 0 if the task is discarded, not taken
+    T qpop(long long now)
+	{
+            T t = m_queue.front().first;
+            if (now)
+                recordResidence(now - m_queue.front().second);
+            m_queue.pop();
+            if (m_weightf)
+                m_weight -= m_weightf(t);
+            return t;
+	}
+
+    // Worker side: wait until there are at least sz tasks, and at
+    // least wsz total weight. Called with the lock held.
+    WaitStatus waitWork(size_t sz, size_t wsz, PTMutexLocker& lock,
+                        const struct timespec *deadline)
+	{
+            long long start = 0;
+            WaitStatus st = WQ_OK;
+            while (ok() && !enough(sz, wsz)) {
+                if (start == 0)
+                    start = Chrono::monomicros();
+                m_workersleeps++;
+                m_workers_waiting++;
+                if (m_queue.empty())
+                    pthread_cond_broadcast(&m_ccond);
+                int err = condwait(&m_wcond, lock, deadline);
+                m_workers_waiting--;
+                if (err == ETIMEDOUT) {
+                    if (!ok() || !enough(sz, wsz))
+                        st = WQ_TIMEOUT;
+                    break;
+                }
+                if (err) {
+                    st = WQ_FAILED;
+                    break;
+                }
+            }
+            if (start)
+                recordTakeWait(Chrono::monomicros() - start);
+            if (st == WQ_OK && !ok())
+                st = WQ_FAILED;
+            return st;
+	}
+
+    // Client side: wait until the queue is not full. Called with the
+    // lock held.
+    WaitStatus waitRoom(PTMutexLocker& lock, const struct timespec *deadline)
+	{
+            long long start = 0;
+            WaitStatus st = WQ_OK;
+            while (ok() && full()) {
+                if (start == 0)
+                    start = Chrono::monomicros();
+                m_clientsleeps++;
+                // Keep the order: we test ok() AFTER the sleep...
+                m_clients_waiting++;
+                int err = condwait(&m_ccond, lock, deadline);
+                m_clients_waiting--;
+                if (err == ETIMEDOUT) {
+                    if (!ok() || full())
+                        st = WQ_TIMEOUT;
+                    break;
+                }
+                if (err) {
+                    st = WQ_FAILED;
+                    break;
+                }
+            }
+            if (start)
+                recordPutBlocked(Chrono::monomicros() - start);
+            if (st == WQ_OK && !ok())
+                st = WQ_FAILED;
+            return st;
+	}
+
+    virtual void queueStats(WorkQueueStats& st)
+	{
+            PTMutexLocker lock(m_mutex);
+            st.tasks = m_tottasks;
+            st.nowake = m_nowake;
+            st.workersleeps = m_workersleeps;
+            st.clientsleeps = m_clientsleeps;
+            st.depth = m_queue.size();
+	}
+
+    WaitStatus doPut(T t, bool flushprevious, const struct timespec *deadline)
+	{
+            PTMutexLocker lock(m_mutex);
+            if (!lock.ok() || !ok()) {
+                return WQ_FAILED;
+            }
+
+            WaitStatus st = waitRoom(lock, deadline);
+            if (st != WQ_OK) {
+                return st;
+            }
+            if (flushprevious) {
+                discard(0);
+            }
+            qpush(t, Chrono::monomicros());
+            if (m_workers_waiting > 0) {
+                // Just wake one worker, there is only one new task.
+                pthread_cond_signal(&m_wcond);
+            } else {
+                m_nowake++;
+            }
+
+            return WQ_OK;
+	}
+
+    WaitStatus doTake(T* tp, size_t *szp, const struct timespec *deadline)
+	{
+            PTMutexLocker lock(m_mutex);
+            if (!lock.ok() || !ok()) {
+                return WQ_FAILED;
+            }
+
+            WaitStatus st = waitWork(m_low, m_loweight, lock, deadline);
+            if (st != WQ_OK) {
+                return st;
+            }
+
+            m_tottasks++;
+            if (szp)
+                *szp = m_queue.size();
+            if (!m_ctlqueue.empty()) {
+                *tp = m_ctlqueue.front();
+                m_ctlqueue.pop();
+            } else {
+                *tp = qpop(Chrono::monomicros());
+            }
+            if (m_clients_waiting > 0) {
+                // No reason to wake up more than one client thread
+                pthread_cond_signal(&m_ccond);
+            } else {
+                m_nowake++;
+            }
+            return WQ_OK;
+	}
+
     long long nanodiff(const struct timespec& older,
                        const struct timespec& newer)
 	{
@@ -315,6 +671,12 @@ private:
     std::string m_name;
     size_t m_high;
     size_t m_low;
+    // Optional task weight function and limits, see setWeight()
+    size_t (*m_weightf)(T);
+    size_t m_hiweight;
+    size_t m_loweight;
+    // Optional function for the discarded tasks
+    void (*m_disposer)(T);
 
     // Status
     // Worker threads having called exit
@@ -323,10 +685,15 @@ private:
 
     // Per-thread data. The data is not used currently, this could be
     // a set<pthread_t>
-    std::unordered_map<pthread_t, WQTData> m_worker_threads;
+    std::vector<pthread_t> m_worker_threads;
 
     // Synchronization
-    std::queue<T> m_queue;
+    // The tasks, with their queueing time
+    std::queue<std::pair<T, long long> > m_queue;
+    // Control items, taken before the tasks
+    std::queue<T> m_ctlqueue;
+    // Total weight of the queued tasks
+    size_t m_weight;
     pthread_cond_t m_ccond;
     pthread_cond_t m_wcond;
     PTMutexInit m_mutex;
@@ -0,0 +1,106 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <algorithm>
+
+#include "wqstats.h"
+#include "ptmutex.h"
+#include "log.h"
+
+using namespace std;
+
+// The registry of existing queues. Some queues are static objects:
+// construct on first use, so that it exists before them, and is
+// destroyed after them.
+struct QueueRegistry {
+    PTMutexInit mutex;
+    vector<QueueStatsSource*> queues;
+};
+static QueueRegistry& registry()
+{
+    static QueueRegistry reg;
+    return reg;
+}
+
+QueueStatsSource::QueueStatsSource(const string& name)
+    : m_statsname(name), m_putblockedus(0), m_peakdepth(0)
+{
+    QueueRegistry& reg = registry();
+    PTMutexLocker lock(reg.mutex);
+    reg.queues.push_back(this);
+}
+
+QueueStatsSource::~QueueStatsSource()
+{
+    QueueRegistry& reg = registry();
+    PTMutexLocker lock(reg.mutex);
+    vector<QueueStatsSource*>::iterator it =
+        find(reg.queues.begin(), reg.queues.end(), this);
+    if (it != reg.queues.end())
+        reg.queues.erase(it);
+}
+
+void QueueStatsSource::getStats(WorkQueueStats& st)
+{
+    st = WorkQueueStats();
+    st.name = m_statsname;
+    queueStats(st);
+    st.peakdepth = max(st.depth, m_peakdepth.load());
+    st.putblockedus = m_putblockedus.load();
+    st.takewaits = m_takewait.count();
+    st.takewaitp50 = m_takewait.percentile(50);
+    st.takewaitp99 = m_takewait.percentile(99);
+    st.takewaitmax = m_takewait.max();
+    st.residencep50 = m_residence.percentile(50);
+    st.residencep99 = m_residence.percentile(99);
+    st.residencemax = m_residence.max();
+}
+
+void QueueStatsSource::dumpStats()
+{
+    WorkQueueStats st;
+    getStats(st);
+    LOGINF("Queue " << st.name << ": tasks " << st.tasks << " depth " <<
+           st.depth << " peak " << st.peakdepth << " nowake " << st.nowake <<
+           " workersleeps " << st.workersleeps << " clientsleeps " <<
+           st.clientsleeps << " overruns " << st.overruns <<
+           " put blocked " << st.putblockedus / 1000 << " mS\n");
+    LOGINF("Queue " << st.name << ": take wait: " << m_takewait.summary() <<
+           endl);
+    LOGINF("Queue " << st.name << ": residence: " << m_residence.summary() <<
+           endl);
+}
+
+void workQueueStats(vector<WorkQueueStats>& stats)
+{
+    QueueRegistry& reg = registry();
+    PTMutexLocker lock(reg.mutex);
+    stats.resize(reg.queues.size());
+    for (unsigned int i = 0; i < reg.queues.size(); i++) {
+        reg.queues[i]->getStats(stats[i]);
+    }
+}
+
+void workQueueStatsDump()
+{
+    QueueRegistry& reg = registry();
+    PTMutexLocker lock(reg.mutex);
+    for (unsigned int i = 0; i < reg.queues.size(); i++) {
+        reg.queues[i]->dumpStats();
+    }
+}
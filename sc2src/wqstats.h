@@ -0,0 +1,111 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _WQSTATS_H_INCLUDED_
+#define _WQSTATS_H_INCLUDED_
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "histo.h"
+
+/** Statistics snapshot for one queue (WorkQueue or SPSCQueue) */
+struct WorkQueueStats {
+    WorkQueueStats()
+        : tasks(0), nowake(0), workersleeps(0), clientsleeps(0),
+          overruns(0), depth(0), peakdepth(0), putblockedus(0),
+          takewaits(0), takewaitp50(0), takewaitp99(0), takewaitmax(0),
+          residencep50(0), residencep99(0), residencemax(0) {}
+    std::string name;
+    // Items taken by the workers
+    unsigned long long tasks;
+    // put() or take() calls which did not need to wake the other side
+    unsigned long long nowake;
+    unsigned long long workersleeps;
+    unsigned long long clientsleeps;
+    // Items dropped because the queue was full (SPSCQueue)
+    unsigned long long overruns;
+    // Current and max item count
+    size_t depth;
+    size_t peakdepth;
+    // Total time the clients spent blocked in put()
+    long long putblockedus;
+    // Worker waits for data, when it had to sleep (uS)
+    unsigned long long takewaits;
+    long long takewaitp50;
+    long long takewaitp99;
+    long long takewaitmax;
+    // Item residence time, from put() to take() (uS)
+    long long residencep50;
+    long long residencep99;
+    long long residencemax;
+};
+
+/**
+ * Statistics common to the queue classes. The queues derive from
+ * this, and are registered by name for the dump and snapshot
+ * functions below while they exist.
+ */
+class QueueStatsSource {
+public:
+    QueueStatsSource(const std::string& name);
+    virtual ~QueueStatsSource();
+
+    /** Snapshot of the statistics */
+    void getStats(WorkQueueStats& st);
+
+    /** Log the statistics, with the histograms */
+    void dumpStats();
+
+    const std::string& statsName() {
+        return m_statsname;
+    }
+
+protected:
+    /** Queue-specific part of the snapshot (counters and depth) */
+    virtual void queueStats(WorkQueueStats& st) = 0;
+
+    void recordPutBlocked(long long us) {
+        m_putblockedus.fetch_add(us, std::memory_order_relaxed);
+    }
+    void recordTakeWait(long long us) {
+        m_takewait.record(us);
+    }
+    void recordResidence(long long us) {
+        m_residence.record(us);
+    }
+    void recordDepth(size_t depth) {
+        size_t v = m_peakdepth.load(std::memory_order_relaxed);
+        while (depth > v && !m_peakdepth.compare_exchange_weak(v, depth))
+            ;
+    }
+
+private:
+    std::string m_statsname;
+    std::atomic<long long> m_putblockedus;
+    std::atomic<size_t> m_peakdepth;
+    Histogram m_takewait;
+    Histogram m_residence;
+};
+
+/** Snapshot of all the existing queues statistics */
+extern void workQueueStats(std::vector<WorkQueueStats>& stats);
+
+/** Log the statistics of all the existing queues. Called on SIGUSR1 */
+extern void workQueueStatsDump();
+
+#endif /* _WQSTATS_H_INCLUDED_ */